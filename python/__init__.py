@@ -54,6 +54,89 @@ def find_forcefield(name):
 
 
 ########################## Forcefield classes ##################################
+class ForcefieldContext(object):
+    """A collection of shared parameter tables.
+
+    Every :class:`Forcefield` belongs to one context, and its parameters are
+    rows of that context's tables. The static param table functions of
+    :class:`Forcefield` act on the default context, which holds the tables
+    of all forcefields imported without a context. Parametrizations whose
+    forcefields were imported into different contexts share no tables, so
+    each can be run and cleared independently of the others.
+    """
+
+    @classmethod
+    def _from_boost(cls, _Context):
+        if _Context is None:
+            return None
+        context = cls.__new__(cls)
+        context._Context = _Context
+        return context
+
+    @staticmethod
+    def Default():
+        """The default context of the static param table functions."""
+        return ForcefieldContext._from_boost(_viparr.ForcefieldContext.Default())
+
+    def __init__(self):
+        """Construct with no param tables."""
+        self._Context = _viparr.ForcefieldContext()
+
+    def __eq__(self, other):
+        try:
+            return self._Context == other._Context
+        except AttributeError:
+            return False
+
+    def __ne__(self, other):
+        return not self.__eq__(other)
+
+    def __hash__(self):
+        return self._Context.__hash__()
+
+    def hasParamTable(self, name):
+        """Whether a given param table is in this context.
+
+        Arguments:
+            name -- str
+
+        Returns: bool
+        """
+        return self._Context.hasParamTable(name)
+
+    def paramTable(self, name):
+        """Get a param table of this context by name.
+
+        Arguments:
+            name -- str
+
+        Returns: :class:`msys.ParamTable`
+        """
+        return msys.ParamTable(self._Context.paramTable(name))
+
+    def addParamTable(self, name, table):
+        """Add a param table to this context.
+
+        Arguments:
+            name -- str
+
+            table -- :class:`msys.ParamTable`
+
+        """
+        self._Context.addParamTable(name, table._ptr)
+
+    def allParamTables(self):
+        """List of names of the param tables of this context.
+
+        Returns: [str, ..., str]
+        """
+        return self._Context.allParamTables()
+
+    def clearParamTables(self):
+        """Clear the param tables of this context; invalidates all
+        forcefields of this context."""
+        self._Context.clearParamTables()
+
 class Forcefield(object):
     """Representation of a forcefield directory.
 
@@ -86,6 +169,10 @@ class Forcefield(object):
     merged into this static dictionary using the global :func:`AddSystemTables`
     function.
 
+    The static dictionary is that of the default :class:`ForcefieldContext`.
+    A forcefield imported or constructed with another context has its
+    parameters in that context's tables instead.
+
     The :class:`Forcefield` class also maintains a static registry of supported
     parameter-matching plugins.
     """
@@ -254,7 +341,7 @@ class Forcefield(object):
         del registry[key]
         _viparr.Forcefield.PluginRegistry = registry
 
-    def __init__(self, rules, typer):
+    def __init__(self, rules, typer, context=None):
         """Construct with no param tables and no cmap tables.
 
         Arguments:
@@ -262,8 +349,11 @@ class Forcefield(object):
 
             typer -- :class:`TemplateTyper` or :class:`SmartsTyper` or :class:`ScoredSmartsTyper`
 
+            context -- :class:`ForcefieldContext` or None for the default
+
         """
-        self._Forcefield = _viparr.Forcefield(rules._Rules, typer._Typer)
+        self._Forcefield = _viparr.Forcefield(rules._Rules, typer._Typer,
+                None if context is None else context._Context)
 
     def copy(self):
         """Create a copy of this forcefield.
@@ -289,6 +379,11 @@ class Forcefield(object):
     def __hash__(self):
         return self._Forcefield.__hash__()
 
+    @property
+    def context(self):
+        """The :class:`ForcefieldContext` holding this forcefield's params."""
+        return ForcefieldContext._from_boost(self._Forcefield.context())
+
     @property
     def name(self):
         """The name of the forcefield.
@@ -339,7 +434,7 @@ class Forcefield(object):
         Returns: [:class:`msys.Param`, ..., :class:`msys.Param`]
         """
         rowIDs = self._Forcefield.rowIDs(name)
-        table = Forcefield.ParamTable(name)
+        table = self.context.paramTable(name)
         return [msys.Param(table._ptr, id) for id in rowIDs]
 
     def findParams(self, name, **kwds):
@@ -357,10 +452,10 @@ class Forcefield(object):
         if len(rowIDs) == 0:
             return []
         for k, v in kwds.items():
-            rowIDs = _viparr.Forcefield.FilterParams(name, rowIDs, k, v)
+            rowIDs = self._Forcefield.filterParams(name, rowIDs, k, v)
             if len(rowIDs) == 0:
                 return []
-        table = Forcefield.ParamTable(name)
+        table = self.context.paramTable(name)
         return [msys.Param(table._ptr, id) for id in rowIDs]
 
     def appendParam(self, name, param=None, **kwds):
@@ -379,13 +474,13 @@ class Forcefield(object):
         Returns: msys.Param
         """
         if param is None:
-            if not Forcefield.HasParamTable(name):
-                Forcefield.AddParamTable(name, msys.CreateParamTable())
+            if not self.context.hasParamTable(name):
+                self.context.addParamTable(name, msys.CreateParamTable())
                 for k, v in kwds.items():
-                    Forcefield.ParamTable(name).addProp(k, type(v))
-            param = Forcefield.ParamTable(name).addParam(**kwds)
-        if not Forcefield.HasParamTable(name) or \
-                param._ptr != self.ParamTable(name)._ptr:
+                    self.context.paramTable(name).addProp(k, type(v))
+            param = self.context.paramTable(name).addParam(**kwds)
+        if not self.context.hasParamTable(name) or \
+                param._ptr != self.context.paramTable(name)._ptr:
             raise RuntimeError("Parameter " + repr(param) + \
                     " does not belong to this table")
         self._Forcefield.appendParam(name, param.id)
@@ -410,7 +505,7 @@ class Forcefield(object):
         elif type(params) == msys.Param:
             params = [params]
         for p in params:
-            if p._Ptr != Forcefield.ParamTable(name)._ptr:
+            if p._Ptr != self.context.paramTable(name)._ptr:
                 raise RuntimeError("Parameter " + p.__repr__() + \
                         " does not belong to this table")
         self._Forcefield.delParams(name, [p.id for p in params])
@@ -433,12 +528,12 @@ class Forcefield(object):
 
         Returns: :class:`msys.Param`
         """
-        if old_param._ptr != Forcefield.ParamTable(name)._ptr:
+        if old_param._ptr != self.context.paramTable(name)._ptr:
             raise RuntimeError("Parameter " + old_param.__repr__() + \
                     " does not belong to this table")
         if new_param is None:
-            new_param = Forcefield.ParamTable(name).addParam(**kwds)
-        if new_param._ptr != Forcefield.ParamTable(name)._ptr:
+            new_param = self.context.paramTable(name).addParam(**kwds)
+        if new_param._ptr != self.context.paramTable(name)._ptr:
             raise RuntimeError("Parameter " + new_param.__repr__() + \
                     " does not belong to this table")
         self._Forcefield.replaceParam(name, old_param.id, new_param.id)
@@ -1457,7 +1552,8 @@ class TemplateTyper(object):
         return output
 
 ###################### Import, export, and merge ###############################
-def ImportForcefield(dir, require_rules=True):
+def ImportForcefield(dir, require_rules=True, cache=None, lazy=False,
+        context=None):
     """Import entire forcefield from a forcefield directory.
     
     :class:`Rules` is imported from 'rules' and templates from any files of
@@ -1480,19 +1576,85 @@ def ImportForcefield(dir, require_rules=True):
     as the param file; the static shared param table to which the parameters are
     imported is the table with key being the param file name.
 
+    If cache is given, it is the path of a compiled forcefield for dir (see
+    :func:`ExportCompiledForcefield`). The forcefield is imported from the
+    cache if it is current with the contents of dir; otherwise it is imported
+    from dir and the cache is rewritten.
+
+    If lazy is True, param files and 'cmap' are not read until their
+    parameters or shared param tables are first used, e.g. by a plugin in
+    :func:`ExecuteViparr`, so tables a system never needs are never loaded.
+    Errors in those files are then reported when they are read.  A compiled
+    forcefield holds every param table, so lazy cannot be combined with
+    cache; a ValueError is raised if both are given.
+
+    If context is given, the parameters are imported into the param tables
+    of that :class:`ForcefieldContext` instead of the static dictionary.
+
     Arguments:
         dir -- str
 
         require_rules -- bool
 
+        cache -- str or None
+
+        lazy -- bool
+
+        context -- :class:`ForcefieldContext` or None
+
     Returns: :class:`Forcefield`
 
     Side effect: Modifies the static param table dictionary of the
-        :class:`Forcefield` class
+        :class:`Forcefield` class, or the tables of context
 
     """
+    if cache is not None:
+        if lazy:
+            raise ValueError("ImportForcefield: cache and lazy cannot be "
+                    "combined")
+        return Forcefield._from_boost(_viparr.ImportCachedForcefield(dir,
+            cache, require_rules, {},
+            None if context is None else context._Context))
     return Forcefield._from_boost(_viparr.ImportForcefield(dir, require_rules,
-        {}))
+        {}, lazy, None if context is None else context._Context))
+
+def ImportCompiledForcefield(path, dir, context=None):
+    """Import a forcefield from a compiled forcefield file.
+
+    The result is the same as that of :func:`ImportForcefield` on dir, but
+    the file is memory-mapped and read in one pass without parsing any JSON.
+    Its contents are still copied: param rows are appended to the param
+    tables and templates are rebuilt. An error is raised if the file was not
+    compiled from the current contents of dir.
+
+    Arguments:
+        path -- str, file written by :func:`ExportCompiledForcefield`
+
+        dir -- str, forcefield directory the file was compiled from
+
+        context -- :class:`ForcefieldContext` or None for the default
+
+    Returns: :class:`Forcefield`
+
+    Side effect: Modifies the static param table dictionary of the
+        :class:`Forcefield` class, or the tables of context
+
+    """
+    return Forcefield._from_boost(_viparr.ImportCompiledForcefield(path, dir,
+        {}, None if context is None else context._Context))
+
+def CompiledForcefieldIsCurrent(path, dir):
+    """Whether path is a compiled forcefield that is current with the
+    contents of the forcefield directory dir.
+
+    Arguments:
+        path -- str
+
+        dir -- str
+
+    Returns: bool
+    """
+    return _viparr.CompiledForcefieldIsCurrent(path, dir)
 
 def ImportRules(path):
     """Import a rules file.
@@ -1566,7 +1728,8 @@ def ImportParams(table_name, path, nbfix_identifier=''):
         :class:`Forcefield` class
 
     """
-    rowIDs = _viparr.ImportParams(table_name, path, [], nbfix_identifier)
+    rowIDs = _viparr.ImportParams(table_name, path, [], nbfix_identifier,
+            None)
     table = Forcefield.ParamTable(table_name)
     return [msys.Param(table._ptr, id) for id in rowIDs]
 
@@ -1588,6 +1751,27 @@ def ExportForcefield(ff, dir):
     """
     _viparr.ExportForcefield(ff._Forcefield, dir)
 
+def ExportCompiledForcefield(dir, path, require_rules=True):
+    """Compile a forcefield directory into a single file.
+
+    The file holds the rules, the templates with their graph hashes, the
+    param tables in columnar form, and the cmap tables, and is keyed by a
+    hash of the contents of dir so that :func:`ImportCompiledForcefield`
+    rejects it once dir changes. An existing file at path is replaced.
+
+    Arguments:
+        dir -- str, forcefield directory
+
+        path -- str
+
+        require_rules -- bool
+
+    Side effect: Modifies the static param table dictionary of the
+        :class:`Forcefield` class
+
+    """
+    _viparr.ExportCompiledForcefield(dir, path, require_rules)
+
 def ExportRules(rules, path):
     """Export a :class:`Rules` object to a file.
 
@@ -2370,7 +2554,7 @@ def AddSystemTables(system, table_name_mapping=None):
         :func:`Forcefield.AllParamTables()`
 
     """
-    _viparr.AddSystemTables(system._ptr, {}, table_name_mapping)
+    _viparr.AddSystemTables(system._ptr, {}, table_name_mapping, None)
 
 def ExecuteFFDETypify(ifile, ofile, ffde):
     """Use ff-type-dms to parameterize system
@@ -2385,10 +2569,57 @@ def ExecuteFFDETypify(ifile, ofile, ffde):
     subprocess.run(cmd, check=True)
 
     
+def SetThreads(nthreads):
+    """Set the number of threads used to parametrize systems.
+
+    Parameter matching in the forcefield plugins is split over this many
+    threads; results do not depend on the number of threads. The default
+    is 1.
+
+    Arguments:
+        nthreads -- int
+    """
+    _viparr.SetThreads(nthreads)
+
+def GetThreads():
+    """Return the number of threads set by :func:`SetThreads`."""
+    return _viparr.GetThreads()
+
+def SetProfiling(enable=True):
+    """Enable or disable collection of the profile returned by
+    :func:`GetProfile`. Profiling is off by default.
+
+    Arguments:
+        enable -- bool
+    """
+    _viparr.SetProfiling(enable)
+
+def ResetProfile():
+    """Clear the timers and counters returned by :func:`GetProfile`."""
+    _viparr.ResetProfile()
+
+def GetProfile():
+    """Return the timers and counters collected while profiling was enabled
+    (see :func:`SetProfiling`), accumulated since the last
+    :func:`ResetProfile`.
+
+    Timers cover the phases of :func:`ExecuteViparr` (such as 'fragments',
+    'typing/<forcefield>', 'plugin/<plugin>', 'compile/<plugin>',
+    'constraints' and 'fix_masses'), and counters include fragments,
+    residues, template memo hits ('templates/...'), parameter matcher
+    cache statistics ('matcher/...') and the terms added to each table
+    ('terms/<table>').
+
+    Returns: {'timers': {name: {'seconds': float, 'calls': int}},
+              'counters': {name: int}}
+    """
+    return _viparr.GetProfile()
+
 def ExecuteViparr(system, ffs, atoms=None, rename_atoms=False,
         rename_residues=False, with_constraints=True, fix_masses=True,
         fatal=True, compile_plugins=True, verbose=False, verbose_matching=False,
-        rename_prochiral_atoms=False):
+        rename_prochiral_atoms=False, dedup_fragments=False,
+        incremental=False):
     """Run viparr to parametrize a system using a list of forcefields.
 
     Equivalent to the viparr command-line executable without reorder-ids
@@ -2414,6 +2645,34 @@ def ExecuteViparr(system, ffs, atoms=None, rename_atoms=False,
     the end; to reorder the IDs so that pseudos are next to parents, run
     :func:`ReorderIDs`.
 
+    If 'dedup_fragments' is True, fragments that are identical up to an
+    offset of atom IDs (such as solvent molecules) are matched and
+    parametrized once, and the resulting terms, charges and masses are
+    copied to each identical fragment.  Fragments are identical when
+    pairing their atoms in ID order preserves the elements, formal
+    charges, residue names, and bonds with their orders.  The parametrized
+    system has the same terms, with the same parameters, as without
+    'dedup_fragments', but not in the same order: within each table, the
+    terms of the first fragment of each identical set come first, followed
+    by those of the other fragments of each set in turn.
+
+    If 'incremental' is True, a hash of each parametrized fragment and of
+    the contents of the forcefields is stored in the atom property
+    'viparr_fragment_hash'.  A forcefield imported from a directory is
+    identified by the contents of the files it was imported from, and any
+    other forcefield by its rules, templates and parameters.
+    Selected fragments whose atoms already store the current hash are
+    unchanged since an earlier incremental run with the same forcefields,
+    and keep their existing parameters; only the other fragments are
+    parametrized.  The system must then include its existing terms (it
+    must not be loaded structure-only).  A run without 'incremental' resets
+    the stored hash of the fragments it parametrizes to 0, so that a later
+    incremental run parametrizes them again.
+
+    All forcefields in 'ffs' must belong to the same
+    :class:`ForcefieldContext`; the system's existing tables and the
+    tables built by the plugins are added to that context.
+
     Arguments:
         system -- :class:`msys.System`
 
@@ -2435,13 +2694,17 @@ def ExecuteViparr(system, ffs, atoms=None, rename_atoms=False,
 
         verbose -- bool
 
+        dedup_fragments -- bool
+
+        incremental -- bool
+
     """
     if atoms is None:
         atoms = system.atoms
     _viparr.ExecuteViparr(system._ptr, [ff._Forcefield for ff in ffs],
             [atom.id for atom in atoms], rename_atoms, rename_residues,
             with_constraints, fix_masses, fatal, compile_plugins, verbose, verbose_matching,
-            rename_prochiral_atoms)
+            rename_prochiral_atoms, dedup_fragments, incremental)
 
 class CompilePlugins(object):
     """A collection of plugin compilation functions and helper functions.
@@ -2805,11 +3068,17 @@ def PrintParams(params):
         output += '\n'
     return output
 
-def GetBondsAnglesDihedrals(system):
-    ''' Return bonds, angles and dihedrals deduced from bond topology
+def GetBondsAnglesDihedrals(system, new_atoms=None):
+    ''' Return bonds, angles and dihedrals deduced from bond topology.
+    If 'new_atoms' (a list of msys.Atom or atom IDs) is given, return only
+    the tuples that contain at least one of them, in the same order; the
+    cost is then proportional to the number of those tuples.
     Returns: dict
     '''
-    return _viparr.GetBondsAnglesDihedrals(system._ptr)
+    if new_atoms is None:
+        return _viparr.GetBondsAnglesDihedrals(system._ptr)
+    ids = [a if isinstance(a, int) else a.id for a in new_atoms]
+    return _viparr.GetBondsAnglesDihedrals(system._ptr, ids)
 
 def SystemToDot(system, residue_id = msys.BadId):
     ''' Return dot file representation of system
@@ -17,6 +17,8 @@
 #include "../src/execute_iviparr.hxx"
 #include "../src/util/get_bonds_angles_dihedrals.hxx"
 #include "../src/util/system_to_dot.hxx"
+#include "../src/util/parallel.hxx"
+#include "../src/util/profile.hxx"
 #include <msys/version.hxx>
 
 using namespace pybind11;
@@ -30,25 +32,48 @@ namespace {
 }
 
 
+static IdList filter_params(std::string name, IdList params, std::string key, object value) {
+    if (isinstance<int_>(value)) return Forcefield::FilterParams(name, params, key, value.cast<int>());
+    if (isinstance<float_>(value)) return Forcefield::FilterParams(name, params, key, value.cast<double>());
+    if (isinstance<str>(value)) return Forcefield::FilterParams(name, params, key, value.cast<std::string>());
+    PyErr_SetString(PyExc_ValueError, "value must be int, float or string");
+    throw error_already_set();
+}
+
 static void export_forcefield(module m) {
+    class_<ForcefieldContext, ForcefieldContextPtr>(m, "ForcefieldContext")
+        .def("__eq__", eq<ForcefieldContextPtr>)
+        .def("__ne__", ne<ForcefieldContextPtr>)
+        .def("__hash__", hash<ForcefieldContextPtr>)
+        .def(init(&ForcefieldContext::create))
+        .def_static("Default", &ForcefieldContext::Default)
+        .def("hasParamTable", &ForcefieldContext::hasParamTable)
+        .def("paramTable", &ForcefieldContext::paramTable)
+        .def("addParamTable", &ForcefieldContext::addParamTable)
+        .def("allParamTables", &ForcefieldContext::allParamTables)
+        .def("clearParamTables", &ForcefieldContext::clearParamTables)
+        ;
+
     class_<Forcefield, ForcefieldPtr>(m, "Forcefield")
         .def("__eq__", eq<ForcefieldPtr>)
         .def("__ne__", ne<ForcefieldPtr>)
         .def("__hash__", hash<ForcefieldPtr>)
-        .def(init(&Forcefield::create))
+        .def(init([](RulesPtr rules, TemplateTyperPtr typer,
+                        ForcefieldContextPtr context) {
+            return Forcefield::create(rules, typer, context);
+            }))
         .def_static("ClearPlugins", []() { Forcefield::PluginRegistry().clear(); })
         .def_static("HasParamTable", &Forcefield::HasParamTable)
         .def_static("ParamTable", &Forcefield::ParamTable)
         .def_static("AddParamTable", &Forcefield::AddParamTable)
         .def_static("ClearParamTables", &Forcefield::ClearParamTables)
         .def_static("AllParamTables", &Forcefield::AllParamTables)
-        .def_static("FilterParams", [](std::string name, IdList params, std::string key, object value) {
-            if (isinstance<int_>(value)) return Forcefield::FilterParams(name, params, key, value.cast<int>());
-            if (isinstance<float_>(value)) return Forcefield::FilterParams(name, params, key, value.cast<double>());
-            if (isinstance<str>(value)) return Forcefield::FilterParams(name, params, key, value.cast<std::string>());
-            PyErr_SetString(PyExc_ValueError, "value must be int, float or string");
-            throw error_already_set();
+        .def_static("FilterParams", filter_params)
+        .def("filterParams", [](ForcefieldPtr self, std::string name, IdList params, std::string key, object value) {
+            ForcefieldContext::Scope scope(self->context());
+            return filter_params(name, params, key, value);
             })
+        .def("context", &Forcefield::context)
         .def("rules", &Forcefield::rules)
         .def("resetRules", &Forcefield::resetRules)
         .def("typer", &Forcefield::typer)
@@ -153,13 +178,15 @@ static void export_typers(module m) {
         .def("btype", &TemplatedSystem::btype)
         .def("nbtype", &TemplatedSystem::nbtype)
         .def("pset", &TemplatedSystem::pset)
-        .def("pseudoBonds", &TemplatedSystem::pseudoBonds)
-        .def("nonPseudoBonds", &TemplatedSystem::nonPseudoBonds)
-        .def("angles", &TemplatedSystem::angles)
-        .def("dihedrals", &TemplatedSystem::dihedrals)
-        .def("exclusions", &TemplatedSystem::exclusions)
-        .def("impropers", &TemplatedSystem::impropers)
-        .def("cmaps", &TemplatedSystem::cmaps)
+        /* Tuples are stored flat; return copies as lists of id lists */
+        .def("typedAtoms", [](TemplatedSystem& s) { return s.typedAtoms().lists(); })
+        .def("pseudoBonds", [](TemplatedSystem& s) { return s.pseudoBonds().lists(); })
+        .def("nonPseudoBonds", [](TemplatedSystem& s) { return s.nonPseudoBonds().lists(); })
+        .def("angles", [](TemplatedSystem& s) { return s.angles().lists(); })
+        .def("dihedrals", [](TemplatedSystem& s) { return s.dihedrals().lists(); })
+        .def("exclusions", [](TemplatedSystem& s) { return s.exclusions().lists(); })
+        .def("impropers", [](TemplatedSystem& s) { return s.impropers().lists(); })
+        .def("cmaps", [](TemplatedSystem& s) { return s.cmaps().lists(); })
         .def("setTypes", &TemplatedSystem::setTypes)
         .def("addTypedAtom", &TemplatedSystem::addTypedAtom)
         .def("addNonPseudoBond", &TemplatedSystem::addNonPseudoBond)
@@ -183,12 +210,36 @@ PYBIND11_MODULE(_viparr, m) {
     m.add_object("msys_version", str(MSYS_VERSION));
     m.def("BuildConstraints", BuildConstraints);
     m.def("AddSystemTables", AddSystemTables);
-    m.def("ExecuteViparr", ExecuteViparr);
+    m.def("ExecuteViparr", ExecuteViparr,
+          call_guard<gil_scoped_release>());
     m.def("ExecuteIviparr", ExecuteIviparr);
     m.def("FixMasses", FixMasses);
     m.def("FixProchiralProteinAtomNames", FixProchiralProteinAtomNames);
     m.def("ReorderIDs", ReorderIDs);
-    m.def("ImportForcefield", ImportForcefield);
+    m.def("SetThreads", ViparrSetThreads);
+    m.def("GetThreads", ViparrThreads);
+    m.def("SetProfiling", ViparrSetProfiling);
+    m.def("ResetProfile", ViparrResetProfile);
+    m.def("GetProfile", []() {
+        dict timers;
+        for (const auto& timer : ViparrProfileTimers()) {
+            dict t;
+            t["seconds"] = timer.second.seconds;
+            t["calls"] = timer.second.calls;
+            timers[str(timer.first)] = t;
+        }
+        dict d;
+        d["timers"] = timers;
+        d["counters"] = cast(ViparrProfileCounters());
+        return d;
+        });
+    m.def("ImportForcefield", ImportForcefield,
+          call_guard<gil_scoped_release>());
+    m.def("ImportCompiledForcefield", ImportCompiledForcefield,
+          call_guard<gil_scoped_release>());
+    m.def("ImportCachedForcefield", ImportCachedForcefield,
+          call_guard<gil_scoped_release>());
+    m.def("CompiledForcefieldIsCurrent", CompiledForcefieldIsCurrent);
     m.def("MergeForcefields", MergeForcefields);
     m.def("MergeRules", MergeRules);
     m.def("MergeTemplates", MergeTemplates);
@@ -198,6 +249,7 @@ PYBIND11_MODULE(_viparr, m) {
     m.def("ImportCmap", ImportCmap);
     m.def("ImportParams", ImportParams);
     m.def("ExportForcefield", ExportForcefield);
+    m.def("ExportCompiledForcefield", ExportCompiledForcefield);
     m.def("ExportRules", ExportRules);
     m.def("ExportTemplates", ExportTemplates);
     m.def("ExportCmap", ExportCmap);
@@ -215,6 +267,19 @@ PYBIND11_MODULE(_viparr, m) {
         d["dihedrals"] = cast(dihedrals);
         return d;
         });
+    m.def("GetBondsAnglesDihedrals", [](SystemPtr mol, const IdList& new_atoms) {
+        std::vector<IdList> non_pseudo_bonds;
+        std::vector<IdList> pseudo_bonds;
+        std::vector<IdList> angles;
+        std::vector<IdList> dihedrals;
+        GetBondsAnglesDihedrals(mol, mol->atoms(), new_atoms, non_pseudo_bonds, pseudo_bonds, angles, dihedrals);
+        dict d;
+        d["non_pseudo_bonds"] = cast(non_pseudo_bonds);
+        d["pseudo_bonds"] = cast(pseudo_bonds);
+        d["angles"] = cast(angles);
+        d["dihedrals"] = cast(dihedrals);
+        return d;
+        });
     m.def("SystemToDot", [](SystemPtr mol, Id residue_id) {
         std::stringstream ss;
         SystemToDot(mol, ss, residue_id);
@@ -8,7 +8,11 @@ using namespace desres::viparr;
 
 void desres::viparr::AddSystemTables(msys::SystemPtr sys,
         const std::map<std::string, std::list<msys::Id> >& share_params,
-        const std::map<std::string, std::string>& name_conversions) {
+        const std::map<std::string, std::string>& name_conversions,
+        ForcefieldContextPtr context) {
+
+    if (!context)
+        context = ForcefieldContext::Current();
 
     std::vector<std::string> tables = sys->tableNames();
     for (unsigned i = 0; i < tables.size(); ++i) {
@@ -29,16 +33,16 @@ void desres::viparr::AddSystemTables(msys::SystemPtr sys,
 
         msys::IdList rowIDs;
         msys::IdList new_param_ids;
-        if (!Forcefield::HasParamTable(name) || term_table->params()
-                != Forcefield::ParamTable(name)) {
+        if (!context->hasParamTable(name) || term_table->params()
+                != context->paramTable(name)) {
             /* Append parameters of system to global table */
             std::map<std::string, std::list<msys::Id> >::const_iterator
                 share_iter = share_params.find(name);
             if (share_iter == share_params.end())
-                rowIDs = append_params::AppendParams<msys::IdList>(
+                rowIDs = append_params::AppendParams<msys::IdList>(context,
                         term_table->params(), name);
             else
-                rowIDs = append_params::AppendParams<msys::IdList>(
+                rowIDs = append_params::AppendParams<msys::IdList>(context,
                         term_table->params(), name, share_iter->second);
             /* Get new term table param IDs */
             new_param_ids = msys::IdList(term_table->maxTermId(), msys::BadId);
@@ -59,18 +63,18 @@ void desres::viparr::AddSystemTables(msys::SystemPtr sys,
         msys::IdList new_override_params;
         if (term_table->overrides()->count() > 0 &&
                 (new_param_ids.size() > 0 ||
-                 !Forcefield::HasParamTable(overrides_name) ||
+                 !context->hasParamTable(overrides_name) ||
                  term_table->overrides()->params()
-                 != Forcefield::ParamTable(overrides_name))) {
+                 != context->paramTable(overrides_name))) {
             /* Append parameters of system's override table to global table */
             msys::IdList or_rowIDs;
             std::map<std::string, std::list<msys::Id> >::const_iterator
                 share_iter = share_params.find(overrides_name);
             if (share_iter == share_params.end())
-                or_rowIDs = append_params::AppendParams<msys::IdList>(
+                or_rowIDs = append_params::AppendParams<msys::IdList>(context,
                         term_table->overrides()->params(), overrides_name);
             else
-                or_rowIDs = append_params::AppendParams<msys::IdList>(
+                or_rowIDs = append_params::AppendParams<msys::IdList>(context,
                         term_table->overrides()->params(), overrides_name,
                         share_iter->second);
             /* Get new override param and pair IDs */
@@ -88,13 +92,13 @@ void desres::viparr::AddSystemTables(msys::SystemPtr sys,
 
         /* Reset term table params and overrides */
         if (new_param_ids.size() > 0) {
-            term_table->resetParams(Forcefield::ParamTable(name));
+            term_table->resetParams(context->paramTable(name));
             for (unsigned j = 0; j < terms.size(); ++j)
                 term_table->setParam(terms[j], new_param_ids[terms[j]]);
         }
         if (new_override_pairs.size() > 0) {
             term_table->overrides()->resetParams(
-                    Forcefield::ParamTable(overrides_name));
+                    context->paramTable(overrides_name));
             for (unsigned j = 0; j < new_override_pairs.size(); ++j)
                 term_table->overrides()->set(new_override_pairs[j],
                         new_override_params[j]);
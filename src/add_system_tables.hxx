@@ -1,6 +1,7 @@
 #ifndef desres_viparr_add_system_tables_hxx
 #define desres_viparr_add_system_tables_hxx
 
+#include "ff.hxx"
 #include <msys/system.hxx>
 #include <list>
 
@@ -15,12 +16,14 @@ namespace desres { namespace viparr {
      * and point term tables in the system to the static Forcefield tables.
      * Parameter tables in the system are merged into the Forcefield tables of
      * the same name, with the exceptions of the replacements specified by
-     * name_conversions. */
+     * name_conversions. The tables are those of context, or of
+     * ForcefieldContext::Current() if context is null. */
     void AddSystemTables(msys::SystemPtr sys,
             const std::map<std::string, std::list<msys::Id> >&
             share_params=std::map<std::string, std::list<msys::Id> >(),
             const std::map<std::string, std::string>& name_conversions
-            =DefaultTableNameConversions);
+            =DefaultTableNameConversions,
+            ForcefieldContextPtr context=ForcefieldContextPtr());
 
 }}
 
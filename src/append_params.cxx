@@ -2,6 +2,36 @@
 
 using namespace desres;
 
+namespace {
+    inline uint64_t HashWord(uint64_t h, uint64_t word) {
+        h = (h ^ word) * 0xff51afd7ed558ccdULL;
+        return h ^ (h >> 32);
+    }
+
+    /* Hash a value so that values equal under ValueRef::compare hash
+     * equally; unset strings hash as the empty string */
+    uint64_t HashValue(uint64_t h, const msys::ValueRef& val) {
+        switch (val.type()) {
+            case msys::IntType:
+                return HashWord(h, val.asInt());
+            case msys::FloatType: {
+                double f = val.asFloat();
+                if (f == 0) f = 0; /* -0.0 == 0.0 */
+                uint64_t bits;
+                memcpy(&bits, &f, sizeof(bits));
+                return HashWord(h, bits);
+            }
+            default: {
+                const char* s = val.c_str();
+                size_t n = 0;
+                for (; s && s[n]; ++n)
+                    h = HashWord(h, (unsigned char)s[n]);
+                return HashWord(h, n);
+            }
+        }
+    }
+}
+
 /* Compare two parameters, possibly from different tables dest and src,
  * lexicographically in the order of properties in dest. dest must contain
  * the properties of src as a subset; any additional properties are assumed
@@ -60,3 +90,25 @@ bool desres::viparr::append_params::ParamComparator::operator() (
         return false; // pi == pj
     }
 }
+
+desres::viparr::append_params::ParamHasher::ParamHasher(
+        msys::ParamTablePtr dest, msys::ParamTablePtr src, const msys::IdList&
+        dest_to_src) : _dest(dest), _src(src), _d2s(dest_to_src)
+{}
+
+uint64_t desres::viparr::append_params::ParamHasher::operator() (
+        const ParamToken& p) const {
+    msys::Value _empty_val; _empty_val.s=nullptr;
+    uint64_t h = 0x9e3779b97f4a7c15ULL;
+    for (unsigned i = 0; i < _d2s.size(); ++i) {
+        if (p.first)
+            h = HashValue(h, _dest->value(p.second, i));
+        else if (_d2s[i] != msys::BadId)
+            h = HashValue(h, _src->value(p.second, _d2s[i]));
+        else {
+            /* Missing from src; compared as the empty value */
+            h = HashValue(h, msys::ValueRef(_dest->propType(i), _empty_val));
+        }
+    }
+    return h;
+}
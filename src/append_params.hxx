@@ -3,6 +3,8 @@
 
 #include "ff.hxx"
 #include <msys/system.hxx>
+#include <stdint.h>
+#include <unordered_map>
 
 namespace desres { namespace viparr { namespace append_params {
 
@@ -14,18 +16,34 @@ namespace desres { namespace viparr { namespace append_params {
         ParamComparator(msys::ParamTablePtr dest, msys::ParamTablePtr src,
                 const msys::IdList& dest_to_src);
         bool operator()(const ParamToken& pi, const ParamToken& pj) const;
+        bool equal(const ParamToken& pi, const ParamToken& pj) const {
+            return !(*this)(pi, pj) && !(*this)(pj, pi);
+        }
     };
 
-    /* Helper function to append parameters from a param table to a static
-     * Forcefield table */
+    /* 64-bit digest of a parameter's values in the order of properties in
+     * dest, such that parameters equal under ParamComparator have equal
+     * digests; the tables are as for ParamComparator */
+    struct ParamHasher {
+        msys::ParamTablePtr _dest;
+        msys::ParamTablePtr _src;
+        const msys::IdList& _d2s;
+        ParamHasher(msys::ParamTablePtr dest, msys::ParamTablePtr src,
+                const msys::IdList& dest_to_src);
+        uint64_t operator()(const ParamToken& p) const;
+    };
+
+    /* Helper function to append parameters from a param table to a shared
+     * param table of context */
     template <class Container>
-    Container AppendParams(msys::ParamTablePtr src_table,
+    Container AppendParams(ForcefieldContextPtr context,
+            msys::ParamTablePtr src_table,
             const std::string& dest_table_name,
             const std::list<msys::Id>& share_params=std::list<msys::Id>()) {
         /* If the param table is already a global param table, do
          * nothing */
-        if (Forcefield::HasParamTable(dest_table_name) && src_table
-                == Forcefield::ParamTable(dest_table_name)) {
+        if (context->hasParamTable(dest_table_name) && src_table
+                == context->paramTable(dest_table_name)) {
             msys::IdList params = src_table->params();
             return Container(params.begin(), params.end());
         }
@@ -33,15 +51,15 @@ namespace desres { namespace viparr { namespace append_params {
         /* Add new global param table, or check for consistency of columns */
         msys::ParamTablePtr ptable;
         msys::IdList prop_map;
-        if (!Forcefield::HasParamTable(dest_table_name)) {
+        if (!context->hasParamTable(dest_table_name)) {
             ptable = msys::ParamTable::create();
             for (unsigned j = 0; j < src_table->propCount(); ++j) {
                 ptable->addProp(src_table->propName(j), src_table->propType(j));
                 prop_map.push_back(j);
             }
-            Forcefield::AddParamTable(dest_table_name, ptable);
+            context->addParamTable(dest_table_name, ptable);
         } else {
-            ptable = Forcefield::ParamTable(dest_table_name);
+            ptable = context->paramTable(dest_table_name);
             for (unsigned j = 0; j < ptable->propCount(); ++j) {
                 msys::Id index = src_table->propIndex(ptable->propName(j));
                 if (index == msys::BadId) {
@@ -65,20 +83,38 @@ namespace desres { namespace viparr { namespace append_params {
             }
         }
 
-        typedef std::map<ParamToken, msys::Id, ParamComparator> ParamMap;
+        /* Cache of unique dest rows by digest; rows with equal digests
+         * are told apart with the comparator */
+        typedef std::unordered_multimap<uint64_t, msys::Id> ParamMap;
         ParamComparator comp(ptable, src_table, prop_map);
-        ParamMap cache(comp);
+        ParamHasher hasher(ptable, src_table, prop_map);
+        ParamMap cache;
+        auto find = [&](const ParamToken& p, uint64_t hash)
+                -> ParamMap::iterator {
+            std::pair<ParamMap::iterator, ParamMap::iterator> range
+                = cache.equal_range(hash);
+            for (ParamMap::iterator iter = range.first;
+                    iter != range.second; ++iter)
+                if (comp.equal(ParamToken(true, iter->second), p))
+                    return iter;
+            return cache.end();
+        };
         /* Loop through dest params and cache unique rows */
+        if (share_params.size() > 0)
+            cache.reserve(share_params.size() + src_table->paramCount());
         for (msys::Id param : share_params) {
-            if (cache.find(ParamToken(true,param)) == cache.end())
-                cache.insert(std::make_pair(ParamToken(true,param), param));
+            uint64_t hash = hasher(ParamToken(true, param));
+            if (find(ParamToken(true, param), hash) == cache.end())
+                cache.insert(std::make_pair(hash, param));
         }
 
         /* Merge param table rows */
         Container rows;
         for (unsigned j = 0; j < src_table->paramCount(); ++j) {
+            uint64_t hash = 0;
             if (share_params.size() > 0) {
-                ParamMap::iterator iter = cache.find(ParamToken(false,j));
+                hash = hasher(ParamToken(false, j));
+                ParamMap::iterator iter = find(ParamToken(false, j), hash);
                 if (iter != cache.end()) {
                     rows.push_back(iter->second);
                     continue;
@@ -92,10 +128,8 @@ namespace desres { namespace viparr { namespace append_params {
                 }
             }
             rows.push_back(paramid);
-            if (share_params.size() > 0) {
-                cache.insert(std::make_pair(ParamToken(true, paramid),
-                            paramid));
-            }
+            if (share_params.size() > 0)
+                cache.insert(std::make_pair(hash, paramid));
         }
         return rows;
     }
@@ -0,0 +1,173 @@
+#include "apply_plugins.hxx"
+#include "util/parallel.hxx"
+#include "util/profile.hxx"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace {
+    std::mutex& PluginTableMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+
+    bool SharesTable(const desres::viparr::Forcefield::Plugin& a,
+            const desres::viparr::Forcefield::Plugin& b) {
+        for (unsigned i = 0; i < a.tables.size(); ++i)
+            if (std::find(b.tables.begin(), b.tables.end(), a.tables[i])
+                    != b.tables.end())
+                return true;
+        return false;
+    }
+}
+
+namespace desres { namespace viparr {
+
+    msys::TermTablePtr AddPluginTable(TemplatedSystemPtr sys,
+            const std::string& name, unsigned natoms,
+            msys::ParamTablePtr params) {
+        std::lock_guard<std::mutex> lock(PluginTableMutex());
+        return sys->system()->addTable(name, natoms, params);
+    }
+
+    std::vector<std::pair<std::string, double> >
+    ApplyPlugins(TemplatedSystemPtr sys, ForcefieldPtr ff, bool verbose) {
+
+        const std::vector<std::string>& names = ff->rules()->plugins;
+        unsigned nplugins = names.size();
+        std::vector<Forcefield::PluginPtr> plugins(nplugins);
+        for (unsigned i = 0; i < nplugins; ++i) {
+            std::map<std::string, Forcefield::PluginPtr>::const_iterator
+              iter = Forcefield::PluginRegistry().find(names[i]);
+            if (iter == Forcefield::PluginRegistry().end())
+                VIPARR_FAIL("Unsupported plugin: " + names[i]);
+            plugins[i] = iter->second;
+        }
+
+        /* Build the DAG: waits[j] counts the earlier plugins that plugin j
+         * must wait for, and next[i] lists the later plugins waiting for
+         * plugin i */
+        std::vector<unsigned> waits(nplugins, 0);
+        std::vector<std::vector<unsigned> > next(nplugins);
+        for (unsigned j = 0; j < nplugins; ++j) {
+            const Forcefield::Plugin& plugin = *plugins[j];
+            for (const std::string& prereq : plugin.prerequisites) {
+                /* Fail if a prerequisite plugin is in the forcefield but
+                 * after this plugin */
+                std::vector<std::string>::const_iterator iter
+                    = std::find(names.begin(), names.end(), prereq);
+                if (iter != names.end() && unsigned(iter - names.begin()) > j)
+                    VIPARR_FAIL("Plugin " + prereq +
+                                " must come before plugin " + names[j]);
+            }
+            for (unsigned i = 0; i < j; ++i) {
+                const Forcefield::Plugin& earlier = *plugins[i];
+                if (plugin.tables.empty() || earlier.tables.empty()
+                        || SharesTable(plugin, earlier)
+                        || std::find(plugin.prerequisites.begin(),
+                            plugin.prerequisites.end(), names[i])
+                        != plugin.prerequisites.end()) {
+                    ++waits[j];
+                    next[i].push_back(j);
+                }
+            }
+        }
+
+        std::vector<std::pair<std::string, double> > times(nplugins);
+        std::vector<std::exception_ptr> errors(nplugins);
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::vector<unsigned> ready;
+        for (unsigned i = 0; i < nplugins; ++i)
+            if (waits[i] == 0)
+                ready.push_back(i);
+        unsigned nfinished = 0;
+        bool failed = false;
+
+        /* A plugin runs alone if it waits for all earlier plugins and all
+         * later plugins wait for it. Parallel loops within plugins that
+         * may run concurrently run serially in the plugin's worker, so
+         * that at most ViparrThreads() threads run; plugins that run
+         * alone use all threads. If all plugins run alone, they run in
+         * this thread. */
+        std::vector<char> alone(nplugins);
+        bool concurrent = false;
+        for (unsigned i = 0; i < nplugins; ++i) {
+            alone[i] = waits[i] == i && next[i].size() == nplugins - 1 - i;
+            if (!alone[i])
+                concurrent = true;
+        }
+        unsigned nthreads = concurrent
+            ? std::min(ViparrThreads(), nplugins) : 1;
+
+        /* Each worker repeatedly takes the earliest ready plugin, applies
+         * it, and releases the plugins waiting for it. After a failure no
+         * new plugins are started. */
+        auto worker = [&]() {
+            /* For plugins that use the static table functions */
+            ForcefieldContext::Scope scope(ff->context());
+            std::unique_lock<std::mutex> lock(mutex);
+            for (;;) {
+                cond.wait(lock, [&]() {
+                        return !ready.empty() || failed
+                            || nfinished == nplugins; });
+                if (failed || nfinished == nplugins)
+                    return;
+                std::vector<unsigned>::iterator first
+                    = std::min_element(ready.begin(), ready.end());
+                unsigned i = *first;
+                ready.erase(first);
+                if (verbose)
+                    VIPARR_OUT << "    " << names[i] << std::endl;
+                lock.unlock();
+
+                std::chrono::steady_clock::time_point start
+                    = std::chrono::steady_clock::now();
+                try {
+                    std::unique_ptr<ViparrSerialScope> serial;
+                    if (!alone[i])
+                        serial.reset(new ViparrSerialScope);
+                    plugins[i]->match(sys, ff);
+                } catch (...) {
+                    errors[i] = std::current_exception();
+                }
+                std::chrono::duration<double> elapsed
+                    = std::chrono::steady_clock::now() - start;
+
+                lock.lock();
+                times[i] = std::make_pair(names[i], elapsed.count());
+                ++nfinished;
+                if (errors[i])
+                    failed = true;
+                for (unsigned j : next[i])
+                    if (--waits[j] == 0)
+                        ready.push_back(j);
+                cond.notify_all();
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned t = 1; t < nthreads; ++t)
+            threads.push_back(std::thread(worker));
+        worker();
+        for (unsigned t = 0; t < threads.size(); ++t)
+            threads[t].join();
+        for (unsigned i = 0; i < nplugins; ++i)
+            if (errors[i])
+                std::rethrow_exception(errors[i]);
+        for (unsigned i = 0; i < nplugins; ++i)
+            ViparrProfileTime("plugin/" + names[i], times[i].second);
+
+        if (verbose) {
+            VIPARR_OUT << "  Plugin wall times:" << std::endl;
+            for (unsigned i = 0; i < nplugins; ++i)
+                VIPARR_OUT << "    " << times[i].first << ": "
+                    << times[i].second << " s" << std::endl;
+        }
+        return times;
+    }
+}}
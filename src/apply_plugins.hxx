@@ -0,0 +1,46 @@
+#ifndef desres_viparr_apply_plugins_hxx
+#define desres_viparr_apply_plugins_hxx
+
+#include "ff.hxx"
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace desres { namespace viparr {
+
+    /* Applies the plugins listed in ff->rules()->plugins to a system. Fails
+     * if a plugin is not registered, or is listed before one of its
+     * prerequisites.
+     *
+     * With ViparrThreads() > 1, plugins run concurrently where the order
+     * of the plugin list does not matter. A plugin waits for every earlier
+     * plugin in the list that:
+     *   - is one of its prerequisites,
+     *   - writes one of the same term tables, or
+     *   - does not declare its tables (Forcefield::Plugin::tables).
+     * A plugin that does not declare its tables also waits for all earlier
+     * plugins, so it runs alone. Each term table is therefore written by
+     * its plugins in list order, as in a serial run. If plugins fail, the
+     * error of the earliest failing plugin in the list is rethrown after
+     * all running plugins finish. Parallel loops within plugins that may
+     * run concurrently run serially (see ViparrSerialScope), so no more
+     * than ViparrThreads() threads are started; plugins that run alone
+     * use all threads.
+     *
+     * Returns the name and wall time in seconds of each plugin, in list
+     * order; if verbose, also prints them. */
+    std::vector<std::pair<std::string, double> >
+    ApplyPlugins(TemplatedSystemPtr sys, ForcefieldPtr ff, bool verbose);
+
+    /* Adds a term table to the system, or returns the existing table with
+     * that name, while holding a process-wide lock shared by all plugins
+     * of all parametrizations; it is held only while the table is looked
+     * up or added. Plugins that declare their tables must create them
+     * with this function. */
+    msys::TermTablePtr AddPluginTable(TemplatedSystemPtr sys,
+            const std::string& name, unsigned natoms,
+            msys::ParamTablePtr params);
+
+}}
+
+#endif
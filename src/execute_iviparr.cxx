@@ -375,7 +375,7 @@ void check_template(TemplatedSystemPtr tsys, const IdList& atoms,
         VIPARR_FAIL(msg.str());
     }
     for (unsigned i = 0; i < tpl->impropers().size(); ++i)
-        if (impropers.find(tpl->impropers()[i]) == impropers.end()) {
+        if (impropers.find(tpl->impropers()[i].list()) == impropers.end()) {
             msg << "impropers";
             VIPARR_FAIL(msg.str());
         }
@@ -399,7 +399,7 @@ void check_template(TemplatedSystemPtr tsys, const IdList& atoms,
         VIPARR_FAIL(msg.str());
     }
     for (unsigned i = 0; i < tpl->exclusions().size(); ++i) {
-        IdList excl = tpl->exclusions()[i];
+        IdList excl = tpl->exclusions()[i].list();
         if (exclusions.find(excl) == exclusions.end()) {
             std::reverse(excl.begin(), excl.end());
             if (exclusions.find(excl) == exclusions.end()) {
@@ -429,7 +429,7 @@ void check_template(TemplatedSystemPtr tsys, const IdList& atoms,
         VIPARR_FAIL(msg.str());
     }
     for (unsigned i = 0; i < tpl->cmaps().size(); ++i) {
-        IdList cmap = tpl->cmaps()[i];
+        IdList cmap = tpl->cmaps()[i].list();
         if (cmaps.find(cmap) == cmaps.end()) {
             std::reverse(cmap.begin(), cmap.end());
             if (cmaps.find(cmap) == cmaps.end()) {
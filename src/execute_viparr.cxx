@@ -1,10 +1,15 @@
 #include "add_system_tables.hxx"
+#include "apply_plugins.hxx"
 #include "base.hxx"
 #include "execute_viparr.hxx"
+#include "importexport/import_ff.hxx"
 #include "postprocess/build_constraints.hxx"
 #include "postprocess/compile_plugins.hxx"
 #include "postprocess/fix_masses.hxx"
 #include "postprocess/prochirality.hxx"
+#include "util/key_map.hxx"
+#include "util/parallel.hxx"
+#include "util/profile.hxx"
 
 #include <viparr/version.hxx> /* Auto-generated in SConscript */
 
@@ -14,9 +19,11 @@
 #include <msys/override.hxx>
 #include <sstream>
 #include <map>
+#include <unordered_map>
 #include <algorithm>
 
 #include <cstdlib>
+#include <cstring>
 #include <cmath>
 #include <csignal>
 
@@ -24,15 +31,444 @@ namespace desres { namespace viparr {
 
     constexpr double charge_difference_threshold = 0.05;
 
+    namespace {
+
+      typedef std::vector<std::pair<TemplatedSystemPtr, msys::IdList> >
+        MatchList;
+
+      /* Delete the terms of table that have an atom in selected (a bitmap
+       * over atom ids), then the overrides between params that no
+       * remaining term uses. This is one sweep over the table's terms,
+       * instead of an atom search followed by a per-term deletion and a
+       * second sweep to find the used params. */
+      void DelTermsWithAtoms(msys::TermTablePtr table,
+                             const std::vector<bool>& selected) {
+        bool prune = (table->overrides()->count() != 0);
+        std::vector<bool> used;
+        if (prune)
+          used.assign(table->params()->paramCount(), false);
+        unsigned natoms = table->atomCount();
+        for (msys::Id term : table->terms()) {
+          bool touched = false;
+          for (unsigned k = 0; k < natoms && !touched; ++k)
+            touched = selected[table->atom(term, k)];
+          if (touched)
+            table->delTerm(term);
+          else if (prune && table->param(term) != msys::BadId)
+            used[table->param(term)] = true;
+        }
+        if (!prune)
+          return;
+        std::vector<msys::IdPair> overrides = table->overrides()->list();
+        for (const msys::IdPair& pair : overrides) {
+          if (!used[pair.first] && !used[pair.second])
+            table->overrides()->del(pair);
+        }
+      }
+
+      typedef std::vector<std::pair<unsigned, unsigned> > LaterBonds;
+
+      /* Fill later with the position and order of each bond from the atom
+       * at position i of its sorted fragment to a later non-pseudo atom,
+       * in increasing position. Order 0 counts as 1, as ExecuteViparr sets
+       * it before typing. */
+      void GetLaterBonds(msys::SystemPtr sys, msys::Id atom, unsigned i,
+                         const std::vector<unsigned>& atom_pos,
+                         LaterBonds& later) {
+        later.clear();
+        for (msys::Id bond : sys->bondsForAtom(atom)) {
+          const msys::bond_t& bnd = sys->bond(bond);
+          msys::Id nbr = bnd.other(atom);
+          if (sys->atom(nbr).atomic_number != 0 && atom_pos[nbr] > i)
+            later.push_back(std::make_pair(atom_pos[nbr],
+                                           unsigned(std::max(bnd.order, 1))));
+        }
+        std::sort(later.begin(), later.end());
+      }
+
+      /* Write a key for the fragment whose atoms in increasing id order are
+       * sorted: for each atom, its atomic number, formal charge, the name
+       * and relative id of its residue, and the position and order of its
+       * bonds to later atoms. These are the atom and bond fields that
+       * template matching and the plugins read from the input system;
+       * charges and atom names are assigned from the templates. Two
+       * fragments have the same key exactly when pairing their atoms in id
+       * order preserves all of these fields. atom_pos holds the position of
+       * each atom in its sorted fragment. */
+      void FragmentKey(msys::SystemPtr sys, const msys::IdList& sorted,
+                       const std::vector<unsigned>& atom_pos,
+                       KeyMap<unsigned>::Key& key) {
+        key.clear();
+        key.push_back(sorted.size());
+        msys::Id first_res = msys::BadId;
+        for (msys::Id atom : sorted)
+          first_res = std::min(first_res, sys->atom(atom).residue);
+        msys::Id last_res = msys::BadId;
+        TypeId resname = 0;
+        LaterBonds later;
+        for (unsigned i = 0; i < sorted.size(); ++i) {
+          const msys::atom_t& atm = sys->atom(sorted[i]);
+          if (atm.residue != last_res) {
+            last_res = atm.residue;
+            resname = TypeDictionary::Intern(sys->residue(last_res).name);
+          }
+          GetLaterBonds(sys, sorted[i], i, atom_pos, later);
+          key.push_back(atm.atomic_number);
+          key.push_back(atm.formal_charge);
+          key.push_back(atm.residue - first_res);
+          key.push_back(resname);
+          key.push_back(later.size());
+          for (const std::pair<unsigned, unsigned>& bond : later) {
+            key.push_back(bond.first);
+            key.push_back(bond.second);
+          }
+        }
+      }
+
+      /* Atom property recording, for each non-pseudo atom parametrized in
+       * incremental mode, the FragmentHash of its fragment */
+      const char* const FragmentHashProp = "viparr_fragment_hash";
+
+      inline uint64_t HashWord(uint64_t h, uint64_t word) {
+        h = (h ^ word) * 0xff51afd7ed558ccdULL;
+        return h ^ (h >> 32);
+      }
+
+      inline uint64_t HashDouble(uint64_t h, double value) {
+        uint64_t word;
+        memcpy(&word, &value, sizeof(word));
+        return HashWord(h, word);
+      }
+
+      uint64_t HashString(uint64_t h, const std::string& str) {
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= str.size(); i += sizeof(uint64_t)) {
+          uint64_t word;
+          memcpy(&word, str.data() + i, sizeof(word));
+          h = HashWord(h, word);
+        }
+        if (i < str.size()) {
+          uint64_t word = 0;
+          memcpy(&word, str.data() + i, str.size() - i);
+          h = HashWord(h, word);
+        }
+        return HashWord(h, str.size());
+      }
+
+      /* Hash of the given rows of a param table, column by column */
+      template <typename Rows>
+      uint64_t HashParams(uint64_t h, msys::ParamTablePtr table,
+                          const Rows& rows) {
+        h = HashWord(h, rows.size());
+        for (msys::Id col = 0; col < table->propCount(); ++col) {
+          h = HashString(h, table->propName(col));
+          msys::ValueType type = table->propType(col);
+          for (msys::Id row : rows) {
+            if (type == msys::IntType)
+              h = HashWord(h, table->value(row, col).asInt());
+            else if (type == msys::FloatType)
+              h = HashDouble(h, table->value(row, col).asFloat());
+            else
+              h = HashString(h, table->value(row, col).asString());
+          }
+        }
+        return h;
+      }
+
+      /* Hash of what a forcefield parametrizes with: its rules, its
+       * templates with their types and charges, its rows of each param
+       * table, and its cmap tables */
+      uint64_t ForcefieldContentHash(uint64_t h, ForcefieldPtr ff) {
+        RulesPtr rules = ff->rules();
+        for (const std::string& line : rules->info)
+          h = HashString(h, line);
+        h = HashString(h, rules->vdw_func);
+        h = HashString(h, rules->vdw_comb_rule);
+        for (const std::string& plugin : rules->plugins)
+          h = HashString(h, plugin);
+        h = HashWord(h, rules->fatal);
+        h = HashString(h, rules->nbfix_identifier);
+        h = HashWord(h, rules->exclusions());
+        for (unsigned i = 2; i <= rules->exclusions(); ++i) {
+          h = HashDouble(h, rules->es_scale(i));
+          h = HashDouble(h, rules->lj_scale(i));
+        }
+
+        for (TemplatedSystemPtr tpl : ff->typer()->templates()) {
+          msys::SystemPtr tsys = tpl->system();
+          h = HashString(h, tpl->hash());
+          for (msys::Id atom : tsys->atoms()) {
+            h = HashString(h, tsys->atom(atom).name);
+            h = HashDouble(h, tsys->atom(atom).charge);
+            h = HashString(h, tpl->btype(atom));
+            h = HashString(h, tpl->nbtype(atom));
+            h = HashString(h, tpl->pset(atom));
+          }
+        }
+
+        for (const std::string& name : ff->paramTables()) {
+          h = HashString(h, name);
+          h = HashParams(h, ff->context()->paramTable(name),
+                         ff->rowIDs(name));
+        }
+        for (msys::ParamTablePtr cmap : ff->cmapTables())
+          h = HashParams(h, cmap, cmap->params());
+        return h;
+      }
+
+      /* Hash of the contents of the forcefields, identifying the
+       * parameters they assign. A forcefield imported from a directory
+       * (whose name is that directory) is identified by
+       * ForcefieldDirectoryHash, without reading its param tables, so that
+       * a lazily imported forcefield stays unloaded; others are hashed by
+       * ForcefieldContentHash. */
+      uint64_t ForcefieldsHash(const std::vector<ForcefieldPtr>& fflist) {
+        uint64_t h = HashWord(0x9e3779b97f4a7c15ULL, fflist.size());
+        for (ForcefieldPtr ff : fflist) {
+          if (!ff->name.empty() && fs::is_directory(ff->name))
+            h = HashWord(h, ForcefieldDirectoryHash(ff->name));
+          else
+            h = ForcefieldContentHash(h, ff);
+        }
+        return h;
+      }
+
+      /* Hash of the non-pseudo atoms of a fragment and of the forcefields
+       * (ForcefieldsHash) used to parametrize it. It covers the same
+       * atom properties as FragmentKey, but hashes residue names as strings
+       * so that it is stable across runs. On return, sorted holds the
+       * non-pseudo atoms in increasing id order; atom_pos is scratch space
+       * of sys->maxAtomId() elements. */
+      uint64_t FragmentHash(msys::SystemPtr sys, const msys::IdList& frag,
+                            uint64_t ff_hash, msys::IdList& sorted,
+                            std::vector<unsigned>& atom_pos) {
+        sorted.clear();
+        for (msys::Id atom : frag)
+          if (sys->atom(atom).atomic_number != 0)
+            sorted.push_back(atom);
+        std::sort(sorted.begin(), sorted.end());
+        for (unsigned i = 0; i < sorted.size(); ++i)
+          atom_pos[sorted[i]] = i;
+
+        uint64_t h = HashWord(ff_hash, sorted.size());
+        msys::Id first_res = msys::BadId;
+        for (msys::Id atom : sorted)
+          first_res = std::min(first_res, sys->atom(atom).residue);
+        msys::Id last_res = msys::BadId;
+        LaterBonds later;
+        for (unsigned i = 0; i < sorted.size(); ++i) {
+          const msys::atom_t& atm = sys->atom(sorted[i]);
+          if (atm.residue != last_res) {
+            last_res = atm.residue;
+            h = HashString(h, sys->residue(last_res).name);
+          }
+          GetLaterBonds(sys, sorted[i], i, atom_pos, later);
+          h = HashWord(h, atm.atomic_number);
+          h = HashWord(h, uint32_t(atm.formal_charge));
+          h = HashWord(h, atm.residue - first_res);
+          h = HashWord(h, later.size());
+          for (const std::pair<unsigned, unsigned>& bond : later) {
+            h = HashWord(h, bond.first);
+            h = HashWord(h, bond.second);
+          }
+        }
+        return h;
+      }
+
+      /* Return the selected atoms of the fragments that need to be
+       * parametrized in incremental mode: all fragments with a selected
+       * atom, except those whose non-pseudo atoms all record the current
+       * FragmentHash. Those are unchanged since an earlier incremental run
+       * with the same forcefields, and keep their terms. */
+      msys::IdList ChangedAtoms(msys::SystemPtr sys,
+                                const std::vector<msys::IdList>& fragments,
+                                const msys::IdList& atoms,
+                                uint64_t ff_hash) {
+        msys::Id prop = sys->atomPropIndex(FragmentHashProp);
+        if (prop == msys::BadId)
+          return atoms;
+        std::vector<bool> selected(sys->maxAtomId(), false);
+        for (msys::Id atom : atoms)
+          selected[atom] = true;
+        std::vector<unsigned> atom_pos(sys->maxAtomId());
+        msys::IdList sorted;
+        msys::IdList changed;
+        for (const msys::IdList& frag : fragments) {
+          bool any_selected = false;
+          for (msys::Id atom : frag)
+            any_selected = any_selected || selected[atom];
+          if (!any_selected)
+            continue;
+          uint64_t hash = FragmentHash(sys, frag, ff_hash, sorted, atom_pos);
+          bool unchanged = !sorted.empty();
+          for (msys::Id atom : sorted) {
+            if (uint64_t(sys->atomPropValue(atom, prop).asInt()) != hash) {
+              unchanged = false;
+              break;
+            }
+          }
+          if (unchanged)
+            continue;
+          for (msys::Id atom : frag)
+            if (selected[atom])
+              changed.push_back(atom);
+        }
+        return changed;
+      }
+
+      /* Find, for each fragment in frags, the indices in fflist of the
+       * forcefields that have a template with the graph hash of each of its
+       * residues, in order; only these forcefields can match the fragment.
+       * Residues are hashed once, against a single index of the template
+       * hashes of all forcefields. */
+      void DispatchFragments(msys::SystemPtr sys,
+                             const std::vector<ForcefieldPtr>& fflist,
+                             const std::vector<msys::IdList>& fragments,
+                             const msys::IdList& frags,
+                             std::vector<msys::IdList>& frag_ffs) {
+        std::unordered_map<std::string, msys::IdList> index;
+        for (unsigned k = 0; k < fflist.size(); ++k)
+          for (const std::string& hash : fflist[k]->typer()->hashes())
+            index[hash].push_back(k);
+
+        frag_ffs.assign(fragments.size(), msys::IdList());
+        ViparrParallelFor(frags.size(), [&](unsigned i) {
+          const msys::IdList& frag = fragments[frags[i]];
+          std::map<msys::Id, msys::IdList> residues;
+          for (msys::Id atom : frag)
+            residues[sys->atom(atom).residue].push_back(atom);
+          std::vector<unsigned> count(fflist.size(), 0);
+          for (const auto& res : residues) {
+            auto iter = index.find(msys::Graph::hash(sys, res.second));
+            if (iter == index.end())
+              return;
+            for (msys::Id k : iter->second)
+              ++count[k];
+          }
+          for (unsigned k = 0; k < fflist.size(); ++k)
+            if (count[k] == residues.size())
+              frag_ffs[frags[i]].push_back(k);
+        });
+      }
+
+      /* Map the template matches of a representative fragment onto a copy
+       * of it; atom_pos holds the position of each representative atom in
+       * its sorted fragment, and copy lists the copy's atoms in id order */
+      void CopyMatches(const MatchList& rep, const msys::IdList& copy,
+                       const std::vector<unsigned>& atom_pos,
+                       MatchList& matches) {
+        matches = rep;
+        for (unsigned i = 0; i < matches.size(); ++i) {
+          msys::IdList& tmap = matches[i].second;
+          for (unsigned j = 0; j < tmap.size(); ++j)
+            if (!msys::bad(tmap[j]))
+              tmap[j] = copy[atom_pos[tmap[j]]];
+        }
+      }
+
+      /* A group of identical fragments: the representative, typed and
+       * parametrized by plugins, and its copies, which were only typed.
+       * atoms lists the atoms of each fragment of the group in
+       * corresponding order, including the pseudos added by typing;
+       * charges and masses are those of the representative's atoms before
+       * plugins were applied. */
+      struct FragmentCopies {
+        unsigned group;
+        std::vector<const msys::IdList*> atoms;
+        std::vector<double> charges;
+        std::vector<double> masses;
+      };
+
+      /* Add, for each copy, the terms that plugins added for the atoms of
+       * its representative, with the same params and term properties, and
+       * copy the charges and masses that plugins changed. Tables in
+       * global_tables are skipped. */
+      void StampCopies(msys::SystemPtr sys,
+                       const std::vector<FragmentCopies>& copies,
+                       const std::set<std::string>& global_tables) {
+        std::vector<int> owner(sys->maxAtomId(), -1);
+        std::vector<unsigned> pos(sys->maxAtomId());
+        for (unsigned c = 0; c < copies.size(); ++c) {
+          const msys::IdList& rep = *copies[c].atoms[0];
+          for (unsigned i = 0; i < rep.size(); ++i) {
+            owner[rep[i]] = c;
+            pos[rep[i]] = i;
+          }
+        }
+
+        for (const std::string& name : sys->tableNames()) {
+          if (global_tables.count(name))
+            continue;
+          msys::TermTablePtr table = sys->table(name);
+          std::vector<msys::IdList> owned(copies.size());
+          for (msys::Id term : table->terms()) {
+            msys::IdList atoms = table->atoms(term);
+            int c = owner[atoms[0]];
+            for (unsigned i = 1; c >= 0 && i < atoms.size(); ++i)
+              if (owner[atoms[i]] != c)
+                c = -1;
+            if (c >= 0)
+              owned[c].push_back(term);
+          }
+          msys::Id nprops = table->termPropCount();
+          for (unsigned c = 0; c < copies.size(); ++c) {
+            for (unsigned k = 1; k < copies[c].atoms.size(); ++k) {
+              const msys::IdList& copy = *copies[c].atoms[k];
+              for (msys::Id term : owned[c]) {
+                msys::IdList atoms = table->atoms(term);
+                for (unsigned i = 0; i < atoms.size(); ++i)
+                  atoms[i] = copy[pos[atoms[i]]];
+                msys::Id id = table->addTerm(atoms, table->param(term));
+                for (msys::Id prop = 0; prop < nprops; ++prop)
+                  table->termPropValue(id, prop)
+                    = table->termPropValue(term, prop);
+              }
+            }
+          }
+        }
+
+        for (const FragmentCopies& c : copies) {
+          const msys::IdList& rep = *c.atoms[0];
+          for (unsigned i = 0; i < rep.size(); ++i) {
+            const msys::atom_t& atm = sys->atom(rep[i]);
+            bool charge = atm.charge != c.charges[i];
+            bool mass = atm.mass != c.masses[i];
+            if (!charge && !mass) continue;
+            for (unsigned k = 1; k < c.atoms.size(); ++k) {
+              msys::atom_t& copy = sys->atom((*c.atoms[k])[i]);
+              if (charge) copy.charge = atm.charge;
+              if (mass) copy.mass = atm.mass;
+            }
+          }
+        }
+      }
+    }
+
     void ExecuteViparr(const msys::SystemPtr sys,
                        const std::vector<ForcefieldPtr>& fflist,
                        const msys::IdList& atoms, bool rename_atoms, bool rename_residues,
                        bool with_constraints, bool fix_masses, bool fatal,
                        bool compile_plugins, bool verbose, bool verbose_matching,
-                       bool rename_prochiral_atoms) {
+                       bool rename_prochiral_atoms, bool dedup_fragments,
+                       bool incremental) {
 
       if (atoms.size() == 0)
         VIPARR_FAIL("No atoms selected for VIPARR parametrization");
+      ViparrScopedTimer total_timer("total");
+
+      /* All forcefields must share one context, whose param tables then
+       * receive the system's existing tables and the tables built by the
+       * plugins and postprocessing. The context is passed explicitly to
+       * AddSystemTables and, through the forcefields, to the plugins; the
+       * scope is for the plugin compile functions and postprocessing,
+       * which use the static Forcefield table functions on this thread. */
+      ForcefieldContextPtr context = fflist.size() > 0
+        ? fflist[0]->context() : ForcefieldContext::Current();
+      for (ForcefieldPtr ff : fflist)
+        if (ff->context() != context)
+          VIPARR_FAIL("Forcefields for VIPARR parametrization must share a "
+                      "ForcefieldContext");
+      ForcefieldContext::Scope scope(context);
 
       double original_charge = 0.0;
       for(const auto & atom_id : sys->atoms()) {
@@ -45,7 +481,8 @@ namespace desres { namespace viparr {
         if (verbose)
           VIPARR_OUT << "Adding existing tables in input system to "
             "viparr's global param tables" << std::endl;
-        AddSystemTables(sys);
+        AddSystemTables(sys, std::map<std::string, std::list<msys::Id> >(),
+                        DefaultTableNameConversions, context);
       }
 
       /* Set vdw_funct and vdw_rule */
@@ -106,16 +543,31 @@ namespace desres { namespace viparr {
       }
 
       /* Sort atoms into fragments */
+      ViparrScopedTimer fragments_timer("fragments");
       std::vector<msys::IdList> fragments;
       unsigned nfrags = sys->updateFragids(&fragments);
       unsigned nfrags_all = nfrags;
 
+      /* In incremental mode, select only the changed fragments */
+      uint64_t ff_hash = incremental ? ForcefieldsHash(fflist) : 0;
+      msys::IdList changed_atoms;
+      if (incremental) {
+        changed_atoms = ChangedAtoms(sys, fragments, atoms, ff_hash);
+        if (changed_atoms.empty()) {
+          if (verbose)
+            VIPARR_OUT << "No selected fragments have changed since they "
+              "were last parametrized" << std::endl;
+          return;
+        }
+      }
+      const msys::IdList& selection = incremental ? changed_atoms : atoms;
+
       /* Take only fragments with selected atoms */
       msys::IdList atoms_no_pseudos;
       msys::IdList pseudos;
       std::vector<bool> in_selection(sys->maxAtomId(), false);
-      for (unsigned i = 0; i < atoms.size(); ++i)
-        in_selection[atoms[i]] = true;
+      for (unsigned i = 0; i < selection.size(); ++i)
+        in_selection[selection[i]] = true;
       std::vector<msys::IdList>::iterator frag_iter = fragments.begin();
       while (frag_iter != fragments.end()) {
         msys::IdList& frag = *frag_iter;
@@ -152,11 +604,22 @@ namespace desres { namespace viparr {
         }
       }
 
+      fragments_timer.stop();
       if (verbose)
         VIPARR_OUT << "Parametrizing " << nfrags << " of " << nfrags_all
                    << " total fragments" << std::endl;
+      if (ViparrProfiling()) {
+        std::set<msys::Id> residues;
+        for (const msys::IdList& frag : fragments)
+          for (msys::Id atom : frag)
+            residues.insert(sys->atom(atom).residue);
+        ViparrProfileCount("fragments", nfrags);
+        ViparrProfileCount("fragments_total", nfrags_all);
+        ViparrProfileCount("residues", residues.size());
+      }
 
       /* Get atomic formulas for parametrized fragments */
+      ViparrScopedTimer formulas_timer("formulas");
       std::vector<std::string> formulas(nfrags);
       for (unsigned i = 0; i < nfrags; ++i) {
         int counts[128];
@@ -174,29 +637,17 @@ namespace desres { namespace viparr {
         formulas[i] = formula.str();
       }
 
+      formulas_timer.stop();
+
       /* Remove terms with selected atoms from all tables */
+      ViparrScopedTimer remove_timer("remove_terms");
       std::vector<std::string> tables = sys->tableNames();
-      for (unsigned i = 0; i < tables.size(); ++i) {
-        msys::TermTablePtr table = sys->table(tables[i]);
-        msys::IdList terms = table->findWithAny(atoms);
-        for (unsigned j = 0; j < terms.size(); ++j)
-          table->delTerm(terms[j]);
-        /* Remove overrides for unused params */
-        if (table->overrides()->count() != 0) {
-          std::vector<bool> used(table->params()->paramCount(), false);
-          terms = table->terms();
-          for (msys::Id term : terms) {
-            if (table->param(term) != msys::BadId)
-              used[table->param(term)] = true;
-          }
-          std::vector<msys::IdPair> overrides
-            = table->overrides()->list();
-          for (const msys::IdPair& pair : overrides) {
-            if (!used[pair.first] && !used[pair.second])
-              table->overrides()->del(pair);
-          }
-        }
-      }
+      for (unsigned i = 0; i < tables.size(); ++i)
+        DelTermsWithAtoms(sys->table(tables[i]), in_selection);
+      /* Term counts after removal, to count the terms added */
+      std::map<std::string, msys::Id> base_terms;
+      for (unsigned i = 0; i < tables.size(); ++i)
+        base_terms[tables[i]] = sys->table(tables[i])->termCount();
 
       /* Remove pseudos in selected atoms from system */
       for (unsigned i = 0; i < pseudos.size(); ++i)
@@ -216,40 +667,120 @@ namespace desres { namespace viparr {
           sys->delAuxTable(aux_table);
       }
 
-      for (msys::Id atom : atoms) {
+      for (msys::Id atom : selection) {
           for (msys::Id bond : sys->bondsForAtom(atom)) {
             if(sys->bond(bond).order == 0)
               sys->bond(bond).order = 1;
           }
         }
+      remove_timer.stop();
       /* Stores the name of every plugin matched, for use during the
          compilation stage of plugin application. */
       std::set<std::string> all_plugins;
 
+      /* With dedup_fragments, group fragments that are identical when
+       * their atoms are paired in id order. Only the first fragment of each
+       * group, its representative, is matched and parametrized by plugins;
+       * its matches, terms, and plugin-assigned charges and masses are then
+       * copied to the rest of the group. sorted_atoms holds the atoms of
+       * each fragment in id order, followed by the pseudos added for it. */
+      std::vector<unsigned> frag_group(nfrags);
+      std::vector<msys::IdList> groups;
+      std::vector<msys::IdList> sorted_atoms;
+      std::vector<unsigned> atom_pos;
+      ViparrScopedTimer dedup_timer("dedup");
+      if (dedup_fragments) {
+        sorted_atoms = fragments;
+        atom_pos.resize(sys->maxAtomId());
+        for (msys::IdList& frag : sorted_atoms) {
+          std::sort(frag.begin(), frag.end());
+          for (unsigned i = 0; i < frag.size(); ++i)
+            atom_pos[frag[i]] = i;
+        }
+        KeyMap<unsigned> group_index;
+        KeyMap<unsigned>::Key key;
+        for (unsigned frag = 0; frag < nfrags; ++frag) {
+          FragmentKey(sys, sorted_atoms[frag], atom_pos, key);
+          uint64_t hash = KeyMap<unsigned>::Hash(key);
+          const unsigned* group = group_index.find(key, hash);
+          if (group == NULL) {
+            group_index.insert(key, hash, groups.size());
+            frag_group[frag] = groups.size();
+            groups.push_back(msys::IdList());
+          } else
+            frag_group[frag] = *group;
+          groups[frag_group[frag]].push_back(frag);
+        }
+        if (verbose)
+          VIPARR_OUT << "Found " << groups.size()
+                     << " distinct fragments" << std::endl;
+      }
+
+      dedup_timer.stop();
+
+      /* Dispatch each fragment (only representatives with dedup_fragments)
+       * to the forcefields that may match it */
+      ViparrScopedTimer dispatch_timer("dispatch");
+      msys::IdList to_dispatch;
+      for (unsigned frag = 0; frag < nfrags; ++frag)
+        if (!dedup_fragments || groups[frag_group[frag]][0] == frag)
+          to_dispatch.push_back(frag);
+      std::vector<msys::IdList> frag_ffs;
+      DispatchFragments(sys, fflist, fragments, to_dispatch, frag_ffs);
+      dispatch_timer.stop();
+
       /* Apply forcefields */
       std::vector<bool> assigned(nfrags, false);
-      std::vector<std::vector<std::string> > whynot(nfrags);
-      for (ForcefieldPtr ff : fflist) {
+      for (unsigned ff_index = 0; ff_index < fflist.size(); ++ff_index) {
+        ForcefieldPtr ff = fflist[ff_index];
         std::set<std::string> matched_formulas;
         std::set<std::string> warned_formulas;
         int matched_frags = 0;
         if (verbose)
           VIPARR_OUT << "Applying forcefield " << ff->name << std::endl;
 
-        /* Assign atomtypes */
+        /* Assign atomtypes. Copies of representative fragments are typed
+         * in copies_tsys, which plugins do not see. */
         if (verbose)
           VIPARR_OUT << "  Matching fragments and assigning atom types"
                      << std::endl;
+        ViparrScopedTimer typing_timer("typing/" + ff->name);
         TemplatedSystemPtr tsys = TemplatedSystem::create(sys);
+        TemplatedSystemPtr copies_tsys = dedup_fragments
+          ? TemplatedSystem::create(sys) : tsys;
+        std::vector<FragmentCopies> copies;
+        ff->typer()->resetStats();
+
+        /* Match dispatched fragments to templates in parallel; matching
+         * only reads the system and the typer. Matches are then assigned
+         * serially in fragment order. */
+        msys::IdList to_match;
+        for (unsigned frag : to_dispatch)
+          if (std::find(frag_ffs[frag].begin(), frag_ffs[frag].end(),
+                        ff_index) != frag_ffs[frag].end())
+            to_match.push_back(frag);
+        std::vector<MatchList> frag_matches(nfrags);
+        std::vector<char> frag_matched(nfrags, false);
+        ViparrParallelFor(to_match.size(), [&](unsigned i) {
+          unsigned frag = to_match[i];
+          TemplateTyper::Failure failure;
+          frag_matched[frag] = ff->typer()->matchFragment(tsys,
+              fragments[frag], frag_matches[frag], failure);
+        });
+
         for (unsigned frag = 0; frag < nfrags; ++frag) {
-          std::stringstream ss;
-          ss << "Forcefield " << ff->name << " ";
-          std::vector<std::pair<TemplatedSystemPtr, msys::IdList> > matches;
-          bool matched = ff->typer()->matchFragment(tsys, fragments[frag],
-                                                    matches, ss);
-          if (!matched)
-            whynot[frag].push_back(ss.str());
-          else {
+          /* A copy takes its representative's matches, mapped onto its
+           * atoms */
+          unsigned rep = dedup_fragments ? groups[frag_group[frag]][0] : frag;
+          bool is_copy = rep != frag;
+          bool matched = frag_matched[rep];
+          MatchList copy_matches;
+          if (matched && is_copy)
+            CopyMatches(frag_matches[rep], sorted_atoms[frag], atom_pos,
+                        copy_matches);
+          const MatchList& matches = is_copy ? copy_matches
+                                             : frag_matches[rep];
+          if (matched) {
             if (assigned[frag]) {
               if (warned_formulas.find(formulas[frag])
                   == warned_formulas.end()) {
@@ -280,48 +811,66 @@ namespace desres { namespace viparr {
                   }
                 }
               }
-              ff->typer()->assignMatch(tsys, matches, rename_atoms,
-                                       rename_residues);
+              msys::Id first_added = sys->maxAtomId();
+              ff->typer()->assignMatch(is_copy ? copies_tsys : tsys, matches,
+                                       rename_atoms, rename_residues);
               ++matched_frags;
               assigned[frag] = true;
+              if (dedup_fragments) {
+                msys::IdList& atoms = sorted_atoms[frag];
+                for (msys::Id id = first_added; id < sys->maxAtomId(); ++id)
+                  atoms.push_back(id);
+                const msys::IdList& group = groups[frag_group[frag]];
+                if (group.size() > 1 && !is_copy) {
+                  copies.push_back(FragmentCopies());
+                  copies.back().group = frag_group[frag];
+                  for (msys::Id atom : atoms) {
+                    copies.back().charges.push_back(sys->atom(atom).charge);
+                    copies.back().masses.push_back(sys->atom(atom).mass);
+                  }
+                }
+              }
             }
           }
         }
-        if (verbose)
+        typing_timer.stop();
+        ViparrProfileCount("templates/lookups", ff->typer()->stats().lookups);
+        ViparrProfileCount("templates/hits", ff->typer()->stats().hits);
+        if (verbose) {
           VIPARR_OUT << "  Matched " << matched_frags
                      << " total fragments" << std::endl;
+          const TemplateTyper::Stats& stats = ff->typer()->stats();
+          VIPARR_OUT << "  Reused " << stats.hits << " of " << stats.lookups
+                     << " residue template matches";
+          if (stats.lookups > 0)
+            VIPARR_OUT << " (" << 100 * stats.hits / stats.lookups << "%)";
+          VIPARR_OUT << std::endl;
+        }
 
         /* Apply plugins for parameter matching */
-        std::vector<std::string> plugins = ff->rules()->plugins;
-        std::vector<std::string> plugins_done;
+        const std::vector<std::string>& plugins = ff->rules()->plugins;
+        all_plugins.insert(plugins.begin(), plugins.end());
         if (verbose)
           VIPARR_OUT << "  Applying plugins" << std::endl;
-        for (unsigned i = 0; i < plugins.size(); ++i) {
-          std::string name = plugins[i];
-          all_plugins.insert(name);
-          std::map<std::string, Forcefield::PluginPtr>::const_iterator
-            iter = Forcefield::PluginRegistry().find(name);
-          if (iter == Forcefield::PluginRegistry().end())
-            VIPARR_FAIL("Unsupported plugin: " + name);
-          const std::vector<std::string>& prerequisites
-            = iter->second->prerequisites;
-          for (unsigned j = 0; j < prerequisites.size(); ++j) {
-            std::vector<std::string>::iterator done_iter = std::find(
-              plugins_done.begin(), plugins_done.end(),
-              prerequisites[j]);
-            std::vector<std::string>::iterator all_iter = std::find(
-              plugins.begin(), plugins.end(), prerequisites[j]);
-            /* Fail if a prerequisite plugin is in the forcefield but
-             * after this plugin */
-            if (done_iter == plugins_done.end()
-                && all_iter != plugins.end())
-              VIPARR_FAIL("Plugin " + prerequisites[j] +
-                          " must come before plugin " + name);
+        ApplyPlugins(tsys, ff, verbose);
+        if (!copies.empty()) {
+          /* Copies are typed after their representative, so atom lists
+           * are complete only now */
+          for (FragmentCopies& c : copies)
+            for (unsigned frag : groups[c.group])
+              c.atoms.push_back(&sorted_atoms[frag]);
+          ViparrScopedTimer timer("stamp_copies");
+          /* Plugins declare the tables whose terms hold forcefield-wide
+           * parameters on an arbitrary atom; a representative that
+           * happens to hold them must not pass them on to its copies */
+          std::set<std::string> global_tables;
+          for (const std::string& name : plugins) {
+            const Forcefield::PluginPtr& plugin
+              = Forcefield::PluginRegistry().at(name);
+            global_tables.insert(plugin->global_tables.begin(),
+                                 plugin->global_tables.end());
           }
-          if (verbose)
-            VIPARR_OUT << "    " << name << std::endl;
-          iter->second->match(tsys, ff);
-          plugins_done.push_back(name);
+          StampCopies(sys, copies, global_tables);
         }
       }
       for (unsigned frag = 0; frag < nfrags; ++frag) {
@@ -331,8 +880,13 @@ namespace desres { namespace viparr {
               << "parametrize fragment " << frag << ": "
               << formulas[frag] << ". Reason for each "
               << "forcefield: " << std::endl;
-          for (unsigned i = 0; i < whynot[frag].size(); ++i)
-            msg << whynot[frag][i];
+          /* Diagnostics are only built for the reported fragment */
+          TemplatedSystemPtr tsys = TemplatedSystem::create(sys);
+          for (ForcefieldPtr ff : fflist) {
+            MatchList matches;
+            msg << "Forcefield " << ff->name << " ";
+            ff->typer()->matchFragment(tsys, fragments[frag], matches, msg);
+          }
           VIPARR_FAIL(msg.str());
         }
       }
@@ -342,23 +896,28 @@ namespace desres { namespace viparr {
           VIPARR_OUT << "Compiling system for DMS output" << std::endl;
 
         CompilePlugins(sys,all_plugins);
+        ViparrScopedTimer timer("compile/cleanup");
         CleanupSystem(sys);
       }
 
       if (with_constraints) {
         if (verbose)
           VIPARR_OUT << "Building constraints" << std::endl;
-        BuildConstraints(sys, atoms, false, std::set<std::string>(), verbose);
+        ViparrScopedTimer timer("constraints");
+        BuildConstraints(sys, selection, false, std::set<std::string>(),
+                         verbose);
       }
 
       if (fix_masses) {
         if (verbose)
           VIPARR_OUT << "Fixing masses" << std::endl;
+        ViparrScopedTimer timer("fix_masses");
         FixMasses(sys, atoms_no_pseudos, verbose);
       }
 
       if (rename_prochiral_atoms) {
           if (rename_atoms && rename_residues) {
+            ViparrScopedTimer timer("prochirality");
             auto ids = FixProchiralProteinAtomNames(sys);
             if (verbose) {
               VIPARR_OUT << " Number of updated prochiral atom names: " << ids.size() << "\n";
@@ -396,6 +955,39 @@ namespace desres { namespace viparr {
         ffMetaTable->value(param, "info") = info.str();
       }
       sys->addAuxTable("forcefield", ffMetaTable);
+
+      /* Count the terms added to each table */
+      if (ViparrProfiling()) {
+        for (const std::string& name : sys->tableNames()) {
+          msys::Id count = sys->table(name)->termCount();
+          std::map<std::string, msys::Id>::const_iterator base
+            = base_terms.find(name);
+          if (base != base_terms.end())
+            count = count > base->second ? count - base->second : 0;
+          ViparrProfileCount("terms/" + name, count);
+        }
+      }
+
+      /* Record fragment hashes for later incremental runs. A
+       * non-incremental run clears the hashes of the fragments it
+       * parametrized, which may no longer match the forcefields those
+       * hashes were recorded for. */
+      if (incremental) {
+        msys::Id prop = sys->addAtomProp(FragmentHashProp, msys::IntType);
+        std::vector<unsigned> atom_pos(sys->maxAtomId());
+        msys::IdList sorted;
+        for (const msys::IdList& frag : fragments) {
+          msys::Int hash = FragmentHash(sys, frag, ff_hash, sorted, atom_pos);
+          for (msys::Id atom : sorted)
+            sys->atomPropValue(atom, prop) = hash;
+        }
+      } else {
+        msys::Id prop = sys->atomPropIndex(FragmentHashProp);
+        if (prop != msys::BadId)
+          for (const msys::IdList& frag : fragments)
+            for (msys::Id atom : frag)
+              sys->atomPropValue(atom, prop) = 0;
+      }
     }
 
     msys::SystemPtr ReorderIDs(msys::SystemPtr sys) {
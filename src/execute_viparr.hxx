@@ -8,7 +8,16 @@
 namespace desres { namespace viparr {
 
     /* The main viparr executable to parametrize a system with a list of
-     * forcefields.
+     * forcefields. If dedup_fragments is set, only one of each set of
+     * identical fragments is matched and parametrized, and the results are
+     * copied to the others; terms may be added in a different order.
+     * If incremental is set, a hash of each parametrized fragment and of
+     * the forcefields is stored in the atom property viparr_fragment_hash,
+     * and selected fragments whose atoms already store the current hash
+     * are left unchanged with their existing terms. The first incremental
+     * run on a system parametrizes all selected fragments.
+     * The forcefields must all belong to the same ForcefieldContext, which
+     * is current for the duration of the call.
      * FIXME: this is a horror show.
      */
     void ExecuteViparr(const msys::SystemPtr input_sys,
@@ -18,7 +27,8 @@ namespace desres { namespace viparr {
             bool fix_masses=true, bool fatal=true,
             bool compile_plugins=true, bool verbose=true,
             bool verbose_matching=false,
-            bool rename_prochiral_atoms=false);
+            bool rename_prochiral_atoms=false,
+            bool dedup_fragments=false, bool incremental=false);
 
     /* Create a copy of the system in which IDs of pseudo atoms are adjacent
      * to their parent atoms */
@@ -1,5 +1,7 @@
 #include "ff.hxx"
 #include "base.hxx"
+#include <mutex>
+#include <set>
 
 using namespace desres;
 using namespace desres::viparr;
@@ -37,41 +39,123 @@ namespace {
 namespace desres { namespace viparr {
 
     typedef std::map<std::string, msys::ParamTablePtr> ParamTableMap;
+    typedef std::lock_guard<std::recursive_mutex> ContextLock;
 
-    ParamTableMap Forcefield::SharedParamTables = ParamTableMap();
     std::list<msys::Id> Forcefield::_empty_idlist = std::list<msys::Id>();
 
-    bool Forcefield::HasParamTable(const std::string& name) {
-      ParamTableMap::const_iterator iter = SharedParamTables.find(name);
-      return (iter != SharedParamTables.end());
+    namespace {
+      thread_local ForcefieldContextPtr current_context;
     }
 
-    msys::ParamTablePtr Forcefield::ParamTable(const std::string& name) {
-      ParamTableMap::const_iterator iter = SharedParamTables.find(name);
-      if (iter == SharedParamTables.end())
+    ForcefieldContextPtr ForcefieldContext::Default() {
+      static ForcefieldContextPtr context = ForcefieldContext::create();
+      return context;
+    }
+
+    ForcefieldContextPtr ForcefieldContext::Current() {
+      return current_context ? current_context : Default();
+    }
+
+    ForcefieldContext::Scope::Scope(ForcefieldContextPtr context)
+      : _prev(current_context) {
+      current_context = context;
+    }
+
+    ForcefieldContext::Scope::~Scope() {
+      current_context = _prev;
+    }
+
+    void ForcefieldContext::loadPendingParams(const std::string& name) {
+      std::map<std::string, std::vector<PendingParamsPtr> >::iterator iter
+        = _pending.find(name);
+      if (iter == _pending.end())
+        return;
+      std::vector<PendingParamsPtr> pending;
+      pending.swap(iter->second);
+      _pending.erase(iter);
+      /* The imports add their rows through the static table functions */
+      Scope scope(shared_from_this());
+      for (PendingParamsPtr params : pending) {
+        params->rows = params->load();
+        params->loaded = true;
+        params->load = nullptr;
+      }
+    }
+
+    bool ForcefieldContext::hasParamTable(const std::string& name) {
+      ContextLock lock(_mutex);
+      ParamTableMap::const_iterator iter = _tables.find(name);
+      return (iter != _tables.end() || _pending.count(name) != 0);
+    }
+
+    msys::ParamTablePtr ForcefieldContext::paramTable(const std::string& name) {
+      ContextLock lock(_mutex);
+      loadPendingParams(name);
+      ParamTableMap::const_iterator iter = _tables.find(name);
+      if (iter == _tables.end())
         VIPARR_FAIL("Param table " + name + " not found");
       return iter->second;
     }
 
-    void Forcefield::AddParamTable(const std::string& name,
-                                   msys::ParamTablePtr table) {
-      ParamTableMap::const_iterator iter = SharedParamTables.find(name);
-      if (iter != SharedParamTables.end())
+    void ForcefieldContext::addParamTable(const std::string& name,
+                                          msys::ParamTablePtr table) {
+      ContextLock lock(_mutex);
+      ParamTableMap::const_iterator iter = _tables.find(name);
+      if (iter != _tables.end())
         VIPARR_FAIL("Cannot add table: Param table " + name
                     + " already exists");
-      SharedParamTables.insert(std::make_pair(name, table));
+      _tables.insert(std::make_pair(name, table));
+    }
+
+    std::vector<std::string> ForcefieldContext::allParamTables() {
+      ContextLock lock(_mutex);
+      std::set<std::string> names;
+      for (ParamTableMap::const_iterator iter = _tables.begin();
+           iter != _tables.end(); ++iter)
+        names.insert(iter->first);
+      for (const auto& pending : _pending)
+        names.insert(pending.first);
+      return std::vector<std::string>(names.begin(), names.end());
+    }
+
+    void ForcefieldContext::clearParamTables() {
+      ContextLock lock(_mutex);
+      _tables.clear();
+      _pending.clear();
+    }
+
+    void Forcefield::takePendingParams(const std::string& name) const {
+      std::map<std::string, PendingParamsPtr>::iterator iter
+        = _pending.find(name);
+      if (iter == _pending.end())
+        return;
+      PendingParamsPtr params = iter->second;
+      _pending.erase(iter);
+      if (!params->loaded)
+        _context->loadPendingParams(name);
+      /* Not loaded if the tables were cleared before the import ran */
+      if (!params->loaded)
+        return;
+      std::list<msys::Id>& rows = _row_ids_map[name];
+      rows.insert(rows.end(), params->rows.begin(), params->rows.end());
     }
 
-    std::vector<std::string> Forcefield::AllParamTables() {
-      std::vector<std::string> names;
-      for (ParamTableMap::const_iterator iter = SharedParamTables.begin();
-           iter != SharedParamTables.end(); ++iter)
-        names.push_back(iter->first);
-      return names;
+    void Forcefield::deferParams(const std::string& name,
+                                 std::function<std::list<msys::Id>()> load) {
+      ContextLock lock(_context->_mutex);
+      /* Keep this forcefield's rows in the order they were added */
+      takePendingParams(name);
+      PendingParamsPtr params
+        = std::make_shared<ForcefieldContext::PendingParams>();
+      params->load = load;
+      _context->_pending[name].push_back(params);
+      _pending[name] = params;
     }
 
     const std::list<msys::Id>& Forcefield::rowIDs(const std::string&
                                                   name) const {
+      ContextLock lock(_context->_mutex);
+      takePendingParams(name);
       std::map<std::string, std::list<msys::Id> >::const_iterator iter
         = _row_ids_map.find(name);
       return (iter == _row_ids_map.end() ? _empty_idlist : iter->second);
@@ -83,6 +167,8 @@ namespace desres { namespace viparr {
 
     void Forcefield::delParams(const std::string& name,
                                const std::list<msys::Id>& params) {
+      ContextLock lock(_context->_mutex);
+      takePendingParams(name);
       std::set<msys::Id> param_set(params.begin(), params.end());
       std::map<std::string, std::list<msys::Id> >::iterator iter
         = _row_ids_map.find(name);
@@ -99,6 +185,8 @@ namespace desres { namespace viparr {
     }
 
     void Forcefield::clearParams(const std::string& name) {
+      ContextLock lock(_context->_mutex);
+      takePendingParams(name);
       std::map<std::string, std::list<msys::Id> >::iterator iter
         = _row_ids_map.find(name);
       if (iter == _row_ids_map.end())
@@ -114,9 +202,11 @@ namespace desres { namespace viparr {
                                   const std::list<msys::Id>& params) {
       if (params.size() == 0)
         return;
+      ContextLock lock(_context->_mutex);
+      takePendingParams(name);
       std::map<std::string, msys::ParamTablePtr>::iterator static_map_iter
-        = SharedParamTables.find(name);
-      if (static_map_iter == SharedParamTables.end())
+        = _context->_tables.find(name);
+      if (static_map_iter == _context->_tables.end())
         VIPARR_FAIL("Shared param table '" + name + "' does not exist");
       std::map<std::string, std::list<msys::Id> >::iterator row_ids_iter
         = _row_ids_map.find(name);
@@ -136,8 +226,10 @@ namespace desres { namespace viparr {
 
     void Forcefield::replaceParam(const std::string& name, msys::Id old_param,
                                   msys::Id new_param) {
-      ParamTableMap::iterator static_iter = SharedParamTables.find(name);
-      if (static_iter == SharedParamTables.end()
+      ContextLock lock(_context->_mutex);
+      takePendingParams(name);
+      ParamTableMap::iterator static_iter = _context->_tables.find(name);
+      if (static_iter == _context->_tables.end()
           || new_param >= static_iter->second->paramCount()) {
         std::stringstream msg;
         msg << "Parameter " << new_param << " of shared param table '"
@@ -158,6 +250,9 @@ namespace desres { namespace viparr {
     }
 
     std::vector<std::string> Forcefield::paramTables() const {
+      ContextLock lock(_context->_mutex);
+      while (!_pending.empty())
+        takePendingParams(_pending.begin()->first);
       std::vector<std::string> tables;
       for (std::map<std::string, std::list<msys::Id> >::const_iterator iter
              = _row_ids_map.begin(); iter != _row_ids_map.end(); ++iter) {
@@ -167,12 +262,48 @@ namespace desres { namespace viparr {
       return tables;
     }
 
+    void Forcefield::takePendingCmapTables() const {
+      if (!_pending_cmaps)
+        return;
+      std::function<std::vector<msys::ParamTablePtr>()> load;
+      load.swap(_pending_cmaps);
+      std::vector<msys::ParamTablePtr> cmaps = load();
+      _cmaps.insert(_cmaps.end(), cmaps.begin(), cmaps.end());
+    }
+
+    void Forcefield::deferCmapTables(
+        std::function<std::vector<msys::ParamTablePtr>()> load) {
+      ContextLock lock(_context->_mutex);
+      takePendingCmapTables();
+      _pending_cmaps = load;
+    }
+
     msys::ParamTablePtr Forcefield::cmapTable(unsigned cmap) const {
+      ContextLock lock(_context->_mutex);
+      takePendingCmapTables();
       if (cmap > _cmaps.size() || cmap <= 0)
         VIPARR_FAIL("Invalid cmap id");
       return _cmaps[cmap-1];
     }
 
+    const std::vector<msys::ParamTablePtr>& Forcefield::cmapTables() const {
+      ContextLock lock(_context->_mutex);
+      takePendingCmapTables();
+      return _cmaps;
+    }
+
+    void Forcefield::addCmapTable(msys::ParamTablePtr cmap_table) {
+      ContextLock lock(_context->_mutex);
+      takePendingCmapTables();
+      _cmaps.push_back(cmap_table);
+    }
+
+    void Forcefield::delCmapTables() {
+      ContextLock lock(_context->_mutex);
+      _pending_cmaps = nullptr;
+      _cmaps.clear();
+    }
+
     std::map<std::string, Forcefield::PluginPtr>& Forcefield::PluginRegistry() {
       static std::map<std::string, Forcefield::PluginPtr> registry;
       return registry;
@@ -200,4 +331,28 @@ namespace desres { namespace viparr {
       iter->second->prerequisites.push_back(first_plugin);
     }
 
+    Forcefield::RegisterPluginTables::RegisterPluginTables(const std::string& plugin,
+                                                           const std::vector<std::string>& tables) {
+      std::map<std::string, Forcefield::PluginPtr>::iterator iter
+        = Forcefield::PluginRegistry().find(plugin);
+      if (iter == Forcefield::PluginRegistry().end()) {
+        VIPARR_FAIL("Must register plugin '" + plugin
+                    + "' before registering its tables");
+      }
+      iter->second->tables.insert(iter->second->tables.end(),
+                                  tables.begin(), tables.end());
+    }
+
+    Forcefield::RegisterPluginGlobalTables::RegisterPluginGlobalTables(const std::string& plugin,
+                                                                       const std::vector<std::string>& tables) {
+      std::map<std::string, Forcefield::PluginPtr>::iterator iter
+        = Forcefield::PluginRegistry().find(plugin);
+      if (iter == Forcefield::PluginRegistry().end()) {
+        VIPARR_FAIL("Must register plugin '" + plugin
+                    + "' before registering its global tables");
+      }
+      iter->second->global_tables.insert(iter->second->global_tables.end(),
+                                         tables.begin(), tables.end());
+    }
+
   }}
@@ -5,14 +5,111 @@
 #include "rules.hxx"
 #include "template_typer.hxx"
 #include <msys/append.hxx>
+#include <functional>
 #include <list>
 #include <map>
+#include <mutex>
 
 namespace desres { namespace viparr {
 
     class Forcefield;
     typedef std::shared_ptr<Forcefield> ForcefieldPtr;
 
+    class ForcefieldContext;
+    typedef std::shared_ptr<ForcefieldContext> ForcefieldContextPtr;
+
+    /* A collection of shared param tables, together with the deferred
+     * imports into them (see Forcefield::deferParams). Every Forcefield
+     * belongs to one context, and its row IDs refer to that context's
+     * tables. Parametrizations with forcefields of different contexts do
+     * not share any param tables, so they may run concurrently in one
+     * process; each should import its own forcefields into its own
+     * context.
+     *
+     * Code with a forcefield uses its context explicitly: the importers,
+     * AppendParams, AddSystemTables, ParameterMatcher, and the match
+     * functions of the built-in plugins all take the tables from
+     * ff->context() (or a context argument), so they work in any thread.
+     * The static Forcefield table functions are the default-context API,
+     * for code with no forcefield at hand: they act on the current context
+     * of the calling thread, which is Default() unless a Scope is active.
+     * ExecuteViparr makes its context current for plugin compile functions
+     * and postprocessing, and ApplyPlugins for the plugins it runs, but
+     * the threads of ViparrParallelFor do not inherit a Scope.
+     *
+     * Some state is process-wide rather than per context, and is shared by
+     * concurrent parametrizations: the thread count (ViparrSetThreads),
+     * the profile (ViparrSetProfiling), the interned type names
+     * (TypeDictionary), the plugin registry, and the lock taken by
+     * AddPluginTable. */
+    class ForcefieldContext
+        : public std::enable_shared_from_this<ForcefieldContext> {
+
+        public:
+            static ForcefieldContextPtr create() {
+                return ForcefieldContextPtr(new ForcefieldContext);
+            }
+
+            /* The process-wide context of the static table functions */
+            static ForcefieldContextPtr Default();
+
+            /* The current context of the calling thread */
+            static ForcefieldContextPtr Current();
+
+            /* Makes a context current in the calling thread for the
+             * lifetime of the Scope */
+            class Scope {
+                ForcefieldContextPtr _prev;
+                public:
+                    explicit Scope(ForcefieldContextPtr context);
+                    ~Scope();
+                    Scope(const Scope&) = delete;
+                    Scope& operator=(const Scope&) = delete;
+            };
+
+            /* Functions to access and modify the shared param tables. A
+             * table with deferred imports exists, and is imported when it
+             * is first accessed with paramTable. These functions may be
+             * called concurrently. */
+            bool hasParamTable(const std::string& name);
+            msys::ParamTablePtr paramTable(const std::string& name);
+            void addParamTable(const std::string& name,
+                    msys::ParamTablePtr table);
+            std::vector<std::string> allParamTables();
+            /* Clears all shared tables; invalidates all existing Forcefield
+             * objects of this context */
+            void clearParamTables();
+
+        private:
+            friend class Forcefield;
+
+            ForcefieldContext() { }
+
+            /* A deferred import of rows into a shared param table */
+            struct PendingParams {
+                std::function<std::list<msys::Id>()> load;
+                bool loaded = false;
+                std::list<msys::Id> rows;
+            };
+            typedef std::shared_ptr<PendingParams> PendingParamsPtr;
+
+            std::map<std::string, msys::ParamTablePtr> _tables;
+
+            /* Deferred imports of all forcefields, by shared table name, in
+             * the order they were deferred */
+            std::map<std::string, std::vector<PendingParamsPtr> > _pending;
+
+            /* Guards the tables and all deferred imports, including the
+             * deferred rows of the context's forcefields. It is recursive
+             * because a deferred import adds its rows through the table
+             * functions. */
+            std::recursive_mutex _mutex;
+
+            /* Run and remove the deferred imports into a shared table; the
+             * lock must be held */
+            void loadPendingParams(const std::string& name);
+    };
+
     /* Representation of a forcefield, consisting of
      * (1) a Rules object, containing the nonbonded info and list of plugins
      * (2) a TemplateTyper, SmartsTyper, or ScoredSmartsTyper object, containing
@@ -23,35 +120,58 @@ namespace desres { namespace viparr {
      *       this forcefield
      * (4) an optional list of cmap param tables
      *
-     * In addition, the Forcefield class has a static collection of all of the
-     * param tables, with static accessors and modifiers, and a static
+     * The param tables themselves belong to the forcefield's
+     * ForcefieldContext; the Forcefield class has static accessors and
+     * modifiers for the tables of the current context, and a static
      * name-to-plugin registry of supported plugins. */
     class Forcefield {
 
         private:
-            /* Static shared param tables */
-            static std::map<std::string, msys::ParamTablePtr> SharedParamTables;
+            typedef ForcefieldContext::PendingParamsPtr PendingParamsPtr;
+
             static std::list<msys::Id> _empty_idlist;
 
             RulesPtr _rules;
             TemplateTyperPtr _typer;
-            std::map<std::string, std::list<msys::Id> > _row_ids_map;
-            std::vector<msys::ParamTablePtr> _cmaps;
+            ForcefieldContextPtr _context;
+
+            /* Row lists and cmap tables are filled in from deferred imports
+             * on first access, including by const accessors */
+            mutable std::map<std::string, std::list<msys::Id> > _row_ids_map;
+            mutable std::map<std::string, PendingParamsPtr> _pending;
+            mutable std::vector<msys::ParamTablePtr> _cmaps;
+            mutable std::function<std::vector<msys::ParamTablePtr>()>
+                _pending_cmaps;
+
+            /* Move this forcefield's rows of a deferred import, or its
+             * deferred cmap tables, into place; the context lock must be
+             * held */
+            void takePendingParams(const std::string& name) const;
+            void takePendingCmapTables() const;
 
             /* Private constructor; must construct using create() function */
-            Forcefield(RulesPtr rules, TemplateTyperPtr typer) :
-                _rules(rules), _typer(typer) { }
+            Forcefield(RulesPtr rules, TemplateTyperPtr typer,
+                    ForcefieldContextPtr context) :
+                _rules(rules), _typer(typer), _context(context) { }
 
         public:
-            /* Functions to access and modify static shared param tables */
-            static bool HasParamTable(const std::string& name);
-            static msys::ParamTablePtr ParamTable(const std::string& name);
+            /* Functions to access and modify the shared param tables of
+             * ForcefieldContext::Current(); see ForcefieldContext. The
+             * accessors of deferred rows below may also be called
+             * concurrently. */
+            static bool HasParamTable(const std::string& name) {
+                return ForcefieldContext::Current()->hasParamTable(name); }
+            static msys::ParamTablePtr ParamTable(const std::string& name) {
+                return ForcefieldContext::Current()->paramTable(name); }
             static void AddParamTable(const std::string& name,
-                    msys::ParamTablePtr table);
-            static std::vector<std::string> AllParamTables();
-            /* Clears all shared tables; invalidates all existing Forcefield
-             * objects */
-            static void ClearParamTables() { SharedParamTables.clear(); }
+                    msys::ParamTablePtr table) {
+                ForcefieldContext::Current()->addParamTable(name, table); }
+            static std::vector<std::string> AllParamTables() {
+                return ForcefieldContext::Current()->allParamTables(); }
+            /* Clears all shared tables of the current context; invalidates
+             * all existing Forcefield objects of the context */
+            static void ClearParamTables() {
+                ForcefieldContext::Current()->clearParamTables(); }
 
             /* Functions to search within static shared param tables, by
              * taking a given list of params and returning only the params
@@ -159,6 +279,20 @@ namespace desres { namespace viparr {
                 /* A list of Plugin names which, if also applied in this 
                  * forcefield, must be applied before this one */
                 std::vector<std::string> prerequisites;
+                /* The names of the term tables this plugin writes. A plugin
+                 * that declares its tables modifies the system only through
+                 * those tables (creating them with AddPluginTable), so it
+                 * may be applied concurrently with plugins that write other
+                 * tables. Plugins with no declared tables are applied
+                 * alone; see ApplyPlugins. */
+                std::vector<std::string> tables;
+                /* The names of the term tables in which this plugin records
+                 * forcefield-wide parameters, as terms on an arbitrary
+                 * atom, rather than parameters of the atoms of each term.
+                 * With dedup_fragments, ExecuteViparr copies the terms of
+                 * a representative fragment to its copies in every table
+                 * except these. */
+                std::vector<std::string> global_tables;
 
                 virtual ~Plugin() { }
             };
@@ -185,20 +319,38 @@ namespace desres { namespace viparr {
                 explicit RegisterPluginPrerequisite(const std::string&
                         first_plugin, const std::string& second_plugin);
             };
+            /* Call this constructor in a static initializer to declare the
+             * term tables written by a plugin on program initialization */
+            struct RegisterPluginTables {
+                explicit RegisterPluginTables(const std::string& plugin,
+                        const std::vector<std::string>& tables);
+            };
+            /* Call this constructor in a static initializer to declare the
+             * global term tables of a plugin on program initialization */
+            struct RegisterPluginGlobalTables {
+                explicit RegisterPluginGlobalTables(const std::string& plugin,
+                        const std::vector<std::string>& tables);
+            };
 
             /* Create forcefield with given rules and typer, with no pattern
-             * tables and no cmap tables */
+             * tables and no cmap tables, in the given context or by default
+             * the current one */
             static ForcefieldPtr create(RulesPtr rules,
-                    TemplateTyperPtr typer) {
-                return ForcefieldPtr(new Forcefield(rules, typer));
+                    TemplateTyperPtr typer,
+                    ForcefieldContextPtr context=ForcefieldContextPtr()) {
+                return ForcefieldPtr(new Forcefield(rules, typer,
+                            context ? context : ForcefieldContext::Current()));
             }
 
-            /* Create a shallow copy of a forcefield sharing the same rules and
-             * typer objects */
+            /* Create a shallow copy of a forcefield sharing the same rules,
+             * typer, and context objects */
             static ForcefieldPtr copy(ForcefieldPtr ff) {
                 return ForcefieldPtr(new Forcefield(*ff.get()));
             }
 
+            /* The context holding this forcefield's param tables */
+            ForcefieldContextPtr context() const { return _context; }
+
             /* Can store the file-path from which the forcefield was imported */
             std::string name;
 
@@ -227,6 +379,15 @@ namespace desres { namespace viparr {
             void replaceParam(const std::string& name, msys::Id old_param,
                     msys::Id new_param);
 
+            /* Defer adding parameters to this forcefield: load is called
+             * to import the rows into the shared table name and return
+             * them when the rows or the shared table are first needed. The
+             * deferred imports of all forcefields into the same table run
+             * together, in the order they were deferred, so the resulting
+             * row ids do not depend on which forcefield asks first. */
+            void deferParams(const std::string& name,
+                    std::function<std::list<msys::Id>()> load);
+
 #if 0
             /* Mode manipulation, for forcefields with modes */
             msys::Id getModeParam(const std::string& name, msys::Id rowID,
@@ -239,16 +400,21 @@ namespace desres { namespace viparr {
                     std::string& mode);
 #endif
 
+            /* Names of the nonempty param tables of this forcefield;
+             * imports all deferred rows of this forcefield */
             std::vector<std::string> paramTables() const;
 
             /* Functions to access and modify cmap tables; the cmapTable
              * accessor uses a 1-based index */
             msys::ParamTablePtr cmapTable(unsigned cmap) const;
-            const std::vector<msys::ParamTablePtr>& cmapTables() const {
-                return _cmaps; }
-            void addCmapTable(msys::ParamTablePtr cmap_table) { 
-                _cmaps.push_back(cmap_table); }
-            void delCmapTables() { _cmaps.clear(); }
+            const std::vector<msys::ParamTablePtr>& cmapTables() const;
+            void addCmapTable(msys::ParamTablePtr cmap_table);
+            void delCmapTables();
+
+            /* Defer importing cmap tables until they are first accessed;
+             * load returns the tables to add */
+            void deferCmapTables(
+                    std::function<std::vector<msys::ParamTablePtr>()> load);
     };
 
 }}
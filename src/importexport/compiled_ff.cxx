@@ -0,0 +1,575 @@
+#include "import_ff.hxx"
+#include "export_ff.hxx"
+#include "../append_params.hxx"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace desres;
+using namespace desres::viparr;
+
+/* Compiled forcefield layout; all values are in native byte order.
+ *
+ *   header:    "VIPARRFF", uint32 version, uint32 0, uint64 source hash
+ *   rules:     info, vdw_func, vdw_comb_rule, plugins, fatal,
+ *              nbfix_identifier, es_scale, lj_scale
+ *   templates: count, then per template: residue name, graph hash, atoms
+ *              (name, atomic number, charge, memo, btype, nbtype, pset),
+ *              bonds (atom positions, aromaticity), exclusions, impropers,
+ *              cmaps, and pseudo types with their site tuples
+ *   params:    count, then per table: name, row count, columns
+ *   cmaps:     count, then per cmap table: row count, columns
+ *
+ * Strings are a uint32 length followed by their bytes; lists are a uint32
+ * count followed by their elements. A column is its name, a uint8 type,
+ * and its values stored contiguously: doubles, int64s, or uint32 string
+ * end offsets followed by the concatenated string bytes. */
+
+namespace {
+
+    const char Magic[8] = { 'V','I','P','A','R','R','F','F' };
+    const uint32_t Version = 1;
+
+    enum ColumnType { IntColumn = 0, FloatColumn = 1, StringColumn = 2 };
+
+    inline uint64_t HashWord(uint64_t h, uint64_t word) {
+        h = (h ^ word) * 0xff51afd7ed558ccdULL;
+        return h ^ (h >> 32);
+    }
+
+    /* Hashes bytes a word at a time, in native byte order; a final
+     * partial word is zero-padded */
+    uint64_t HashBytes(uint64_t h, const char* bytes, size_t size) {
+        size_t i = 0;
+        for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, bytes + i, sizeof(word));
+            h = HashWord(h, word);
+        }
+        if (i < size) {
+            uint64_t word = 0;
+            memcpy(&word, bytes + i, size - i);
+            h = HashWord(h, word);
+        }
+        return HashWord(h, size);
+    }
+
+    /* Whether ImportForcefield reads the given directory entry; must match
+     * the files skipped there */
+    bool IsForcefieldFile(const std::string& dir, const std::string& name) {
+        if (name.substr(name.size()-1) == "~") return false;
+        if (name.substr(0,1) == ".") return false;
+        if (fs::is_directory(dir + "/" + name)) return false;
+        if (name == "README") return false;
+        if (name.size() >= 4 && name.substr(name.size()-4) == ".def")
+            return false;
+        return true;
+    }
+
+    /* Read-only memory mapping of an entire file */
+    class MappedFile {
+        int _fd;
+        void* _addr;
+        size_t _size;
+        public:
+            explicit MappedFile(const std::string& path)
+            : _fd(-1), _addr(MAP_FAILED), _size(0) {
+                _fd = open(path.c_str(), O_RDONLY);
+                if (_fd < 0)
+                    VIPARR_FAIL("Cannot open " << path << ": "
+                            << strerror(errno));
+                struct stat buf;
+                if (fstat(_fd, &buf) != 0) {
+                    close(_fd);
+                    VIPARR_FAIL("Cannot stat " << path << ": "
+                            << strerror(errno));
+                }
+                _size = buf.st_size;
+                if (_size > 0) {
+                    _addr = mmap(NULL, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+                    if (_addr == MAP_FAILED) {
+                        close(_fd);
+                        VIPARR_FAIL("Cannot map " << path << ": "
+                                << strerror(errno));
+                    }
+                }
+            }
+            ~MappedFile() {
+                if (_addr != MAP_FAILED)
+                    munmap(_addr, _size);
+                close(_fd);
+            }
+            const char* data() const {
+                return _addr == MAP_FAILED ? NULL : (const char*)_addr; }
+            size_t size() const { return _size; }
+    };
+
+    /* Serializes values into an in-memory buffer */
+    class Writer {
+        std::string _buf;
+        public:
+            template <typename T>
+            void put(T value) {
+                _buf.append((const char*)&value, sizeof(T));
+            }
+            void put(const std::string& str) {
+                put<uint32_t>(str.size());
+                _buf.append(str);
+            }
+            void put(const std::vector<std::string>& strs) {
+                put<uint32_t>(strs.size());
+                for (const std::string& str : strs)
+                    put(str);
+            }
+            void put(const char* bytes, size_t size) {
+                _buf.append(bytes, size);
+            }
+            void put(const TupleView& tuples, const msys::IdList& pos) {
+                put<uint32_t>(tuples.size());
+                for (IdSpan tuple : tuples)
+                    for (msys::Id atom : tuple)
+                        put<uint32_t>(pos[atom]);
+            }
+            void put(msys::ParamTablePtr table, const msys::IdList& rows);
+            const std::string& buffer() const { return _buf; }
+    };
+
+    void Writer::put(msys::ParamTablePtr table, const msys::IdList& rows) {
+        put<uint32_t>(rows.size());
+        put<uint32_t>(table->propCount());
+        for (msys::Id col = 0; col < table->propCount(); ++col) {
+            put(table->propName(col));
+            switch (table->propType(col)) {
+                case msys::IntType:
+                    put<uint8_t>(IntColumn);
+                    for (msys::Id row : rows)
+                        put<int64_t>(table->value(row, col).asInt());
+                    break;
+                case msys::FloatType:
+                    put<uint8_t>(FloatColumn);
+                    for (msys::Id row : rows)
+                        put<double>(table->value(row, col).asFloat());
+                    break;
+                default: {
+                    put<uint8_t>(StringColumn);
+                    std::string blob;
+                    for (msys::Id row : rows) {
+                        blob += table->value(row, col).asString();
+                        put<uint32_t>(blob.size());
+                    }
+                    put(blob.data(), blob.size());
+                }
+            }
+        }
+    }
+
+    /* Reads values from a mapped file, checking bounds */
+    class Reader {
+        const char* _ptr;
+        const char* _end;
+        public:
+            Reader(const char* data, size_t size)
+            : _ptr(data), _end(data + size) { }
+
+            const char* take(size_t size) {
+                if (size_t(_end - _ptr) < size)
+                    VIPARR_FAIL("Compiled forcefield is truncated");
+                const char* ptr = _ptr;
+                _ptr += size;
+                return ptr;
+            }
+            template <typename T>
+            T get() {
+                T value;
+                memcpy(&value, take(sizeof(T)), sizeof(T));
+                return value;
+            }
+            std::string str() {
+                uint32_t size = get<uint32_t>();
+                return std::string(take(size), size);
+            }
+            std::vector<std::string> strs() {
+                std::vector<std::string> strs(get<uint32_t>());
+                for (std::string& str : strs)
+                    str = this->str();
+                return strs;
+            }
+            msys::IdList tuple(unsigned arity, const msys::IdList& ids) {
+                msys::IdList tuple(arity);
+                for (unsigned i = 0; i < arity; ++i) {
+                    uint32_t pos = get<uint32_t>();
+                    if (pos >= ids.size())
+                        VIPARR_FAIL("Compiled forcefield has invalid atom "
+                                "index");
+                    tuple[i] = ids[pos];
+                }
+                return tuple;
+            }
+            msys::ParamTablePtr table();
+    };
+
+    msys::ParamTablePtr Reader::table() {
+        uint32_t nrows = get<uint32_t>();
+        uint32_t ncols = get<uint32_t>();
+        msys::ParamTablePtr table = msys::ParamTable::create();
+        for (uint32_t i = 0; i < nrows; ++i)
+            table->addParam();
+        for (uint32_t col = 0; col < ncols; ++col) {
+            std::string name = str();
+            switch (get<uint8_t>()) {
+                case IntColumn: {
+                    table->addProp(name, msys::IntType);
+                    const char* values = take(nrows * sizeof(int64_t));
+                    for (uint32_t row = 0; row < nrows; ++row) {
+                        int64_t value;
+                        memcpy(&value, values + row * sizeof(value),
+                                sizeof(value));
+                        table->value(row, col) = value;
+                    }
+                    break;
+                }
+                case FloatColumn: {
+                    table->addProp(name, msys::FloatType);
+                    const char* values = take(nrows * sizeof(double));
+                    for (uint32_t row = 0; row < nrows; ++row) {
+                        double value;
+                        memcpy(&value, values + row * sizeof(value),
+                                sizeof(value));
+                        table->value(row, col) = value;
+                    }
+                    break;
+                }
+                case StringColumn: {
+                    table->addProp(name, msys::StringType);
+                    const char* ends = take(nrows * sizeof(uint32_t));
+                    uint32_t size = 0;
+                    if (nrows > 0)
+                        memcpy(&size, ends + (nrows - 1) * sizeof(size),
+                                sizeof(size));
+                    const char* blob = take(size);
+                    uint32_t begin = 0;
+                    for (uint32_t row = 0; row < nrows; ++row) {
+                        uint32_t end;
+                        memcpy(&end, ends + row * sizeof(end), sizeof(end));
+                        if (end < begin || end > size)
+                            VIPARR_FAIL("Compiled forcefield has invalid "
+                                    "string column");
+                        table->value(row, col)
+                            = std::string(blob + begin, end - begin);
+                        begin = end;
+                    }
+                    break;
+                }
+                default:
+                    VIPARR_FAIL("Compiled forcefield has invalid column type");
+            }
+        }
+        return table;
+    }
+
+    void WriteTemplate(Writer& out, TemplatedSystemPtr tpl) {
+        msys::SystemPtr sys = tpl->system();
+        msys::IdList atoms = sys->atoms();
+        msys::IdList pos(sys->maxAtomId(), msys::BadId);
+        for (unsigned i = 0; i < atoms.size(); ++i)
+            pos[atoms[i]] = i;
+        msys::Id memo = sys->atomPropIndex("memo");
+
+        out.put(sys->residueCount() > 0 ? sys->residue(0).name
+                : std::string());
+        out.put(tpl->hash());
+        out.put<uint32_t>(atoms.size());
+        for (msys::Id atom : atoms) {
+            const msys::atom_t& atm = sys->atom(atom);
+            out.put(atm.name);
+            out.put<int32_t>(atm.atomic_number);
+            out.put<double>(atm.charge);
+            out.put(memo == msys::BadId ? std::string()
+                    : sys->atomPropValue(atom, memo).asString());
+            out.put(tpl->btype(atom));
+            out.put(tpl->nbtype(atom));
+            out.put(tpl->pset(atom));
+        }
+        msys::IdList bonds = sys->bonds();
+        out.put<uint32_t>(bonds.size());
+        for (msys::Id bond : bonds) {
+            out.put<uint32_t>(pos[sys->bond(bond).i]);
+            out.put<uint32_t>(pos[sys->bond(bond).j]);
+            out.put<uint8_t>(tpl->aromatic(bond));
+        }
+        out.put(tpl->exclusions(), pos);
+        out.put(tpl->impropers(), pos);
+        out.put(tpl->cmaps(), pos);
+        out.put<uint32_t>(tpl->pseudoTypes().size());
+        for (const TemplatedSystem::PseudoType& ptype : tpl->pseudoTypes()) {
+            out.put(ptype.name);
+            out.put<uint32_t>(ptype.nsites);
+            out.put<uint32_t>(ptype.sites_list.size());
+            for (const msys::IdList& sites : ptype.sites_list)
+                for (msys::Id atom : sites)
+                    out.put<uint32_t>(pos[atom]);
+        }
+    }
+
+    /* Rebuilds a template as ImportTemplates would create it, and stores
+     * its precomputed graph hash */
+    TemplatedSystemPtr ReadTemplate(Reader& in) {
+        TemplatedSystemPtr tpl = TemplatedSystem::create();
+        msys::SystemPtr sys = tpl->system();
+        msys::Id res = sys->addResidue(sys->addChain());
+        sys->residue(res).name = in.str();
+        std::string hash = in.str();
+        sys->addAtomProp("memo", msys::StringType);
+
+        msys::IdList ids(in.get<uint32_t>());
+        for (unsigned i = 0; i < ids.size(); ++i) {
+            msys::Id atom = ids[i] = sys->addAtom(res);
+            msys::atom_t& atm = sys->atom(atom);
+            atm.name = in.str();
+            atm.atomic_number = in.get<int32_t>();
+            atm.charge = in.get<double>();
+            sys->atomPropValue(atom, "memo") = in.str();
+            std::string btype = in.str();
+            std::string nbtype = in.str();
+            std::string pset = in.str();
+            tpl->setTypes(atom, btype, nbtype, pset);
+        }
+        for (uint32_t i = 0, n = in.get<uint32_t>(); i < n; ++i) {
+            msys::IdList bond = in.tuple(2, ids);
+            bool arom = in.get<uint8_t>();
+            msys::Id id = sys->addBond(bond[0], bond[1]);
+            if (arom)
+                tpl->setAromatic(id, true);
+        }
+        for (uint32_t i = 0, n = in.get<uint32_t>(); i < n; ++i)
+            tpl->addExclusion(in.tuple(2, ids));
+        for (uint32_t i = 0, n = in.get<uint32_t>(); i < n; ++i)
+            tpl->addImproper(in.tuple(4, ids));
+        for (uint32_t i = 0, n = in.get<uint32_t>(); i < n; ++i)
+            tpl->addCmap(in.tuple(8, ids));
+        for (uint32_t i = 0, n = in.get<uint32_t>(); i < n; ++i) {
+            std::string name = in.str();
+            unsigned nsites = in.get<uint32_t>();
+            tpl->addPseudoType(name, nsites);
+            for (uint32_t j = 0, m = in.get<uint32_t>(); j < m; ++j)
+                tpl->addPseudoSites(name, in.tuple(nsites, ids));
+        }
+        tpl->setHash(hash);
+        return tpl;
+    }
+
+    /* Reads and checks the header; returns the source hash */
+    uint64_t ReadHeader(Reader& in) {
+        if (memcmp(in.take(sizeof(Magic)), Magic, sizeof(Magic)) != 0)
+            VIPARR_FAIL("Not a compiled forcefield");
+        if (in.get<uint32_t>() != Version)
+            VIPARR_FAIL("Unsupported compiled forcefield version");
+        in.get<uint32_t>();
+        return in.get<uint64_t>();
+    }
+
+    /* Whether in starts with the header of a compiled forcefield with the
+     * given source hash; unlike ReadHeader, never throws */
+    bool HasHeader(Reader& in, size_t size, uint64_t source_hash) {
+        if (size < sizeof(Magic) + 2 * sizeof(uint32_t) + sizeof(uint64_t))
+            return false;
+        if (memcmp(in.take(sizeof(Magic)), Magic, sizeof(Magic)) != 0)
+            return false;
+        if (in.get<uint32_t>() != Version)
+            return false;
+        in.get<uint32_t>();
+        return in.get<uint64_t>() == source_hash;
+    }
+
+    /* Writes the compiled form of dir, whose ForcefieldDirectoryHash is
+     * source_hash, to path */
+    void WriteCompiledForcefield(const std::string& dir,
+            const std::string& path, bool require_rules,
+            uint64_t source_hash) {
+
+        /* Import into a private context, so that exporting neither reads
+         * nor adds rows to the caller's param tables */
+        ForcefieldPtr ff = ImportForcefield(dir, require_rules,
+                std::map<std::string, std::list<msys::Id> >(), false,
+                ForcefieldContext::create());
+
+        Writer out;
+        out.put(Magic, sizeof(Magic));
+        out.put<uint32_t>(Version);
+        out.put<uint32_t>(0);
+        out.put<uint64_t>(source_hash);
+
+        RulesPtr rules = ff->rules();
+        out.put(rules->info);
+        out.put(rules->vdw_func);
+        out.put(rules->vdw_comb_rule);
+        out.put(rules->plugins);
+        out.put<uint8_t>(rules->fatal);
+        out.put(rules->nbfix_identifier);
+        out.put<uint32_t>(rules->exclusions());
+        for (unsigned i = 2; i <= rules->exclusions(); ++i)
+            out.put<double>(rules->es_scale(i));
+        for (unsigned i = 2; i <= rules->exclusions(); ++i)
+            out.put<double>(rules->lj_scale(i));
+
+        std::vector<TemplatedSystemPtr> templates = ff->typer()->templates();
+        out.put<uint32_t>(templates.size());
+        for (TemplatedSystemPtr tpl : templates)
+            WriteTemplate(out, tpl);
+
+        std::vector<std::string> tables = ff->paramTables();
+        out.put<uint32_t>(tables.size());
+        for (const std::string& name : tables) {
+            const std::list<msys::Id>& rows = ff->rowIDs(name);
+            out.put(name);
+            out.put(ff->context()->paramTable(name),
+                    msys::IdList(rows.begin(), rows.end()));
+        }
+
+        out.put<uint32_t>(ff->cmapTables().size());
+        for (msys::ParamTablePtr cmap : ff->cmapTables())
+            out.put(cmap, cmap->params());
+
+        /* Write to a temporary file and rename it into place, so that a
+         * concurrent reader never maps a partially written file */
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream file(tmp.c_str(), std::ios::binary);
+            file.write(out.buffer().data(), out.buffer().size());
+            if (!file)
+                VIPARR_FAIL("Error writing " + tmp);
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0)
+            VIPARR_FAIL("Cannot rename " << tmp << " to " << path << ": "
+                    << strerror(errno));
+    }
+
+    /* Reads the body of a compiled forcefield for dir, following its
+     * header */
+    ForcefieldPtr ReadCompiledForcefield(Reader& in, const std::string& dir,
+            const std::map<std::string, std::list<msys::Id> >&
+            share_params, ForcefieldContextPtr context) {
+
+        RulesPtr rules = Rules::create();
+        rules->info = in.strs();
+        rules->vdw_func = in.str();
+        rules->vdw_comb_rule = in.str();
+        rules->plugins = in.strs();
+        rules->fatal = in.get<uint8_t>();
+        rules->nbfix_identifier = in.str();
+        unsigned exclusions = in.get<uint32_t>();
+        if (exclusions == 0)
+            VIPARR_FAIL("Compiled forcefield has invalid exclusion rule");
+        std::vector<double> es_scale(exclusions - 1);
+        std::vector<double> lj_scale(exclusions - 1);
+        for (double& scale : es_scale)
+            scale = in.get<double>();
+        for (double& scale : lj_scale)
+            scale = in.get<double>();
+        rules->setExclusions(exclusions, es_scale, lj_scale);
+
+        TemplateTyperPtr typer = TemplateTyper::create();
+        ForcefieldPtr ff = Forcefield::create(rules, typer, context);
+
+        for (uint32_t i = 0, n = in.get<uint32_t>(); i < n; ++i)
+            typer->addTemplate(ReadTemplate(in));
+
+        for (uint32_t i = 0, n = in.get<uint32_t>(); i < n; ++i) {
+            std::string name = in.str();
+            msys::ParamTablePtr table = in.table();
+            std::map<std::string, std::list<msys::Id> >::const_iterator
+                share_iter = share_params.find(name);
+            std::list<msys::Id> rows = append_params::AppendParams<
+                std::list<msys::Id> >(ff->context(), table, name,
+                        share_iter == share_params.end()
+                        ? std::list<msys::Id>() : share_iter->second);
+            ff->appendParams(name, rows);
+        }
+
+        for (uint32_t i = 0, n = in.get<uint32_t>(); i < n; ++i)
+            ff->addCmapTable(in.table());
+
+        ff->name = dir;
+        return ff;
+    }
+}
+
+namespace desres { namespace viparr {
+
+    uint64_t ForcefieldDirectoryHash(const std::string& dir) {
+        if (!fs::is_directory(dir))
+            VIPARR_FAIL("Forcefield directory " + dir + " not found");
+        std::vector<std::string> names = fs::iter_directory(dir);
+        std::sort(names.begin(), names.end());
+        uint64_t h = HashWord(0x9e3779b97f4a7c15ULL, Version);
+        for (const std::string& name : names) {
+            if (!IsForcefieldFile(dir, name))
+                continue;
+            h = HashBytes(h, name.data(), name.size());
+            MappedFile file(dir + "/" + name);
+            h = HashBytes(h, file.data(), file.size());
+        }
+        return h;
+    }
+
+    void ExportCompiledForcefield(const std::string& dir,
+            const std::string& path, bool require_rules) {
+        WriteCompiledForcefield(dir, path, require_rules,
+                ForcefieldDirectoryHash(dir));
+    }
+
+    bool CompiledForcefieldIsCurrent(const std::string& path,
+            const std::string& dir) {
+        if (!fs::exists(path))
+            return false;
+        try {
+            uint64_t source_hash = ForcefieldDirectoryHash(dir);
+            MappedFile file(path);
+            Reader in(file.data(), file.size());
+            return HasHeader(in, file.size(), source_hash);
+        } catch (std::exception& e) {
+            return false;
+        }
+    }
+
+    ForcefieldPtr ImportCompiledForcefield(const std::string& path,
+            const std::string& dir,
+            const std::map<std::string, std::list<msys::Id> >&
+            share_params, ForcefieldContextPtr context) {
+
+        MappedFile file(path);
+        Reader in(file.data(), file.size());
+        if (ReadHeader(in) != ForcefieldDirectoryHash(dir))
+            VIPARR_FAIL("Compiled forcefield " + path + " is out of date "
+                    "with " + dir);
+        return ReadCompiledForcefield(in, dir, share_params, context);
+    }
+
+    ForcefieldPtr ImportCachedForcefield(const std::string& dir,
+            const std::string& cache, bool require_rules,
+            const std::map<std::string, std::list<msys::Id> >&
+            share_params, ForcefieldContextPtr context) {
+
+        /* Hash dir once, for both the check and a rewrite */
+        uint64_t source_hash = ForcefieldDirectoryHash(dir);
+        if (fs::exists(cache)) {
+            MappedFile file(cache);
+            Reader in(file.data(), file.size());
+            if (HasHeader(in, file.size(), source_hash))
+                return ReadCompiledForcefield(in, dir, share_params, context);
+        }
+        WriteCompiledForcefield(dir, cache, require_rules, source_hash);
+        MappedFile file(cache);
+        Reader in(file.data(), file.size());
+        ReadHeader(in);
+        return ReadCompiledForcefield(in, dir, share_params, context);
+    }
+
+}}
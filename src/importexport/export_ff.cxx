@@ -21,14 +21,14 @@ namespace desres { namespace viparr {
                     + ": " + e.what());
         }
         for (msys::Id param : ff->rowIDs("vdw1")) {
-            if (Forcefield::ParamTable("vdw1")->value(param,
+            if (ff->context()->paramTable("vdw1")->value(param,
                         "nbfix_identifier").asString()
                     != ff->rules()->nbfix_identifier)
                 VIPARR_FAIL("Cannot export forcefield: nbfix_identifier values"
                         " in vdw1 table do not match value in rules");
         }
         for (msys::Id param : ff->rowIDs("vdw2")) {
-            if (Forcefield::ParamTable("vdw2")->value(param,
+            if (ff->context()->paramTable("vdw2")->value(param,
                         "nbfix_identifier").asString()
                     != ff->rules()->nbfix_identifier)
                 VIPARR_FAIL("Cannot export forcefield: nbfix_identifier values"
@@ -62,7 +62,7 @@ namespace desres { namespace viparr {
             std::string name = tables[i];
             auto param_path = dir + "/" + tables[i];
             try {
-                ExportParams(Forcefield::ParamTable(name), rows, param_path);
+                ExportParams(ff->context()->paramTable(name), rows, param_path);
             } catch(std::exception& e) {
                 VIPARR_FAIL("Error writing " + param_path
                         + ": " + e.what());
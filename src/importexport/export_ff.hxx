@@ -14,6 +14,16 @@ namespace desres { namespace viparr {
      * Templates are not exported with a SmartsTyper. */
     void ExportForcefield(ForcefieldPtr ff, const std::string& dir);
 
+    /* Import the forcefield directory dir and write it to path as a
+     * compiled forcefield, holding the rules, the templates with their
+     * graph hashes, the forcefield's rows of each param table in columnar
+     * form, and the cmap tables, keyed by ForcefieldDirectoryHash(dir).
+     * Unlike the other exports, an existing file at path is replaced, so
+     * that a stale compiled forcefield can be rewritten in place. See
+     * ImportCompiledForcefield. */
+    void ExportCompiledForcefield(const std::string& dir,
+            const std::string& path, bool require_rules=true);
+
     /* Export individual forcefield files. "path" must specify a non-existent
      * file; exports will not overwrite existing files. Rules are exported
      * with default values. All templates are exported to a single file.
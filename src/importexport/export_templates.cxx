@@ -73,7 +73,7 @@ namespace {
 
         dfj::Json jexcls;
         jexcls.to_array();
-        const std::vector<msys::IdList>& excls = tpl->exclusions();
+        const TupleArray<2>& excls = tpl->exclusions();
         for (unsigned i = 0; i < excls.size(); ++i) {
             dfj::Json jexcl;
             jexcl.to_array();
@@ -84,7 +84,7 @@ namespace {
 
         dfj::Json jimprs;
         jimprs.to_array();
-        const std::vector<msys::IdList>& imprs = tpl->impropers();
+        const TupleArray<4>& imprs = tpl->impropers();
         for (unsigned i = 0; i < imprs.size(); ++i) {
             dfj::Json jimpr;
             jimpr.to_array();
@@ -95,7 +95,7 @@ namespace {
 
         dfj::Json jcmaps;
         jcmaps.to_array();
-        const std::vector<msys::IdList>& cmaps = tpl->cmaps();
+        const TupleArray<8>& cmaps = tpl->cmaps();
         for (unsigned i = 0; i < cmaps.size(); ++i) {
             dfj::Json jcmap;
             jcmap.to_array();
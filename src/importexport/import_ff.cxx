@@ -1,12 +1,35 @@
 #include "import_ff.hxx"
+#include "../append_params.hxx"
+#include "../util/parallel.hxx"
 #include <msys/fastjson/parse.hxx>
 
 namespace dfj = desres::msys::fastjson;
 
+namespace {
+    using namespace desres;
+    using namespace desres::viparr;
+
+    /* Contents of one template, param, or cmap file */
+    struct FileContents {
+        std::vector<TemplatedSystemPtr> templates;
+        std::vector<msys::ParamTablePtr> cmaps;
+        msys::ParamTablePtr params;
+        std::string error;
+    };
+
+    void WarnParamsNotLoaded(const std::string& path,
+            const std::string& error) {
+        //VIPARR_FAIL("Error loading " + path + ": " + error);
+        VIPARR_ERR << "\n\a!!!WARNING: failed to load " << path << ": " << error;
+        VIPARR_ERR << "\n\aContinuing anyway, but BEWARE this missing component.\n\n";
+    }
+}
+
 namespace desres { namespace viparr {
 
     ForcefieldPtr ImportForcefield(const std::string& dir, bool require_rules,
-            const std::map<std::string, std::list<msys::Id> >& share_params) {
+            const std::map<std::string, std::list<msys::Id> >& share_params,
+            bool lazy, ForcefieldContextPtr context) {
 
         if (!fs::exists(dir))
             VIPARR_FAIL("Forcefield directory not found");
@@ -34,9 +57,11 @@ namespace desres { namespace viparr {
             typer = TemplateTyper::create();
 
         /* Create forcefield */
-        ForcefieldPtr ff = Forcefield::create(rules, typer);
+        ForcefieldPtr ff = Forcefield::create(rules, typer, context);
 
-        /* Process template, param, and cmap files */
+        /* Collect template, param, and cmap files */
+        std::vector<std::string> names;
+        std::vector<std::string> nbfix_identifiers;
         for (auto& name : fs::iter_directory(dir)) {
             auto path = dir + "/" + name;
 
@@ -50,59 +75,110 @@ namespace desres { namespace viparr {
               if(name.substr(name.size()-4) == ".def")
                 continue;
 
+            std::string nbfix_identifier;
+            if (name == "vdw1")
+                nbfix_identifier = rules->nbfix_identifier;
+            else if (name == "vdw2") {
+                if (rules->nbfix_identifier == "")
+                    VIPARR_FAIL("Cannot have vdw2 table without "
+                            "nbfix_identifier in rules file");
+                nbfix_identifier = rules->nbfix_identifier;
+            }
+            names.push_back(name);
+            nbfix_identifiers.push_back(nbfix_identifier);
+        }
+
+        /* Parse the files concurrently, each into its own tables and
+         * templates without touching any shared state, then add them to
+         * the forcefield in directory order below, so that row ids are the
+         * same as for a serial import */
+        std::vector<FileContents> contents(names.size());
+        ViparrParallelFor(names.size(), [&](unsigned i) {
+            const std::string& name = names[i];
+            auto path = dir + "/" + name;
+            try {
+                if (name.substr(0,9) == "templates")
+                    contents[i].templates = ImportTemplates(path);
+                else if (lazy)
+                    return;
+                else if (name == "cmap")
+                    contents[i].cmaps = ImportCmap(path);
+                else
+                    contents[i].params = ReadParams(name, path,
+                            nbfix_identifiers[i]);
+            } catch (std::exception& e) {
+                contents[i].error = e.what();
+            }
+        });
+
+        for (unsigned i = 0; i < names.size(); ++i) {
+            const std::string& name = names[i];
+            auto path = dir + "/" + name;
+            const FileContents& file = contents[i];
+
             /* Import templates */
             if (name.substr(0,9) == "templates") {
-                std::vector<TemplatedSystemPtr> templates;
-                try {
-                    templates = ImportTemplates(path);
-                } catch (std::exception& e) {
-                    VIPARR_FAIL("Error loading " + path + ": " + e.what());
-                }
-                for (unsigned i = 0; i < templates.size(); ++i)
-                    typer->addTemplate(templates[i]);
+                if (!file.error.empty())
+                    VIPARR_FAIL("Error loading " + path + ": " + file.error);
+                for (TemplatedSystemPtr tpl : file.templates)
+                    typer->addTemplate(tpl);
                 continue;
             }
 
             /* Import cmap tables */
             if (name == "cmap") {
-                std::vector<msys::ParamTablePtr> cmaps;
-                try {
-                    cmaps = ImportCmap(path);
-                } catch (std::exception& e) {
-                    VIPARR_FAIL("Error loading " + path + ": " + e.what());
+                if (lazy) {
+                    ff->deferCmapTables([path]()
+                            -> std::vector<msys::ParamTablePtr> {
+                        try {
+                            return ImportCmap(path);
+                        } catch (std::exception& e) {
+                            VIPARR_FAIL("Error loading " + path + ": "
+                                    + e.what());
+                        }
+                    });
+                    continue;
                 }
-                for (unsigned i = 0; i < cmaps.size(); ++i)
-                    ff->addCmapTable(cmaps[i]);
+                if (!file.error.empty())
+                    VIPARR_FAIL("Error loading " + path + ": " + file.error);
+                for (msys::ParamTablePtr cmap : file.cmaps)
+                    ff->addCmapTable(cmap);
                 continue;
             }
 
             /* Treat remaining files as param tables. */
-            std::string nbfix_identifier;
-            if (name == "vdw1")
-                nbfix_identifier = rules->nbfix_identifier;
-            else if (name == "vdw2") {
-                if (rules->nbfix_identifier == "")
-                    VIPARR_FAIL("Cannot have vdw2 table without "
-                            "nbfix_identifier in rules file");
-                nbfix_identifier = rules->nbfix_identifier;
-            } else
-                nbfix_identifier = "";
-
-            std::list<msys::Id> rows;
+            std::list<msys::Id> share;
             std::map<std::string, std::list<msys::Id> >::const_iterator
                 share_iter = share_params.find(name);
+            if (share_iter != share_params.end())
+                share = share_iter->second;
+            if (lazy) {
+                std::string nbfix_identifier = nbfix_identifiers[i];
+                ForcefieldContextPtr ctx = ff->context();
+                ff->deferParams(name, [name, path, share, nbfix_identifier,
+                        ctx]() -> std::list<msys::Id> {
+                    try {
+                        return ImportParams(name, path, share,
+                                nbfix_identifier, ctx);
+                    } catch (std::exception& e) {
+                        WarnParamsNotLoaded(path, e.what());
+                        return std::list<msys::Id>();
+                    }
+                });
+                continue;
+            }
+            if (!file.error.empty()) {
+                WarnParamsNotLoaded(path, file.error);
+                continue;
+            }
+            if (file.params == msys::ParamTablePtr())
+                continue;
             try {
-                if (share_iter == share_params.end())
-                    rows = ImportParams(name, path, std::list<msys::Id>(),
-                            nbfix_identifier);
-                else
-                    rows = ImportParams(name, path, share_iter->second,
-                            nbfix_identifier);
-                ff->appendParams(name, rows);
+                ff->appendParams(name, append_params::AppendParams<
+                        std::list<msys::Id> >(ff->context(), file.params,
+                            name, share));
             } catch (std::exception& e) {
-              //VIPARR_FAIL("Error loading " + path + ": " + e.what());
-              VIPARR_ERR << "\n\a!!!WARNING: failed to load " << path << ": " << e.what();
-              VIPARR_ERR << "\n\aContinuing anyway, but BEWARE this missing component.\n\n";
+                WarnParamsNotLoaded(path, e.what());
             }
         }
 
@@ -21,11 +21,51 @@ namespace desres { namespace viparr {
      * share_params is true, a check is performed to see if an identical row
      * exists before importing, and if so, a new row is not created.
      * The rowID map key is always the file name. The SharedParamTables key is
-     * the file name. */
+     * the file name. If lazy is true, param files and "cmap" are only
+     * located here, and each is imported when its rows or shared table are
+     * first accessed (see Forcefield::deferParams), so tables that are
+     * never used are never read. The param tables are those of context, or
+     * of ForcefieldContext::Current() if context is null. */
     ForcefieldPtr ImportForcefield(const std::string& dir,
             bool require_rules=true,
             const std::map<std::string, std::list<msys::Id> >&
-            share_params=std::map<std::string, std::list<msys::Id> >());
+            share_params=std::map<std::string, std::list<msys::Id> >(),
+            bool lazy=false,
+            ForcefieldContextPtr context=ForcefieldContextPtr());
+
+    /* Import a forcefield from a compiled forcefield file written by
+     * ExportCompiledForcefield from dir; the result is the same as that of
+     * ImportForcefield(dir), and share_params has the same meaning. The
+     * file is memory-mapped and read in one pass with no parsing or graph
+     * hashing, but it is not used in place: each param row is copied into
+     * the context's param tables and each template is rebuilt as a
+     * TemplatedSystem. Fails if the file is not current with the contents
+     * of dir. */
+    ForcefieldPtr ImportCompiledForcefield(const std::string& path,
+            const std::string& dir,
+            const std::map<std::string, std::list<msys::Id> >&
+            share_params=std::map<std::string, std::list<msys::Id> >(),
+            ForcefieldContextPtr context=ForcefieldContextPtr());
+
+    /* Import dir through the compiled forcefield file cache: from cache if
+     * it is current with the contents of dir, and otherwise by rewriting
+     * cache with ExportCompiledForcefield and importing that. dir is
+     * hashed once, for both the check and the rewrite. */
+    ForcefieldPtr ImportCachedForcefield(const std::string& dir,
+            const std::string& cache, bool require_rules=true,
+            const std::map<std::string, std::list<msys::Id> >&
+            share_params=std::map<std::string, std::list<msys::Id> >(),
+            ForcefieldContextPtr context=ForcefieldContextPtr());
+
+    /* Whether path is a compiled forcefield that is current with the
+     * contents of dir */
+    bool CompiledForcefieldIsCurrent(const std::string& path,
+            const std::string& dir);
+
+    /* Hash of the names and contents of the files of a forcefield
+     * directory that are read by ImportForcefield, identifying the source
+     * of a compiled forcefield */
+    uint64_t ForcefieldDirectoryHash(const std::string& dir);
 
     /* Format:
      * { "info" : [string, ... , string]
@@ -105,7 +145,8 @@ namespace desres { namespace viparr {
      * column is a ' '-concatenation of all of the "type" fields. If table is
      * "vdw1" or "vdw2", adds column named "nbfix_identifier" and sets value
      * for all imported rows to the given value. A list of added rows is
-     * returned.
+     * returned. The tables are those of context, or of
+     * ForcefieldContext::Current() if context is null.
      *
      * Format:
      * [
@@ -124,7 +165,15 @@ namespace desres { namespace viparr {
     std::list<msys::Id> ImportParams(const std::string& table_name,
             const std::string& path, const std::list<msys::Id>&
             share_params=std::list<msys::Id>(),
-            const std::string& nbfix_identifier="");
+            const std::string& nbfix_identifier="",
+            ForcefieldContextPtr context=ForcefieldContextPtr());
+
+    /* Parse a parameter file into a new param table with the columns and
+     * rows described for ImportParams, without adding it to the shared
+     * tables; returns NULL if the file has no rows. Does not modify any
+     * shared state, so several files may be read concurrently. */
+    msys::ParamTablePtr ReadParams(const std::string& table_name,
+            const std::string& path, const std::string& nbfix_identifier="");
 
 }}
 
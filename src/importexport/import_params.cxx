@@ -8,7 +8,60 @@ using namespace desres;
 
 std::list<msys::Id> desres::viparr::ImportParams(const std::string& name,
         const std::string& path, const std::list<msys::Id>& share_params,
-        const std::string& nbfix_identifier) {
+        const std::string& nbfix_identifier, ForcefieldContextPtr context) {
+
+    msys::ParamTablePtr param_table = ReadParams(name, path,
+            nbfix_identifier);
+    if (param_table == msys::ParamTablePtr())
+        return std::list<msys::Id>();
+
+    /* Append new param table to existing table, if present */
+    std::list<msys::Id> rows = append_params::AppendParams<
+        std::list<msys::Id> >(context ? context : ForcefieldContext::Current(),
+                param_table, name, share_params);
+
+#if 0
+    /* For each added type with modes, create a new row in the param table with
+     * pointers to the mode rows */
+    msys::ParamTablePtr ptable = Forcefield::ParamTable(name);
+    std::map<std::string, msys::Id> type_map;
+    std::list<msys::Id> new_rows;
+    for (unsigned i = 0; i < rows.size(); ++i) {
+        std::string type = ptable->value(rows[i], "type").asString();
+        if (type.substr(0,8) != "__mode__") {
+            new_rows.push_back(rows[i]);
+            continue;
+        }
+        std::string raw_type = type.substr(type.find_first_of(" ") + 1);
+        std::map<std::string, msys::Id>::iterator iter
+            = type_map.find(raw_type);
+        if (iter == type_map.end()) {
+            msys::Id param = ptable->addParam();
+            /* Set starting values of new row to those of the first encountered
+             * mode */
+            for (unsigned j = 0; j < ptable->propCount(); ++j) {
+                if (ptable->propName(j) == "type")
+                    ptable->value(param, j) = raw_type;
+                else if (ptable->propName(j).substr(0,5) != "mode_")
+                    ptable->value(param, j) = ptable->value(rows[i], j);
+            }
+            /* Add new row to returned rows */
+            new_rows.push_back(param);
+            iter = type_map.insert(std::make_pair(raw_type, param)).first;
+        }
+        std::string mode_name = type.substr(8, type.find_first_of(" ")-8);
+        /* Set the 'mode_...' column to 1 + rowID of the mode row; we add 1
+         * because if new rows are added to the param table without modes,
+         * their 'mode_...' values are set by default to 0 */
+        ptable->value(iter->second, "mode_" + mode_name) = rows[i] + 1;
+    }
+    return new_rows;
+#endif
+    return rows;
+}
+
+desres::msys::ParamTablePtr desres::viparr::ReadParams(const std::string& name,
+        const std::string& path, const std::string& nbfix_identifier) {
 
     if (!fs::exists(path))
         VIPARR_FAIL("File not found");
@@ -21,7 +74,7 @@ std::list<msys::Id> desres::viparr::ImportParams(const std::string& name,
     if (js.kind() != dfj::Json::Array)
         VIPARR_FAIL("Param file must be of array type");
     if (js.size() == 0)
-        return std::list<msys::Id>();
+        return msys::ParamTablePtr();
 
     const dfj::Json& first = js.elem(0);
     if (first.kind() != dfj::Json::Object)
@@ -214,46 +267,5 @@ std::list<msys::Id> desres::viparr::ImportParams(const std::string& name,
         }
     }
 
-    /* Append new param table to existing table, if present */
-    std::list<msys::Id> rows = append_params::AppendParams<
-        std::list<msys::Id> >(param_table, name, share_params);
-
-#if 0
-    /* For each added type with modes, create a new row in the param table with
-     * pointers to the mode rows */
-    msys::ParamTablePtr ptable = Forcefield::ParamTable(name);
-    std::map<std::string, msys::Id> type_map;
-    std::list<msys::Id> new_rows;
-    for (unsigned i = 0; i < rows.size(); ++i) {
-        std::string type = ptable->value(rows[i], "type").asString();
-        if (type.substr(0,8) != "__mode__") {
-            new_rows.push_back(rows[i]);
-            continue;
-        }
-        std::string raw_type = type.substr(type.find_first_of(" ") + 1);
-        std::map<std::string, msys::Id>::iterator iter
-            = type_map.find(raw_type);
-        if (iter == type_map.end()) {
-            msys::Id param = ptable->addParam();
-            /* Set starting values of new row to those of the first encountered
-             * mode */
-            for (unsigned j = 0; j < ptable->propCount(); ++j) {
-                if (ptable->propName(j) == "type")
-                    ptable->value(param, j) = raw_type;
-                else if (ptable->propName(j).substr(0,5) != "mode_")
-                    ptable->value(param, j) = ptable->value(rows[i], j);
-            }
-            /* Add new row to returned rows */
-            new_rows.push_back(param);
-            iter = type_map.insert(std::make_pair(raw_type, param)).first;
-        }
-        std::string mode_name = type.substr(8, type.find_first_of(" ")-8);
-        /* Set the 'mode_...' column to 1 + rowID of the mode row; we add 1
-         * because if new rows are added to the param table without modes,
-         * their 'mode_...' values are set by default to 0 */
-        ptable->value(iter->second, "mode_" + mode_name) = rows[i] + 1;
-    }
-    return new_rows;
-#endif
-    return rows;
+    return param_table;
 }
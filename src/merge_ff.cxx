@@ -12,13 +12,16 @@ namespace desres { namespace viparr {
                 || patch->typer() == TemplateTyperPtr())
             VIPARR_FAIL("Forcefields being merged must have valid Rules and "
                     "Typer objects");
+        if (src->context() != patch->context())
+            VIPARR_FAIL("Forcefields being merged must share a "
+                    "ForcefieldContext");
         MergeRules(src->rules(), patch->rules(), verbose);
         MergeTemplates(src->typer(), patch->typer(), append_only, verbose);
         std::vector<std::string> tables = patch->paramTables();
         for (unsigned i = 0; i < tables.size(); ++i) {
             if (verbose)
                 VIPARR_OUT << "Merging param table " << tables[i] << std::endl;
-            msys::ParamTablePtr ptable = Forcefield::ParamTable(tables[i]);
+            msys::ParamTablePtr ptable = src->context()->paramTable(tables[i]);
             std::list<msys::Id> merged_rows = MergeParams(
                     src->rowIDs(tables[i]), patch->rowIDs(tables[i]), ptable,
                     append_only, verbose);
@@ -1,5 +1,7 @@
 #include "base.hxx"
 #include "parameter_matcher.hxx"
+#include "util/parallel.hxx"
+#include "util/profile.hxx"
 #include "util/util.hxx"
 #include <algorithm>
 #include <cstring>
@@ -10,108 +12,116 @@ using namespace desres::viparr;
 
 namespace {
 
-    /* Match pattern string p to expression string e, where p may
-     * contain wild characters */
-    bool matchString(const std::string& e, const std::string& p, char wild) {
-
-        if (p == "")
-            return (e == "");
+    bool isWild(const Pattern& pattern) {
+        for (unsigned i = 0; i < pattern.atoms.size(); ++i)
+            if (pattern.atoms[i].find(ParameterMatcher::ATOM_WILD)
+                    != std::string::npos)
+                return true;
+        return false;
+    }
 
-        /* Tokenize p by wild characters */
-        std::vector<std::string> tokens;
-        size_t i = 0;
-        while (i < p.size()) {
-            if (p[i] == wild) {
-                ++i;
-            }
-            else {
-                size_t pos = p.find(wild, i);
-                if (pos == std::string::npos)
-                    tokens.push_back(p.substr(i));
-                else
-                    tokens.push_back(p.substr(i,pos-i));
-                i = pos;
-            }
+    /* Index views of a Pattern's atom or bond list (see PermutationIndex):
+     * order(i, n) is the position in a list of length n of the entry that
+     * a Permutation moves to position i. Matching code is instantiated for
+     * each view, so the built-in Permutations cost no virtual calls or
+     * copies. */
+    struct IdentityOrder {
+        unsigned operator()(unsigned i, unsigned n) const { return i; }
+    };
+
+    struct ReverseOrder {
+        unsigned operator()(unsigned i, unsigned n) const { return n-1-i; }
+    };
+
+    struct FixedOrder {
+        explicit FixedOrder(const unsigned* order) : order(order) { }
+        unsigned operator()(unsigned i, unsigned n) const { return order[i]; }
+        const unsigned* order;
+    };
+
+    /* Key for the exact-row index: atom types, in the given order, and
+     * flags, each terminated by a separator character that cannot appear
+     * in a type string. Without wild characters, WildString matching
+     * reduces to string equality, so two Patterns with the same key match
+     * on atoms and flags. */
+    template <class Order>
+    void ExactKey(const Pattern& pattern, const Order& order,
+            std::string& key) {
+        key.clear();
+        unsigned natoms = pattern.atoms.size();
+        for (unsigned i = 0; i < natoms; ++i) {
+            key += pattern.atoms[order(i, natoms)];
+            key += '\x1f';
         }
-
-        int n = tokens.size();
-        if (n == 0) {
-            /* p has all wild characters */
-            return true;
+        key += '\x1e';
+        for (unsigned i = 0; i < pattern.flags.size(); ++i) {
+            key += pattern.flags[i];
+            key += '\x1f';
         }
+    }
 
-        /* Find first possible matching positions for tokens in e */
-        std::vector<size_t> matches(n);
-        matches[0] = e.find(tokens[0]);
-        if (matches[0] == std::string::npos)
-            return false;
-        for (int i = 1; i < n; ++i) {
-            matches[i] = e.find(tokens[i], matches[i-1] + tokens[i-1].size());
-            if (matches[i] == std::string::npos)
-                return false;
+    std::string ExactKey(const Pattern& pattern) {
+        std::string key;
+        ExactKey(pattern, IdentityOrder(), key);
+        return key;
+    }
+
+    /* A FIXED PermutationIndex only applies to Patterns of its size */
+    void CheckFixedSize(const Pattern& pattern, const PermutationIndex& index) {
+        if (pattern.atoms.size() != index.natoms
+                || pattern.bonds.size() != index.nbonds) {
+            std::stringstream msg;
+            msg << "Permutation must be used on patterns with "
+                << index.natoms << " atoms and " << index.nbonds << " bonds";
+            VIPARR_FAIL(msg.str());
         }
+    }
 
-        /* Check current match; if not good, find next match */
-        while (true) {
-            if (p.find(wild) != 0 && matches[0] != 0) {
-                /* p starts with a non-wild, but there are no more matches
-                 * where token[0] matches the start of e */
-                return false;
-            }
-            if (p.find_last_of(wild) == p.size() - 1
-                    || matches[n-1] + tokens[n-1].size() == e.size()) {
-                /* p ends with a wild, or the current match extends to the end
-                 * of e: match is good! */
-                return true;
-            }
-            /* This match does not extend to the end of e; find next match */
-            int i = n - 1;
-            for (; i >= 0; --i) {
-                /* Find next possible matching position for token i */
-                size_t new_match = e.find(tokens[i], matches[i] + 1);
-                if (new_match == std::string::npos)
-                    continue;
-                matches[i] = new_match;
-                /* Find first possible matching positions for tokens i+1
-                 * onward */
-                bool found_next = true;
-                for (int j = i + 1; j < n; ++j) {
-                    new_match = e.find(tokens[j],
-                            matches[j-1] + tokens[j-1].size());
-                    if (new_match == std::string::npos) {
-                        found_next = false;
-                        break;
-                    }
-                    matches[j] = new_match;
-                }
-                if (found_next) {
-                    /* Next possible matching positions were found */
-                    break;
-                }
-                /* Else: Need to find next possible match for token i-1 */
-            }
-            if (i == -1) {
-                /* No more possible matches */
-                return false;
+    /* Code for a bond string in a cache key; the common bond types are
+     * coded directly, and other strings are interned */
+    uint32_t BondCode(const std::string& bond) {
+        if (bond.size() == 1) {
+            switch (bond[0]) {
+                case '-': return 1;
+                case '=': return 2;
+                case '#': return 3;
+                case ':': return 4;
             }
         }
+        return 5 + TypeDictionary::Intern(bond);
     }
 
-    bool matchStringList(const std::vector<std::string>& expr,
-            const std::vector<std::string>& pattern, char wild) {
-        for (unsigned i = 0, n = expr.size(); i < n; ++i) {
-            if (!matchString(expr[i], pattern[i], wild))
-                return false;
-        }
-        return true;
+    /* Signatures of a chunk of tuples in ParameterMatcher::matchAll: ids
+     * numbers each distinct signature, first holds the index of the first
+     * tuple with each signature, and local holds the number of each
+     * tuple's signature. global maps the numbers to their numbers across
+     * all chunks. */
+    struct SignatureChunk {
+        desres::viparr::KeyMap<unsigned> ids;
+        std::vector<unsigned> first;
+        std::vector<unsigned> local;
+        std::vector<unsigned> global;
+    };
+
+    /* Minimum number of tuples per chunk in ParameterMatcher::matchAll */
+    const unsigned MinChunkSize = 4096;
+
+    /* Tuple i of a matchAll() argument as an IdList; flat tuples are
+     * copied into scratch */
+    typedef desres::msys::IdList IdList;
+    const IdList& tupleAt(const std::vector<IdList>& tuples, unsigned i,
+            IdList& scratch) {
+        return tuples[i];
+    }
+    const IdList& tupleAt(const TupleView& tuples, unsigned i,
+            IdList& scratch) {
+        tuples[i].copyTo(scratch);
+        return scratch;
     }
 
-    bool isWild(const Pattern& pattern) {
-        for (unsigned i = 0; i < pattern.atoms.size(); ++i)
-            if (pattern.atoms[i].find(ParameterMatcher::ATOM_WILD)
-                    != std::string::npos)
-                return true;
-        return false;
+    bool lessIndex(const std::pair<int, PermutationPtr>& a,
+            const std::pair<int, PermutationPtr>& b) {
+        return a.first < b.first;
     }
 
 
@@ -128,12 +138,12 @@ namespace desres { namespace viparr {
 
         if (_row_ids.size() == 0)
             VIPARR_FAIL("Forcefield does not have param table " + table);
-        _row_to_row_id = msys::IdList(
-                Forcefield::ParamTable(table)->paramCount(), msys::BadId);
+        _param_table = ff->context()->paramTable(table);
+        _row_to_row_id = msys::IdList(_param_table->paramCount(),
+                msys::BadId);
         for (unsigned i = 0; i < _row_ids.size(); ++i)
             if (_row_ids[i] < _row_to_row_id.size())
                 _row_to_row_id[_row_ids[i]] = i;
-        _param_table = Forcefield::ParamTable(table);
         init(type_to_pattern);
     }
 
@@ -153,10 +163,20 @@ namespace desres { namespace viparr {
         init(type_to_pattern);
     }
 
+    ParameterMatcher::~ParameterMatcher() {
+        if (!ViparrProfiling())
+            return;
+        ViparrProfileCount("matcher/hits", _stats.hits);
+        ViparrProfileCount("matcher/misses", _stats.misses);
+        ViparrProfileCount("matcher/wild_matches", _stats.wild_matches);
+        ViparrProfileCount("matcher/no_matches", _stats.no_matches);
+    }
+
     void ParameterMatcher::init(TypeToPatternPtr type_to_pattern) {
 
         unsigned nrows = _row_ids.size();
         _pattern_list.resize(nrows);
+        _compiled_list.resize(nrows);
         if (nrows > 0)
             match_bonds = ((*type_to_pattern)(_param_table->value(_row_ids[0],
                             "type").asString()).bonds.size() > 0);
@@ -167,8 +187,20 @@ namespace desres { namespace viparr {
                 VIPARR_FAIL("Either all rows or no rows from a parameter "
                         "file can match bond types");
             }
-            isWild(_pattern_list[i]) ?
-                _wilds.push_back(i) : _exacts.push_back(i);
+            const Pattern& pattern = _pattern_list[i];
+            CompiledPattern& compiled = _compiled_list[i];
+            for (unsigned j = 0; j < pattern.atoms.size(); ++j)
+                compiled.atoms.push_back(WildString(pattern.atoms[j],
+                            ATOM_WILD));
+            for (unsigned j = 0; j < pattern.bonds.size(); ++j)
+                compiled.bonds.push_back(WildString(pattern.bonds[j],
+                            BOND_WILD));
+            if (isWild(_pattern_list[i]))
+                _wilds.push_back(i);
+            else {
+                _exacts.push_back(i);
+                _exact_index[ExactKey(_pattern_list[i])].push_back(i);
+            }
         }
     }
 
@@ -200,7 +232,26 @@ namespace desres { namespace viparr {
       return "undetermined_functional_form";
     }
 
+    void ParameterMatcher::enableFingerprint() {
+        _fingerprint_counts.resize(_row_ids.size(), 0);
+        _fingerprint_example_tuples.resize(_row_ids.size());
+    }
+
+    msys::Id ParameterMatcher::recordMatch(int index,
+            const msys::IdList& tuple) {
+        if (index < 0)
+            return msys::BadId;
+        if (!_fingerprint_counts.empty()) {
+            _fingerprint_counts[index]++;
+            _fingerprint_example_tuples[index] = tuple;
+        }
+        return _row_ids[index];
+    }
+
     void ParameterMatcher::print_fingerprint(TemplatedSystemPtr tsys, std::string table_name) {
+      if (_fingerprint_counts.empty() && !_row_ids.empty())
+        VIPARR_FAIL("Fingerprinting was not enabled for this matcher");
+
       /* Stash the id's of virtuals and drudes in std::sets so we can print _ND_ and _A_. */
       auto pseudo_types = tsys->pseudoTypes();
       std::set<msys::Id> virtuals, drudes;
@@ -218,12 +269,14 @@ namespace desres { namespace viparr {
           destination->insert(ids[0]);
       }
       
-      for(const auto & kv : _fingerprint_counts) {
-        msys::Id paramid = _row_ids[kv.first];
+      for(unsigned index = 0; index < _fingerprint_counts.size(); ++index) {
+        if(_fingerprint_counts[index] == 0)
+          continue;
+        msys::Id paramid = _row_ids[index];
 
         std::string param_type;
         if(_param_table->propIndex("type") == msys::BadId)    
-          param_type = _pattern_list[kv.first].print();
+          param_type = _pattern_list[index].print();
         else {
           param_type = _param_table->value(paramid, "type").asString();
           ViparrReplaceAll(param_type, " -", "-");
@@ -232,14 +285,14 @@ namespace desres { namespace viparr {
           ViparrReplaceAll(param_type, "= ", "=");
         }
 
-        std::cout << table_name << ":: " << param_type << " " << kv.second;
+        std::cout << table_name << ":: " << param_type << " " << _fingerprint_counts[index];
 
         /* Now, decide whether to apply one of _A_ or _ND_ types. For
          * now, this designation will be applied based on the
          * pseudo-typeness of the LAST atom in the tuple. */
-        msys::Id designated_particle = _fingerprint_example_tuples[kv.first].back();
+        msys::Id designated_particle = _fingerprint_example_tuples[index].back();
         if(table_name.substr(0,7) == "virtual")
-          designated_particle = _fingerprint_example_tuples[kv.first][0];
+          designated_particle = _fingerprint_example_tuples[index][0];
 
         if(drudes.find(designated_particle) == drudes.end()) {
           if(virtuals.find(designated_particle) == virtuals.end())
@@ -274,34 +327,37 @@ namespace desres { namespace viparr {
       std::cout << "\n";
       */
 
-        /* Generate Pattern from tuple */
-        Pattern sys_pattern = (*_sys_to_pattern)(sys, tuple);
-        StringList base_type = sys_pattern.atoms;
-
         /* If pattern/hierarchies is cached, return cached result */
-        std::stringstream ss;
-        ss << sys_pattern;
-        Cache::const_iterator iter = _cache.find(ss.str());
-//    std::cout << ss.str() << "\n";
+        Pattern sys_pattern;
+        bool has_signature = cacheKey(sys, tuple, sys_pattern, _cache_key);
+        uint64_t hash = Cache::Hash(_cache_key);
+        const CacheEntry* cached = _cache.find(_cache_key, hash);
       
-        if (iter != _cache.end()) {
+        if (cached != NULL) {
+            ++_stats.hits;
             if (perm != NULL)
-                *perm = iter->second.second;
-            //          std::cout << "Found it in the cache\n";
-            msys::Id answer_row_id = iter->second.first;
-            unsigned matched_index = std::find(_row_ids.begin(), _row_ids.end(), answer_row_id) - _row_ids.begin(); //index of answer_row_id in row_ids
-            
-            if(matched_index < _row_ids.size()) {
-              _fingerprint_counts[matched_index]++;
-              _fingerprint_example_tuples[matched_index] = tuple;
-            }
-
-            //std::cout << "Match found: " << _pattern_list[matched_index] << "\n";
-            
-            
-            return answer_row_id;
+                *perm = cached->perm;
+            return recordMatch(cached->index, tuple);
         }
 
+        ++_stats.misses;
+        if (has_signature)
+            sys_pattern = (*_sys_to_pattern)(sys, tuple);
+        PermutationPtr matched_perm;
+        int index = resolve(sys, tuple, sys_pattern, allow_repeat,
+                matched_perm, _stats);
+        if (perm != NULL)
+            *perm = matched_perm;
+        _cache.insert(_cache_key, hash, CacheEntry(index, matched_perm));
+        return recordMatch(index, tuple);
+    }
+
+    int ParameterMatcher::resolve(TemplatedSystemPtr sys,
+            const msys::IdList& tuple, Pattern& sys_pattern,
+            bool allow_repeat, PermutationPtr& perm, Stats& stats) const {
+
+        StringList base_type = sys_pattern.atoms;
+
         /* Generate priority map from atom types for hierarchical matching */
         PriorityMap priority_map = getPriorityMap(sys, tuple);
 
@@ -329,59 +385,43 @@ namespace desres { namespace viparr {
         for (auto iter = priority_map.rbegin(); 
                 iter != priority_map.rend(); ++iter) {
             /* Loop through priority levels */
-            std::set<StringList> priority_level = iter->second;
-            int matched_index = -1;
-            PermutationPtr matched_perm = Permutation::Null;
-            for (unsigned i = 0; i < _exacts.size(); ++i) {
-                /* Loop through exact atom type patterns */
-                Pattern type_pattern = _pattern_list[_exacts[i]];
-                std::set<StringList>::iterator level_iter;
-                for (level_iter = priority_level.begin();
-                        level_iter != priority_level.end(); ++level_iter) {
-                    /* Loop through current priority level */
-                    sys_pattern.atoms = *level_iter;
-                    PermutationPtr tmp_perm = matchPattern(sys_pattern,
-                            type_pattern);
-                    if (tmp_perm != Permutation::Null) { /* Found a match */
-                        if (matched_perm == Permutation::Null) {
-                            /* First match found */
-                            matched_index = _exacts[i];
-                            matched_perm = tmp_perm;
-                        } else if (matched_index != _exacts[i] &&
-                                !allow_repeat) {
-                            /* Matched a different parameter */
-                            std::stringstream msg;
-                            std::string tn = determine_table_name(sys->system()
-                                                                  ,_param_table); 
-                            sys_pattern.atoms = base_type;
-                            msg << "For " << tn << ": "
-                                << "Found two matches for " << sys_pattern 
-                                << " (at the same priority): " << type_pattern
-                                << " and " << _pattern_list[matched_index];
-                            VIPARR_FAIL(msg.str());
-                        }
-                    }
-                }
+            const std::set<StringList>& priority_level = iter->second;
+            ExactMatches exact_matches;
+            std::set<StringList>::const_iterator level_iter;
+            for (level_iter = priority_level.begin();
+                    level_iter != priority_level.end(); ++level_iter) {
+                /* Loop through current priority level */
+                sys_pattern.atoms = *level_iter;
+                matchExacts(sys_pattern, exact_matches);
             }
-            if (matched_perm != Permutation::Null) { /* Match was found */
-                if (perm != NULL)
-                    *perm = matched_perm;
-                _cache.insert(std::make_pair(ss.str(),
-                            CacheEntry(_row_ids[matched_index], matched_perm)));
-                _fingerprint_counts[matched_index]++;
-                _fingerprint_example_tuples[matched_index] = tuple;
-
-                //std::cout << "Match found: " << _pattern_list[matched_index] << "\n";                  
-                
-                return _row_ids[matched_index];
+            if (exact_matches.size() == 0)
+                continue;
+            std::sort(exact_matches.begin(), exact_matches.end(), lessIndex);
+            if (exact_matches.size() > 1 && !allow_repeat) {
+                /* Matched a different parameter */
+                std::stringstream msg;
+                std::string tn = determine_table_name(sys->system()
+                                                      ,_param_table); 
+                sys_pattern.atoms = base_type;
+                msg << "For " << tn << ": "
+                    << "Found two matches for " << sys_pattern 
+                    << " (at the same priority): "
+                    << _pattern_list[exact_matches[1].first]
+                    << " and " << _pattern_list[exact_matches[0].first];
+                VIPARR_FAIL(msg.str());
             }
+            /* Match was found */
+            perm = exact_matches[0].second;
+
+            //std::cout << "Match found: " << _pattern_list[exact_matches[0].first] << "\n";                  
+
+            return exact_matches[0].first;
         }
 
         /* Match wildcard atom type patterns in the order in which they
          * appear, and return the first match */
         for (unsigned i = 0; i < _wilds.size(); ++i) {
             /* Loop through wildcard atom type patterns */
-            Pattern type_pattern = _pattern_list[_wilds[i]];
             for (PriorityMap::reverse_iterator iter = priority_map.rbegin(); 
                     iter != priority_map.rend(); ++iter) {
                 std::set<StringList>::iterator level_iter;
@@ -390,57 +430,182 @@ namespace desres { namespace viparr {
                     /* Loop through priority levels and tuples in level */
                     sys_pattern.atoms = *level_iter;
                     PermutationPtr matched_perm = matchPattern(sys_pattern,
-                            type_pattern);
+                            _wilds[i]);
                     if (matched_perm != Permutation::Null) { /* Found match */
-                        if (perm != NULL)
-                            *perm = matched_perm;
-                        _cache.insert(std::make_pair(ss.str(),
-                                    CacheEntry(_row_ids[_wilds[i]],
-                                        matched_perm)));
-//                        std::cout << "Wildcard whatever\n";
-                        _fingerprint_counts[_wilds[i]]++;
-                        _fingerprint_example_tuples[_wilds[i]] = tuple;
+                        perm = matched_perm;
+                        ++stats.wild_matches;
                         //std::cout << "Match found: " << _pattern_list[_wilds[i]] << "\n";                  
 
-                        /* really, I should rename this function
-                         * _match and write a wrapping function match
-                         * that does the cache and fingerprint
-                         * bookkeeping. also I should do fingerprint
-                         * counts by row-ids since that's what this
-                         * function returns, then in print_fingerprint
-                         * I can compute the reverse map once and for
-                         * all. this way I also don't burden callers
-                         * that don't need the bookkeeping. */
-                        
-                        return _row_ids[_wilds[i]];
+                        return _wilds[i];
                     }
                 }
             }
         }
 
         /* No match found */
-        if (perm != NULL)
-            *perm = Permutation::Null;
-        _cache.insert(std::make_pair(ss.str(),
-                    CacheEntry(msys::BadId, Permutation::Null)));
+        perm = Permutation::Null;
+        ++stats.no_matches;
         //std::cout << "No match\n";
       
-        return msys::BadId;
+        return -1;
+    }
+
+    msys::IdList ParameterMatcher::matchAll(TemplatedSystemPtr sys,
+            const std::vector<msys::IdList>& tuples,
+            std::vector<PermutationPtr>* perms, bool allow_repeat) {
+        return matchTuples(sys, tuples, perms, allow_repeat);
+    }
+
+    msys::IdList ParameterMatcher::matchAll(TemplatedSystemPtr sys,
+            const TupleView& tuples,
+            std::vector<PermutationPtr>* perms, bool allow_repeat) {
+        return matchTuples(sys, tuples, perms, allow_repeat);
+    }
+
+    template <class Tuples>
+    msys::IdList ParameterMatcher::matchTuples(TemplatedSystemPtr sys,
+            const Tuples& tuples,
+            std::vector<PermutationPtr>* perms, bool allow_repeat) {
+
+        unsigned ntuples = tuples.size();
+        msys::IdList rows(ntuples);
+        if (perms != NULL)
+            perms->resize(ntuples);
+
+        /* Fingerprinting records every tuple, so must go through match() */
+        msys::IdList scratch;
+        if (!_fingerprint_counts.empty()
+                || (ntuples > 0 && !_sys_to_pattern->signature(sys,
+                        tupleAt(tuples, 0, scratch), _cache_key))) {
+            for (unsigned i = 0; i < ntuples; ++i)
+                rows[i] = match(sys, tupleAt(tuples, i, scratch),
+                        perms == NULL ? NULL : &(*perms)[i], allow_repeat);
+            return rows;
+        }
+
+        /* Compute signatures in contiguous chunks of tuples, in parallel
+         * if ViparrThreads() > 1. Each chunk has its own signature map and
+         * numbers its distinct signatures in order of first appearance. */
+        unsigned nchunks = std::min(ViparrThreads() * 4,
+                std::max(1u, ntuples / MinChunkSize));
+        std::vector<SignatureChunk> chunks(nchunks);
+        ViparrParallelFor(nchunks, [&](unsigned c) {
+            SignatureChunk& chunk = chunks[c];
+            unsigned begin = ViparrChunkBegin(ntuples, nchunks, c);
+            unsigned end = ViparrChunkBegin(ntuples, nchunks, c+1);
+            chunk.local.resize(end - begin);
+            Cache::Key key;
+            msys::IdList tuple;
+            for (unsigned i = begin; i < end; ++i) {
+                _sys_to_pattern->signature(sys, tupleAt(tuples, i, tuple),
+                        key);
+                uint64_t hash = KeyMap<unsigned>::Hash(key);
+                const unsigned* id = chunk.ids.find(key, hash);
+                if (id == NULL) {
+                    chunk.local[i - begin] = chunk.first.size();
+                    chunk.ids.insert(key, hash, chunk.first.size());
+                    chunk.first.push_back(i);
+                } else
+                    chunk.local[i - begin] = *id;
+            }
+        });
+
+        /* Merge the chunks in order, so that distinct signatures are
+         * numbered in order of first appearance in tuples, as in a serial
+         * loop, and look each one up in the cache */
+        KeyMap<unsigned> global_ids;
+        std::vector<int> unique_index;
+        std::vector<PermutationPtr> unique_perms;
+        std::vector<unsigned> missed;
+        std::vector<unsigned> missed_tuples;
+        std::vector<Cache::Key> missed_keys;
+        for (unsigned c = 0; c < nchunks; ++c) {
+            SignatureChunk& chunk = chunks[c];
+            chunk.global.resize(chunk.first.size());
+            for (unsigned j = 0; j < chunk.first.size(); ++j) {
+                const msys::IdList& tuple = tupleAt(tuples, chunk.first[j],
+                        scratch);
+                _sys_to_pattern->signature(sys, tuple, _cache_key);
+                uint64_t hash = KeyMap<unsigned>::Hash(_cache_key);
+                const unsigned* id = global_ids.find(_cache_key, hash);
+                if (id != NULL) {
+                    chunk.global[j] = *id;
+                    continue;
+                }
+                unsigned global = unique_index.size();
+                global_ids.insert(_cache_key, hash, global);
+                chunk.global[j] = global;
+                const CacheEntry* cached = _cache.find(_cache_key, hash);
+                if (cached != NULL) {
+                    unique_index.push_back(cached->index);
+                    unique_perms.push_back(cached->perm);
+                    continue;
+                }
+                unique_index.push_back(-1);
+                unique_perms.push_back(Permutation::Null);
+                missed.push_back(global);
+                missed_tuples.push_back(chunk.first[j]);
+                missed_keys.push_back(_cache_key);
+            }
+        }
+
+        /* Resolve the signatures that are not cached. Resolution only
+         * reads the matcher and the system, so it runs in parallel if
+         * ViparrThreads() > 1, each call with its own Pattern and
+         * statistics. The cache is read-only until all are resolved, and
+         * then the new entries are added in order of first appearance. If
+         * several fail, the error of the first is reported, as in a
+         * serial loop. */
+        std::vector<Stats> missed_stats(missed.size());
+        ViparrParallelFor(missed.size(), [&](unsigned k) {
+            msys::IdList copy;
+            const msys::IdList& tuple = tupleAt(tuples, missed_tuples[k],
+                    copy);
+            Pattern sys_pattern = (*_sys_to_pattern)(sys, tuple);
+            unsigned global = missed[k];
+            unique_index[global] = resolve(sys, tuple, sys_pattern,
+                    allow_repeat, unique_perms[global], missed_stats[k]);
+        });
+        for (unsigned k = 0; k < missed.size(); ++k) {
+            unsigned global = missed[k];
+            _cache.insert(missed_keys[k], Cache::Hash(missed_keys[k]),
+                    CacheEntry(unique_index[global], unique_perms[global]));
+            _stats.wild_matches += missed_stats[k].wild_matches;
+            _stats.no_matches += missed_stats[k].no_matches;
+        }
+        _stats.misses += missed.size();
+        _stats.hits += ntuples - missed.size();
+
+        /* Gather results for all tuples */
+        ViparrParallelFor(nchunks, [&](unsigned c) {
+            const SignatureChunk& chunk = chunks[c];
+            unsigned begin = ViparrChunkBegin(ntuples, nchunks, c);
+            for (unsigned i = 0; i < chunk.local.size(); ++i) {
+                unsigned global = chunk.global[chunk.local[i]];
+                int index = unique_index[global];
+                rows[begin + i] = index < 0 ? msys::BadId : _row_ids[index];
+                if (perms != NULL)
+                    (*perms)[begin + i] = unique_perms[global];
+            }
+        });
+        return rows;
     }
 
     msys::IdList ParameterMatcher::matchMultiple(TemplatedSystemPtr sys,
             const msys::IdList& tuple) {
 
-        /* Generate Pattern from tuple */
-        Pattern sys_pattern = (*_sys_to_pattern)(sys, tuple);
-        StringList base_type = sys_pattern.atoms;
-
         /* If pattern/hierarchies is cached, return cached result */
-        std::stringstream ss;
-        ss << sys_pattern << std::endl;
-        MultipleCache::const_iterator iter = _multi_cache.find(ss.str());
-        if (iter != _multi_cache.end())
-            return iter->second;
+        Pattern sys_pattern;
+        bool has_signature = cacheKey(sys, tuple, sys_pattern, _cache_key);
+        uint64_t hash = MultipleCache::Hash(_cache_key);
+        const msys::IdList* cached = _multi_cache.find(_cache_key, hash);
+        if (cached != NULL) {
+            ++_stats.hits;
+            return *cached;
+        }
+        ++_stats.misses;
+        if (has_signature)
+            sys_pattern = (*_sys_to_pattern)(sys, tuple);
 
         /* Generate priority map from atom types */
         PriorityMap priority_map = getPriorityMap(sys, tuple);
@@ -450,25 +615,24 @@ namespace desres { namespace viparr {
         msys::IdList matches_list;
         for (PriorityMap::reverse_iterator iter = priority_map.rbegin(); 
                 iter != priority_map.rend(); ++iter) {
-            for (unsigned i = 0; i < _exacts.size(); ++i) {
-                Pattern type_pattern = _pattern_list[_exacts[i]];
-                for (std::set<StringList>::iterator level_iter
-                        = iter->second.begin(); level_iter != iter->second.end();
-                        ++level_iter) {
-                    sys_pattern.atoms = *level_iter;
-                    PermutationPtr tmp_perm = matchPattern(sys_pattern,
-                            type_pattern);
-                    if (tmp_perm != Permutation::Null) {
-                        if (matches.find(_row_ids[_exacts[i]]) == matches.end()) {
-                            matches_list.push_back(_row_ids[_exacts[i]]);
-                            matches.insert(_row_ids[_exacts[i]]);
-                        }
-                    }
+            ExactMatches exact_matches;
+            for (std::set<StringList>::iterator level_iter
+                    = iter->second.begin(); level_iter != iter->second.end();
+                    ++level_iter) {
+                sys_pattern.atoms = *level_iter;
+                matchExacts(sys_pattern, exact_matches);
+            }
+            std::sort(exact_matches.begin(), exact_matches.end(), lessIndex);
+            for (unsigned i = 0; i < exact_matches.size(); ++i) {
+                msys::Id row = _row_ids[exact_matches[i].first];
+                if (matches.find(row) == matches.end()) {
+                    matches_list.push_back(row);
+                    matches.insert(row);
                 }
             }
         }
+        size_t nexact = matches_list.size();
         for (unsigned i = 0; i < _wilds.size(); ++i) {
-            Pattern type_pattern = _pattern_list[_wilds[i]];
             for (PriorityMap::reverse_iterator iter = priority_map.rbegin(); 
                     iter != priority_map.rend(); ++iter) {
                 for (std::set<StringList>::iterator level_iter
@@ -476,7 +640,7 @@ namespace desres { namespace viparr {
                         ++level_iter) {
                     sys_pattern.atoms = *level_iter;
                     PermutationPtr tmp_perm = matchPattern(sys_pattern,
-                            type_pattern);
+                            _wilds[i]);
                     if (tmp_perm != Permutation::Null) {
                         if (matches.find(_row_ids[_wilds[i]]) == matches.end()) {
                             matches_list.push_back(_row_ids[_wilds[i]]);
@@ -486,10 +650,33 @@ namespace desres { namespace viparr {
                 }
             }
         }
-        _multi_cache.insert(std::make_pair(ss.str(), matches_list));
+        if (matches_list.size() == 0)
+            ++_stats.no_matches;
+        else if (nexact == 0)
+            ++_stats.wild_matches;
+        _multi_cache.insert(_cache_key, hash, matches_list);
         return matches_list;
     }
 
+    bool ParameterMatcher::cacheKey(TemplatedSystemPtr sys,
+            const msys::IdList& tuple, Pattern& sys_pattern,
+            Cache::Key& key) const {
+        if (_sys_to_pattern->signature(sys, tuple, key))
+            return true;
+        sys_pattern = (*_sys_to_pattern)(sys, tuple);
+        key.clear();
+        key.push_back(sys_pattern.atoms.size());
+        for (unsigned i = 0; i < sys_pattern.atoms.size(); ++i)
+            key.push_back(TypeDictionary::Intern(sys_pattern.atoms[i]));
+        key.push_back(sys_pattern.bonds.size());
+        for (unsigned i = 0; i < sys_pattern.bonds.size(); ++i)
+            key.push_back(BondCode(sys_pattern.bonds[i]));
+        key.push_back(sys_pattern.flags.size());
+        for (unsigned i = 0; i < sys_pattern.flags.size(); ++i)
+            key.push_back(TypeDictionary::Intern(sys_pattern.flags[i]));
+        return false;
+    }
+
     ParameterMatcher::PriorityMap ParameterMatcher::getPriorityMap(
             TemplatedSystemPtr sys, const msys::IdList& tuple) const {
 
@@ -503,31 +690,177 @@ namespace desres { namespace viparr {
             return priority_map;
     }
     
+    ParameterMatcher::WildString::WildString(const std::string& pattern,
+            char wild) : empty(pattern.empty()),
+        anchor_front(!pattern.empty() && pattern[0] != wild),
+        anchor_back(!pattern.empty() && pattern[pattern.size()-1] != wild) {
+
+        /* Tokenize pattern by wild characters */
+        size_t i = 0;
+        while (i < pattern.size()) {
+            if (pattern[i] == wild) {
+                ++i;
+                continue;
+            }
+            size_t pos = pattern.find(wild, i);
+            if (pos == std::string::npos)
+                pos = pattern.size();
+            tokens.push_back(pattern.substr(i, pos - i));
+            i = pos;
+        }
+    }
+
+    bool ParameterMatcher::WildString::match(const std::string& expr) const {
+        if (empty)
+            return expr.empty();
+        size_t n = tokens.size();
+        if (n == 0) {
+            /* Pattern has all wild characters */
+            return true;
+        }
+
+        /* Anchored tokens must match the start and end of expr; the
+         * remaining tokens are matched greedily, left to right, in the
+         * part of expr between them */
+        size_t begin = 0;
+        size_t end = expr.size();
+        size_t first = 0;
+        size_t last = n;
+        if (anchor_front) {
+            const std::string& token = tokens[0];
+            if (token.size() > end || expr.compare(0, token.size(), token))
+                return false;
+            begin = token.size();
+            first = 1;
+        }
+        if (anchor_back) {
+            if (first == last)
+                return begin == end;
+            const std::string& token = tokens[n-1];
+            if (token.size() > end - begin || expr.compare(end - token.size(),
+                        token.size(), token))
+                return false;
+            end -= token.size();
+            last = n - 1;
+        }
+        for (size_t i = first; i < last; ++i) {
+            size_t pos = expr.find(tokens[i], begin);
+            if (pos == std::string::npos || pos + tokens[i].size() > end)
+                return false;
+            begin = pos + tokens[i].size();
+        }
+        return true;
+    }
+
+    template <class Order>
+    bool ParameterMatcher::WildString::matchList(const StringList& expr,
+            const std::vector<WildString>& pattern, const Order& order) {
+        if (expr.size() != pattern.size())
+            return false;
+        for (unsigned i = 0, n = expr.size(); i < n; ++i) {
+            if (!pattern[i].match(expr[order(i, n)]))
+                return false;
+        }
+        return true;
+    }
+
+    template <class Order>
+    bool ParameterMatcher::matchPermuted(const Pattern& sys_pattern,
+            int index, const Order& atom_order,
+            const Order& bond_order) const {
+        const CompiledPattern& type_pattern = _compiled_list[index];
+        if (!WildString::matchList(sys_pattern.atoms, type_pattern.atoms,
+                    atom_order))
+            return false;
+        if (type_pattern.bonds.size() != 0
+                && !WildString::matchList(sys_pattern.bonds,
+                    type_pattern.bonds, bond_order))
+            return false;
+        return sys_pattern.flags == _pattern_list[index].flags;
+    }
+
     PermutationPtr ParameterMatcher::matchPattern(const Pattern& sys_pattern,
-            const Pattern& type_pattern) const {
+            int index) const {
         for (unsigned i = 0; i < _perms.size(); ++i) {
-            Pattern copy_pattern = (*_perms[i])(sys_pattern);
-            if (copy_pattern.atoms.size() != type_pattern.atoms.size())
-                continue;
-            if (!matchStringList(copy_pattern.atoms, type_pattern.atoms,
-                        ATOM_WILD))
-                continue;
-            if (type_pattern.bonds.size() != 0) {
-                if (copy_pattern.bonds.size() != type_pattern.bonds.size())
-                    continue;
-                if (!matchStringList(copy_pattern.bonds, type_pattern.bonds,
-                            BOND_WILD))
-                    continue;
+            const PermutationIndex* perm_index = _perms[i]->index();
+            bool matched;
+            if (perm_index == NULL) {
+                Pattern copy_pattern = (*_perms[i])(sys_pattern);
+                matched = matchPermuted(copy_pattern, index,
+                        IdentityOrder(), IdentityOrder());
+            } else if (perm_index->kind == PermutationIndex::IDENTITY) {
+                matched = matchPermuted(sys_pattern, index,
+                        IdentityOrder(), IdentityOrder());
+            } else if (perm_index->kind == PermutationIndex::REVERSE) {
+                matched = matchPermuted(sys_pattern, index,
+                        ReverseOrder(), ReverseOrder());
+            } else {
+                CheckFixedSize(sys_pattern, *perm_index);
+                matched = matchPermuted(sys_pattern, index,
+                        FixedOrder(perm_index->atoms),
+                        FixedOrder(perm_index->bonds));
             }
-            if (copy_pattern.flags.size() != type_pattern.flags.size())
-                continue;
-            if (!matchStringList(copy_pattern.flags, type_pattern.flags, '\0'))
-                continue;
-            return _perms[i];
+            if (matched)
+                return _perms[i];
         }
         return Permutation::Null;
     }
 
+    template <class Order>
+    void ParameterMatcher::matchExactsPermuted(const Pattern& sys_pattern,
+            const Order& atom_order, const Order& bond_order,
+            const PermutationPtr& perm, std::string& key,
+            ExactMatches& matches) const {
+        ExactKey(sys_pattern, atom_order, key);
+        ExactIndex::const_iterator iter = _exact_index.find(key);
+        if (iter == _exact_index.end())
+            return;
+        for (int index : iter->second) {
+            const CompiledPattern& type_pattern = _compiled_list[index];
+            if (type_pattern.bonds.size() != 0
+                    && !WildString::matchList(sys_pattern.bonds,
+                        type_pattern.bonds, bond_order))
+                continue;
+            bool found = false;
+            for (unsigned j = 0; j < matches.size(); ++j) {
+                if (matches[j].first == index) {
+                    found = true;
+                    break;
+                }
+            }
+            if (!found)
+                matches.push_back(std::make_pair(index, perm));
+        }
+    }
+
+    void ParameterMatcher::matchExacts(const Pattern& sys_pattern,
+            ExactMatches& matches) const {
+        /* Tables with only wildcard rows go straight to the pattern path */
+        if (_exact_index.empty())
+            return;
+        std::string key;
+        for (unsigned i = 0; i < _perms.size(); ++i) {
+            const PermutationIndex* perm_index = _perms[i]->index();
+            if (perm_index == NULL) {
+                Pattern copy_pattern = (*_perms[i])(sys_pattern);
+                matchExactsPermuted(copy_pattern, IdentityOrder(),
+                        IdentityOrder(), _perms[i], key, matches);
+            } else if (perm_index->kind == PermutationIndex::IDENTITY) {
+                matchExactsPermuted(sys_pattern, IdentityOrder(),
+                        IdentityOrder(), _perms[i], key, matches);
+            } else if (perm_index->kind == PermutationIndex::REVERSE) {
+                matchExactsPermuted(sys_pattern, ReverseOrder(),
+                        ReverseOrder(), _perms[i], key, matches);
+            } else {
+                CheckFixedSize(sys_pattern, *perm_index);
+                matchExactsPermuted(sys_pattern,
+                        FixedOrder(perm_index->atoms),
+                        FixedOrder(perm_index->bonds), _perms[i], key,
+                        matches);
+            }
+        }
+    }
+
     void ParameterMatcher::writeMultiple(msys::Id row,
             const msys::IdList& term, msys::TermTablePtr table) const {
         if (row >= _row_to_row_id.size() ||
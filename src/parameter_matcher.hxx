@@ -3,8 +3,10 @@
 
 #include "ff.hxx"
 #include "pattern.hxx"
+#include "util/key_map.hxx"
 #include <set>
 #include <map>
+#include <unordered_map>
 #include <msys/term_table.hxx>
 
 namespace desres { namespace viparr {
@@ -31,6 +33,9 @@ namespace desres { namespace viparr {
                        TypeToPatternPtr type_to_pattern,
                        const std::vector<PermutationPtr>& perms);
 
+      /* Adds the match statistics (see stats()) to the profile counters
+       * matcher/..., if profiling is enabled (see util/profile.hxx) */
+      ~ParameterMatcher();
 
       /* These characters in the pattern table are treated as wildcards
        * during string matching */
@@ -85,6 +90,24 @@ namespace desres { namespace viparr {
       msys::Id match(TemplatedSystemPtr sys, const msys::IdList& tuple,
                      PermutationPtr* perm = NULL, bool allow_repeat=false);
 
+      /* Match each atom tuple in tuples as match() does, and return the
+       * matched row ID (or msys::BadId) for each tuple, in order. If perms
+       * is not NULL, it is filled with the matched Permutation of each
+       * tuple. Tuples are grouped by the signature of their system Pattern
+       * (see SystemToPattern::signature), so each distinct Pattern is
+       * matched only once. If ViparrThreads() > 1, signatures are computed
+       * and distinct uncached Patterns are matched in parallel; results
+       * and error reporting are the same as for the serial loop. The
+       * TupleView overload reads tuples directly from flat TemplatedSystem
+       * storage. */
+      msys::IdList matchAll(TemplatedSystemPtr sys,
+                            const std::vector<msys::IdList>& tuples,
+                            std::vector<PermutationPtr>* perms = NULL,
+                            bool allow_repeat=false);
+      msys::IdList matchAll(TemplatedSystemPtr sys, const TupleView& tuples,
+                            std::vector<PermutationPtr>* perms = NULL,
+                            bool allow_repeat=false);
+
       /* Match a single atom tuple in a system to the contained param
        * table; return IDs of all rows that match. */
       msys::IdList matchMultiple(TemplatedSystemPtr sys, const
@@ -113,7 +136,26 @@ namespace desres { namespace viparr {
       const TypeToPatternPtr typeToPattern() const {
         return _type_to_pattern; }
 
+      /* Counts of match() and matchMultiple() calls, for checking the
+       * behavior of the match cache. A miss requires matching the system
+       * Pattern against the param table; misses that are resolved by a
+       * wildcard row or by no row are also counted separately. */
+      struct Stats {
+          Stats() : hits(0), misses(0), wild_matches(0), no_matches(0) { }
+          uint64_t hits;
+          uint64_t misses;
+          uint64_t wild_matches;
+          uint64_t no_matches;
+      };
+      const Stats& stats() const { return _stats; }
+      void resetStats() { _stats = Stats(); }
+
       //void set_match_callback(std::function<void(Pattern p, msys::Id row)> new_callback);
+
+      /* Fingerprinting records how often each row is matched by match(),
+       * for print_fingerprint(). It is off by default and must be enabled
+       * before matching. */
+      void enableFingerprint();
       void print_fingerprint(TemplatedSystemPtr tsys, std::string table_name);
 
       bool match_bonds;
@@ -128,15 +170,16 @@ namespace desres { namespace viparr {
       TypeToPatternPtr _type_to_pattern;
       std::vector<PermutationPtr> _perms; 
 
-      /* A map from _matched_index to a count of the number of times
-         that index was the match found. DESRESCode#1849 */
-      std::map<int, int> _fingerprint_counts;
+      /* For each index into _row_ids, a count of the number of times
+         that index was the match found; empty unless fingerprinting is
+         enabled. DESRESCode#1849 */
+      std::vector<unsigned> _fingerprint_counts;
 
-      /* A map from _matched_index to a SINGLE example of a tuple (of
+      /* For each index into _row_ids, a SINGLE example of a tuple (of
        * atom id's)that was matched to that parameter. This is
        * collected to assign _A_ and _ND_ types during
        * fingerprinting. */
-      std::map<int, msys::IdList> _fingerprint_example_tuples;
+      std::vector<msys::IdList> _fingerprint_example_tuples;
       
       //std::function<void(Pattern p, msys::Id row)> _match_callback;
 
@@ -145,25 +188,131 @@ namespace desres { namespace viparr {
        * _pattern_list */
       std::vector<Pattern> _pattern_list;
 
+      /* A pattern string split on its wild character at construction, so
+       * that matching it against a system string needs no tokenizing or
+       * allocation and runs in time linear in the system string */
+      struct WildString {
+          WildString(const std::string& pattern, char wild);
+          bool match(const std::string& expr) const;
+
+          /* Match each string of expr, in the order given by the index
+           * view order (see parameter_matcher.cxx), to the corresponding
+           * WildString */
+          template <class Order>
+          static bool matchList(const StringList& expr,
+                                const std::vector<WildString>& pattern,
+                                const Order& order);
+
+          /* Non-wild substrings of the pattern, in order */
+          StringList tokens;
+          /* Pattern is "", which only matches "" */
+          bool empty;
+          /* Pattern does not start (end) with the wild character, so the
+           * first (last) token must match the start (end) of expr */
+          bool anchor_front;
+          bool anchor_back;
+      };
+
+      /* Precompiled atoms and bonds of each Pattern in _pattern_list. Flags
+       * have no wild character and are compared directly. */
+      struct CompiledPattern {
+          std::vector<WildString> atoms;
+          std::vector<WildString> bonds;
+      };
+      std::vector<CompiledPattern> _compiled_list;
+
       /* Keep track of which rows in the pattern table correspond to exact
        * atom types and which have wild atom type characters */
       std::vector<int> _exacts;
       std::vector<int> _wilds;
 
+      /* Index of the exact rows, keyed by their atom types and flags (see
+       * ExactKey in parameter_matcher.cxx); each key maps to the indices in
+       * _pattern_list of all exact rows with that key, in increasing order.
+       * Bond types may contain BOND_WILD and are checked after lookup. */
+      typedef std::unordered_map<std::string, std::vector<int> > ExactIndex;
+      ExactIndex _exact_index;
+
       /* Helper function for constructors */
       void init(TypeToPatternPtr type_to_pattern);
 
-      /* Keep a cache of matched Patterns */
-      typedef std::pair<msys::Id, PermutationPtr> CacheEntry;
-      typedef std::map<std::string, CacheEntry> Cache;
+      /* Keep a cache of matched Patterns, keyed by the words written by
+       * cacheKey(). _cache_key is scratch space for building keys. Entries
+       * hold the matched index into _row_ids (-1 if no match) and the
+       * matching Permutation. */
+      struct CacheEntry {
+          CacheEntry(int index, PermutationPtr perm)
+          : index(index), perm(perm) { }
+          int index;
+          PermutationPtr perm;
+      };
+      typedef KeyMap<CacheEntry> Cache;
       Cache _cache;
-      typedef std::map<std::string, msys::IdList> MultipleCache;
+      typedef KeyMap<msys::IdList> MultipleCache;
       MultipleCache _multi_cache;
+      Cache::Key _cache_key;
+      Stats _stats;
+
+      /* Write a key identifying the system Pattern of a tuple to key. If
+       * the SystemToPattern has a signature (see
+       * SystemToPattern::signature), the key is the signature, which is
+       * read from the type ids of the tuple without constructing the
+       * Pattern or interning any strings, and true is returned. Otherwise
+       * the Pattern is constructed into sys_pattern, and the key is the
+       * interned TypeDictionary id of each atom type and flag and a short
+       * code for each bond, with each list preceded by its length; false
+       * is returned. A matcher always uses the same kind of key. */
+      bool cacheKey(TemplatedSystemPtr sys, const msys::IdList& tuple,
+                    Pattern& sys_pattern, Cache::Key& key) const;
+
+      /* Implementation of both matchAll() overloads */
+      template <class Tuples>
+      msys::IdList matchTuples(TemplatedSystemPtr sys, const Tuples& tuples,
+                               std::vector<PermutationPtr>* perms,
+                               bool allow_repeat);
+
+      /* Record a match of tuple to the given index into _row_ids (or -1
+       * for no match) for fingerprinting, and return the matched row ID */
+      msys::Id recordMatch(int index, const msys::IdList& tuple);
 
-      /* Helper functions to match two Patterns; returns matching
-       * Permutation if matched, or Permutation::Null if not matched */
+      /* Match the system Pattern of a tuple against the param table
+       * without using the cache, as match() does on a cache miss. Returns
+       * the matched index into _row_ids, or -1 if there is no match, and
+       * sets perm to the matching Permutation; counts wildcard and failed
+       * matches in stats. sys_pattern is used as scratch space. Does not
+       * modify the matcher, so it may be called concurrently. */
+      int resolve(TemplatedSystemPtr sys, const msys::IdList& tuple,
+                  Pattern& sys_pattern, bool allow_repeat,
+                  PermutationPtr& perm, Stats& stats) const;
+
+      /* Helper function to match a system Pattern to the type Pattern at
+       * the given index of _pattern_list; returns matching Permutation if
+       * matched, or Permutation::Null if not matched */
       PermutationPtr matchPattern(const Pattern& sys_pattern,
-                                  const Pattern& type_pattern) const;
+                                  int index) const;
+
+      /* Helper function to find all exact rows matching a system Pattern
+       * using _exact_index. Appends the index in _pattern_list of each
+       * matching row not already in matches, together with the first
+       * Permutation that generated the match. */
+      typedef std::vector<std::pair<int, PermutationPtr> > ExactMatches;
+      void matchExacts(const Pattern& sys_pattern,
+                       ExactMatches& matches) const;
+
+      /* Permutations with a PermutationIndex are applied by the helpers
+       * below through index views of the system Pattern, which avoids
+       * constructing the permuted Pattern; other Permutations are applied
+       * directly and viewed in identity order. */
+      template <class Order>
+      bool matchPermuted(const Pattern& sys_pattern, int index,
+                         const Order& atom_order,
+                         const Order& bond_order) const;
+      template <class Order>
+      void matchExactsPermuted(const Pattern& sys_pattern,
+                               const Order& atom_order,
+                               const Order& bond_order,
+                               const PermutationPtr& perm, std::string& key,
+                               ExactMatches& matches) const;
 
       /* Used for hierarchical matching. Given a tuple of atoms,
        * generates a priority map of atom type tuples to match. The
@@ -93,6 +93,64 @@ namespace {
         return p;
     }
 
+    /* Signatures for the sp_* functions above: the tuple length, the type
+     * id of each atom, and the bond character of each bond, in the order
+     * they appear in the Pattern */
+    typedef std::vector<uint32_t> Signature;
+
+    uint32_t bond_code(TemplatedSystemPtr sys, msys::Id ai, msys::Id aj) {
+        return Pattern::GetBondChar(sys, ai, aj);
+    }
+
+    void sig_nbtype(TemplatedSystemPtr sys, const msys::IdList& atoms,
+            Signature& key) {
+        key.push_back(atoms.size());
+        for (unsigned i = 0; i < atoms.size(); ++i)
+            key.push_back(sys->nbtypeId(atoms[i]));
+    }
+
+    void sig_btype(TemplatedSystemPtr sys, const msys::IdList& atoms,
+            Signature& key) {
+        key.push_back(atoms.size());
+        for (unsigned i = 0; i < atoms.size(); ++i)
+            key.push_back(sys->btypeId(atoms[i]));
+    }
+
+    void sig_bonded(TemplatedSystemPtr sys, const msys::IdList& atoms,
+            Signature& key) {
+        sig_btype(sys, atoms, key);
+        for (unsigned i = 1; i < atoms.size(); ++i)
+            key.push_back(bond_code(sys, atoms[i-1], atoms[i]));
+    }
+
+    void sig_bond_to_first(TemplatedSystemPtr sys,
+            const msys::IdList& atoms, Signature& key) {
+        sig_btype(sys, atoms, key);
+        for (unsigned i = 1; i < atoms.size(); ++i)
+            key.push_back(bond_code(sys, atoms[0], atoms[i]));
+    }
+
+    void sig_pseudo_btype(TemplatedSystemPtr sys,
+            const msys::IdList& atoms, Signature& key) {
+        sig_btype(sys, atoms, key);
+        key[1] = sys->psetId(atoms[0]);
+    }
+
+    void sig_pseudo_bond_to_first(TemplatedSystemPtr sys,
+            const msys::IdList& atoms, Signature& key) {
+        sig_pseudo_btype(sys, atoms, key);
+        for (unsigned i = 2; i < atoms.size(); ++i)
+            key.push_back(bond_code(sys, atoms[1], atoms[i]));
+    }
+
+    void sig_pseudo_bond_to_second(TemplatedSystemPtr sys,
+            const msys::IdList& atoms, Signature& key) {
+        sig_pseudo_btype(sys, atoms, key);
+        key.push_back(bond_code(sys, atoms[1], atoms[2]));
+        for (unsigned i = 3; i < atoms.size(); ++i)
+            key.push_back(bond_code(sys, atoms[2], atoms[i]));
+    }
+
     void tokenize(const std::string& type, std::vector<std::string>& tokens) {
         tokens = ViparrSplitString(type);
     }
@@ -197,8 +255,11 @@ namespace {
     class SystemToPatternC : public SystemToPattern {
         public:
             SystemToPatternC(Pattern (*c_sys_to_pattern)(TemplatedSystemPtr,
-                        const msys::IdList&))
-                : _c_sys_to_pattern(c_sys_to_pattern) {
+                        const msys::IdList&),
+                    void (*c_signature)(TemplatedSystemPtr,
+                        const msys::IdList&, Signature&)=NULL)
+                : _c_sys_to_pattern(c_sys_to_pattern),
+                _c_signature(c_signature) {
                     if (c_sys_to_pattern == NULL)
                         VIPARR_FAIL("SystemToPattern function cannot be NULL");
             }
@@ -206,6 +267,14 @@ namespace {
                     const msys::IdList& atoms) const {
                 return _c_sys_to_pattern(sys, atoms);
             }
+            virtual bool signature(TemplatedSystemPtr sys,
+                    const msys::IdList& atoms, Signature& key) const {
+                if (_c_signature == NULL)
+                    return false;
+                key.clear();
+                _c_signature(sys, atoms, key);
+                return true;
+            }
             virtual bool operator==(const SystemToPattern& other) const {
                 try {
                     const SystemToPatternC& other_c
@@ -218,6 +287,8 @@ namespace {
         private:
             Pattern (*_c_sys_to_pattern)(TemplatedSystemPtr,
                     const msys::IdList&);
+            void (*_c_signature)(TemplatedSystemPtr, const msys::IdList&,
+                    Signature&);
     };
 
     class TypeToPatternC : public TypeToPattern {
@@ -246,12 +317,18 @@ namespace {
     class PermutationC : public Permutation {
         public:
             PermutationC(Pattern (*c_perm)(const Pattern&)=NULL)
-                : _c_perm(c_perm) { }
+                : _c_perm(c_perm), _has_index(false) { }
+            PermutationC(Pattern (*c_perm)(const Pattern&),
+                    const PermutationIndex& index)
+                : _c_perm(c_perm), _index(index), _has_index(true) { }
             virtual Pattern operator()(const Pattern& pattern) const {
                 if (_c_perm == NULL)
                     VIPARR_FAIL("Permutation function is NULL");
                 return _c_perm(pattern);
             }
+            virtual const PermutationIndex* index() const {
+                return _has_index ? &_index : NULL;
+            }
             bool operator==(const Permutation& other) const {
                 try {
                     const PermutationC& other_c
@@ -263,6 +340,22 @@ namespace {
             }
         private:
             Pattern (*_c_perm)(const Pattern&);
+            PermutationIndex _index;
+            bool _has_index;
+    };
+
+    /* Index maps of the pre-defined Permutations; the FIXED maps match the
+     * atom and bond orders documented for perm_improper1 to perm_improper5 */
+    const PermutationIndex index_identity
+        = { PermutationIndex::IDENTITY, 0, 0, {0}, {0} };
+    const PermutationIndex index_reverse
+        = { PermutationIndex::REVERSE, 0, 0, {0}, {0} };
+    const PermutationIndex index_improper[5] = {
+        { PermutationIndex::FIXED, 4, 3, {0,1,3,2}, {0,2,1} },
+        { PermutationIndex::FIXED, 4, 3, {0,2,1,3}, {1,0,2} },
+        { PermutationIndex::FIXED, 4, 3, {0,2,3,1}, {1,2,0} },
+        { PermutationIndex::FIXED, 4, 3, {0,3,1,2}, {2,0,1} },
+        { PermutationIndex::FIXED, 4, 3, {0,3,2,1}, {2,1,0} }
     };
 }
 
@@ -270,6 +363,11 @@ namespace desres { namespace viparr {
 
     std::string Pattern::GetBondString(TemplatedSystemPtr sys, msys::Id ai,
             msys::Id aj) {
+        return std::string(1, GetBondChar(sys, ai, aj));
+    }
+
+    char Pattern::GetBondChar(TemplatedSystemPtr sys, msys::Id ai,
+            msys::Id aj) {
         msys::Id bond = sys->system()->findBond(ai, aj);
         if (bond == msys::BadId) {
             std::stringstream msg;
@@ -278,18 +376,18 @@ namespace desres { namespace viparr {
             VIPARR_FAIL(msg.str());
         }
         if (sys->aromatic(bond))
-            return ":";
+            return ':';
         int order = sys->system()->bond(bond).order;
         switch (order) {
-            case 1: return "-";
-            case 2: return "=";
-            case 3: return "#";
+            case 1: return '-';
+            case 2: return '=';
+            case 3: return '#';
             default: std::stringstream msg;
                      msg << "GetBondString error: Cannot handle bond order "
                          << order << " between atoms " << ai << " and " << aj;
                      VIPARR_FAIL(msg.str());
         }
-        return "";
+        return 0;
     }
 
     bool Pattern::operator<(const Pattern& rhs) const {
@@ -323,17 +421,22 @@ namespace desres { namespace viparr {
         return (stream << pattern.print());
     }
 
-    SystemToPatternPtr SystemToPattern::NBType(new SystemToPatternC(sp_nbtype));
-    SystemToPatternPtr SystemToPattern::BType(new SystemToPatternC(sp_btype));
-    SystemToPatternPtr SystemToPattern::Bonded(new SystemToPatternC(sp_bonded));
-    SystemToPatternPtr
-        SystemToPattern::BondToFirst(new SystemToPatternC(sp_bond_to_first));
-    SystemToPatternPtr
-        SystemToPattern::PseudoBType(new SystemToPatternC(sp_pseudo_btype));
+    SystemToPatternPtr SystemToPattern::NBType(new SystemToPatternC(sp_nbtype,
+                sig_nbtype));
+    SystemToPatternPtr SystemToPattern::BType(new SystemToPatternC(sp_btype,
+                sig_btype));
+    SystemToPatternPtr SystemToPattern::Bonded(new SystemToPatternC(sp_bonded,
+                sig_bonded));
+    SystemToPatternPtr SystemToPattern::BondToFirst(
+            new SystemToPatternC(sp_bond_to_first, sig_bond_to_first));
+    SystemToPatternPtr SystemToPattern::PseudoBType(
+            new SystemToPatternC(sp_pseudo_btype, sig_pseudo_btype));
     SystemToPatternPtr SystemToPattern::PseudoBondToFirst(
-            new SystemToPatternC(sp_pseudo_bond_to_first));
+            new SystemToPatternC(sp_pseudo_bond_to_first,
+                sig_pseudo_bond_to_first));
     SystemToPatternPtr SystemToPattern::PseudoBondToSecond(
-            new SystemToPatternC(sp_pseudo_bond_to_second));
+            new SystemToPatternC(sp_pseudo_bond_to_second,
+                sig_pseudo_bond_to_second));
 
     std::set<std::string> TypeToPattern::BondStrings
         = {"-","=","#",":","~"};
@@ -341,15 +444,19 @@ namespace desres { namespace viparr {
     TypeToPatternPtr TypeToPattern::Default(new TypeToPatternC(tp_default));
     TypeToPatternPtr TypeToPattern::Pseudo(new TypeToPatternC(tp_pseudo));
 
-    PermutationPtr Permutation::Identity(new PermutationC(perm_identity));
-    PermutationPtr Permutation::Reverse(new PermutationC(perm_reverse));
+    PermutationPtr Permutation::Identity(new PermutationC(perm_identity,
+                index_identity));
+    PermutationPtr Permutation::Reverse(new PermutationC(perm_reverse,
+                index_reverse));
     PermutationPtr Permutation::Null(new PermutationC());
+    /* Improper[0] is perm_identity, which does not check the Pattern
+     * size, so it gets the IDENTITY index map */
     PermutationPtr Permutation::Improper[6] = {
-        PermutationPtr(new PermutationC(perm_identity)),
-        PermutationPtr(new PermutationC(perm_improper1)),
-        PermutationPtr(new PermutationC(perm_improper2)),
-        PermutationPtr(new PermutationC(perm_improper3)),
-        PermutationPtr(new PermutationC(perm_improper4)),
-        PermutationPtr(new PermutationC(perm_improper5))
+        PermutationPtr(new PermutationC(perm_identity, index_identity)),
+        PermutationPtr(new PermutationC(perm_improper1, index_improper[0])),
+        PermutationPtr(new PermutationC(perm_improper2, index_improper[1])),
+        PermutationPtr(new PermutationC(perm_improper3, index_improper[2])),
+        PermutationPtr(new PermutationC(perm_improper4, index_improper[3])),
+        PermutationPtr(new PermutationC(perm_improper5, index_improper[4]))
     };
 }}
@@ -20,6 +20,10 @@ namespace desres { namespace viparr {
     struct Pattern {
         static std::string GetBondString(TemplatedSystemPtr sys, msys::Id ai,
                 msys::Id aj);
+        /* The single character of GetBondString, without constructing a
+         * string */
+        static char GetBondChar(TemplatedSystemPtr sys, msys::Id ai,
+                msys::Id aj);
 
         std::vector<std::string> atoms;
         std::vector<std::string> bonds;
@@ -46,6 +50,17 @@ namespace desres { namespace viparr {
         }
         virtual ~SystemToPattern() { }
 
+        /* Write a signature of the Pattern that operator() constructs from
+         * the atoms to key and return true; atom tuples with equal
+         * signatures have equal Patterns. The signature is built from
+         * TypeDictionary ids and bond characters without constructing any
+         * strings. Returns false if not supported (e.g. for Python
+         * functions); the pre-defined instances below all support it. */
+        virtual bool signature(TemplatedSystemPtr sys,
+                const msys::IdList& atoms, std::vector<uint32_t>& key) const {
+            return false;
+        }
+
         /* atoms: nbtype(a_0), ... , nbtype(a_n)
          * bonds: None
          * flags: None */
@@ -108,6 +123,24 @@ namespace desres { namespace viparr {
     };
     typedef std::shared_ptr<TypeToPattern> TypeToPatternPtr;
 
+    /* Index map of a Permutation that only reorders atoms and bonds and
+     * keeps flags fixed: atom (bond) i of the permuted Pattern is atom
+     * (bond) j of the original Pattern, where for a list of length n,
+     *   IDENTITY: j = i
+     *   REVERSE:  j = n-1-i
+     *   FIXED:    j = atoms[i] (bonds[i]); the Pattern must have exactly
+     *             natoms atoms and nbonds bonds
+     * This lets ParameterMatcher compare a permuted Pattern in place,
+     * without constructing it. */
+    struct PermutationIndex {
+        enum Kind { IDENTITY, REVERSE, FIXED };
+        Kind kind;
+        unsigned natoms;
+        unsigned nbonds;
+        unsigned atoms[4];
+        unsigned bonds[3];
+    };
+
     /* Wrapper class for a C++ function pointer or Python function that takes
      * a Pattern and returns a copy with permuted attributes. Contains
      * pre-defined instances of Permutation as static members. */
@@ -119,6 +152,11 @@ namespace desres { namespace viparr {
         }
         virtual ~Permutation() { }
 
+        /* Index map equivalent to operator(), or NULL if there is none
+         * (e.g. for Python functions). The pre-defined Permutations below
+         * all have index maps. */
+        virtual const PermutationIndex* index() const { return NULL; }
+
         /* Returns the same Pattern back */
         static std::shared_ptr<Permutation> Identity;
 
@@ -1,23 +1,25 @@
 #include "add_nbody_table.hxx"
 
-void desres::viparr::AddNbodyTable(TemplatedSystemPtr sys, ForcefieldPtr ff,
+desres::msys::TermTablePtr desres::viparr::AddNbodyTable(TemplatedSystemPtr sys, ForcefieldPtr ff,
         const std::string& table_name, const std::string& plugin_name,
-        int natoms, const std::vector<msys::IdList>& nbodies,
+        int natoms, const TupleView& nbodies,
         SystemToPatternPtr sys_to_pattern, TypeToPatternPtr type_to_pattern,
         const std::vector<PermutationPtr>& perms, bool required,
         msys::Category category) {
     if (ff->rowIDs(table_name).size() == 0)
         VIPARR_FAIL("Must have '" + table_name + "' table for '" +
                 plugin_name + "' plugin");
-    msys::TermTablePtr table = sys->system()->addTable(table_name, natoms,
-            Forcefield::ParamTable(table_name));
+    msys::TermTablePtr table = AddPluginTable(sys, table_name, natoms,
+            ff->context()->paramTable(table_name));
     table->category = category;
     ParameterMatcherPtr matcher = ParameterMatcher::create(ff, table_name,
             sys_to_pattern, type_to_pattern, perms);
     unsigned old_size = table->termCount();
+    msys::IdList rows = matcher->matchAll(sys, nbodies);
+    msys::IdList term;
     for (unsigned i = 0, n = nbodies.size(); i < n; ++i) {
-        const msys::IdList& term = nbodies[i];
-        msys::Id row = matcher->match(sys, term);
+        nbodies[i].copyTo(term);
+        msys::Id row = rows[i];
         if (row == msys::BadId) {
             if (!required) continue;
             Pattern patt = (*sys_to_pattern)(sys, term);
@@ -43,4 +45,5 @@ void desres::viparr::AddNbodyTable(TemplatedSystemPtr sys, ForcefieldPtr ff,
     if (table->termCount() - old_size != nbodies.size()
             && required && ff->rules()->fatal)
         VIPARR_FAIL("VIPARR BUG--incorrect number of terms added");
+    return table;
 }
@@ -8,11 +8,12 @@ static void apply_angle_harm(TemplatedSystemPtr sys, ForcefieldPtr ff) {
     std::vector<PermutationPtr> perms;
     perms.push_back(Permutation::Identity);
     perms.push_back(Permutation::Reverse);
-    AddNbodyTable(sys, ff, "angle_harm", "angles", 3, sys->angles(),
-            SystemToPattern::Bonded, TypeToPattern::Default, perms, true,
-            msys::BOND);
-    sys->system()->table("angle_harm")->addTermProp("constrained",
-            msys::IntType);
+    msys::TermTablePtr table = AddNbodyTable(sys, ff, "angle_harm", "angles",
+            3, sys->angles(), SystemToPattern::Bonded, TypeToPattern::Default,
+            perms, true, msys::BOND);
+    table->addTermProp("constrained", msys::IntType);
 }
 
 static Forcefield::RegisterPlugin _("angles", apply_angle_harm);
+static Forcefield::RegisterPluginTables __("angles",
+        std::vector<std::string>(1, "angle_harm"));
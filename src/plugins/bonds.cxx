@@ -8,12 +8,13 @@ static void apply_stretch_harm(TemplatedSystemPtr sys, ForcefieldPtr ff) {
     std::vector<PermutationPtr> perms;
     perms.push_back(Permutation::Identity);
     perms.push_back(Permutation::Reverse);
-    AddNbodyTable(sys, ff, "stretch_harm", "bonds", 2, sys->nonPseudoBonds(),
-            SystemToPattern::Bonded, TypeToPattern::Default, perms, true,
-            msys::BOND);
+    msys::TermTablePtr table = AddNbodyTable(sys, ff, "stretch_harm", "bonds",
+            2, sys->nonPseudoBonds(), SystemToPattern::Bonded,
+            TypeToPattern::Default, perms, true, msys::BOND);
     /* Add "constrained" property */
-    sys->system()->table("stretch_harm")->addTermProp("constrained",
-            msys::IntType);
+    table->addTermProp("constrained", msys::IntType);
 }
 
 static Forcefield::RegisterPlugin _("bonds", apply_stretch_harm);
+static Forcefield::RegisterPluginTables __("bonds",
+        std::vector<std::string>(1, "stretch_harm"));
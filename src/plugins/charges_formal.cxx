@@ -8,13 +8,16 @@ static void match_charges_formal(TemplatedSystemPtr sys, ForcefieldPtr ff) {
     AddNbodyTable(sys, ff, "charges_formal", "charges_formal", 1,
             sys->typedAtoms(), SystemToPattern::Bonded, TypeToPattern::Default,
             perms, false, msys::NO_CATEGORY);
-    msys::ParamTablePtr params = Forcefield::ParamTable("charges_formal");
+    msys::ParamTablePtr params = ff->context()->paramTable("charges_formal");
     msys::Id p = params->addParam();
     params->value(p, "charge") = 0;
     msys::TermTablePtr charges = sys->system()->table("charges_formal");
-    for (msys::IdList atom : sys->typedAtoms())
+    msys::IdList atom;
+    for (IdSpan span : sys->typedAtoms()) {
+        span.copyTo(atom);
         if (charges->findExact(atom).size() == 0)
             charges->addTerm(atom, p);
+    }
 }
 
 static void compile_charges_formal(msys::SystemPtr sys) {
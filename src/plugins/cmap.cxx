@@ -44,9 +44,9 @@ static void apply_cmap(TemplatedSystemPtr sys, ForcefieldPtr ff) {
             }
             /* Create a new row in the torsiontorsion table for this system,
              * with possibly a different cmapid from the forcefield */
-            msys::Id new_p = Forcefield::ParamTable(
+            msys::Id new_p = ff->context()->paramTable(
                     "torsiontorsion_cmap")->duplicate(table->param(terms[i]));
-            Forcefield::ParamTable("torsiontorsion_cmap")->value(new_p,
+            ff->context()->paramTable("torsiontorsion_cmap")->value(new_p,
                     "cmapid") = new_name;
             row_map[name] = new_p;
             sys->system()->addAuxTable(new_name, ff->cmapTable(cmap));
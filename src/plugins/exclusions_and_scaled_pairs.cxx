@@ -56,7 +56,7 @@ static void apply_exclusions(TemplatedSystemPtr sys, ForcefieldPtr ff) {
     /* Extra exclusions provided by the templates or SMARTS are added first;
      * no scaled pairs or BCI-balanced pairs will be generated for these
      * exclusions */
-    const std::vector<IdList>& exclusions = sys->exclusions();
+    const TupleArray<2>& exclusions = sys->exclusions();
     for (unsigned i = 0, n = exclusions.size(); i < n; ++i) {
         Id p = table->params()->addParam();
         table->params()->value(p, "separation") = -1;
@@ -69,13 +69,12 @@ static void apply_exclusions(TemplatedSystemPtr sys, ForcefieldPtr ff) {
 
     /* Generate all the tuple exclusions, up to the exclusion rule; these may
      * be added to the pairs table as scaled or BCI-balanced pairs */
-    std::vector<IdList> alltuples[4];
-    for (IdList atom : sys->typedAtoms())
+    TupleArray<1> real_atoms;
+    for (IdSpan atom : sys->typedAtoms())
         if (sys->system()->atom(atom[0]).atomic_number > 0)
-            alltuples[0].push_back(atom);
-    alltuples[1] = sys->nonPseudoBonds();
-    alltuples[2] = sys->angles();
-    alltuples[3] = sys->dihedrals();
+            real_atoms.push_back(atom.list());
+    const TupleView alltuples[4] = {real_atoms, sys->nonPseudoBonds(),
+        sys->angles(), sys->dihedrals()};
     int rule = ff->rules()->exclusions();
     for (int i = 1; i <= rule; ++i) {
         Id p = table->params()->addParam();
@@ -84,7 +83,7 @@ static void apply_exclusions(TemplatedSystemPtr sys, ForcefieldPtr ff) {
                 ? 0 : ff->rules()->es_scale(i));
         table->params()->value(p, "lj_scale") = (i == 1
                 ? 0 : ff->rules()->lj_scale(i));
-        const std::vector<IdList>& tuples = alltuples[i-1];
+        const TupleView& tuples = alltuples[i-1];
         for (unsigned j = 0, n = tuples.size(); j < n; ++j) {
             Id atm1 = tuples[j][0];
             Id atm2 = tuples[j][i-1];
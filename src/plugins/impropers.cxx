@@ -18,8 +18,8 @@ static void apply_improper_harm(TemplatedSystemPtr sys, ForcefieldPtr ff) {
 }
 
 static void apply_improper_anharm(TemplatedSystemPtr sys, ForcefieldPtr ff) {
-    msys::TermTablePtr table = sys->system()->addTable("improper_anharm", 4,
-            Forcefield::ParamTable("improper_anharm"));
+    msys::TermTablePtr table = AddPluginTable(sys, "improper_anharm", 4,
+            ff->context()->paramTable("improper_anharm"));
     table->category = msys::BOND;
     /* If the center atom is last, the improper comes from an old-style
      * template, and we match only the identity permutation with no bonds for
@@ -36,14 +36,38 @@ static void apply_improper_anharm(TemplatedSystemPtr sys, ForcefieldPtr ff) {
     ParameterMatcherPtr matcher_new = ParameterMatcher::create(ff,
             "improper_anharm", SystemToPattern::BondToFirst,
             TypeToPattern::Default, perms_new);
-    const std::vector<IdList>& impropers = sys->impropers();
+    /* Sort the impropers by style, then match each style in one batch;
+     * style[i] is 1 for old style, 2 for new style, and 0 for impropers
+     * that are ignored */
+    const TupleArray<4>& impropers = sys->impropers();
+    std::vector<IdList> terms_old, terms_new;
+    std::vector<char> style(impropers.size(), 0);
+    IdList term;
     for (unsigned i = 0, n = impropers.size(); i < n; ++i) {
-        const IdList& term = impropers[i];
+        impropers[i].copyTo(term);
         if (sys->system()->findBond(term[3], term[0]) != msys::BadId
                 && sys->system()->findBond(term[3], term[1]) != msys::BadId
                 && sys->system()->findBond(term[3], term[2]) != msys::BadId) {
             /* Old style, center atom last */
-            Id row = matcher_old->match(sys, term);
+            style[i] = 1;
+            terms_old.push_back(term);
+        } else if (sys->system()->findBond(term[0], term[1]) != msys::BadId
+                && sys->system()->findBond(term[0], term[2]) != msys::BadId
+                && sys->system()->findBond(term[0], term[3]) != msys::BadId) {
+            /* New style, center atom first */
+            style[i] = 2;
+            terms_new.push_back(term);
+        } else {
+          /* DESRESCode#3487 Ignore this improper term. */
+        }
+    }
+    IdList rows_old = matcher_old->matchAll(sys, terms_old);
+    IdList rows_new = matcher_new->matchAll(sys, terms_new);
+    unsigned next_old = 0, next_new = 0;
+    for (unsigned i = 0, n = impropers.size(); i < n; ++i) {
+        if (style[i] == 1) {
+            const IdList& term = terms_old[next_old];
+            Id row = rows_old[next_old++];
             if (row == msys::BadId) {
                 Pattern patt = (*SystemToPattern::BType)(sys, term);
                 std::stringstream msg;
@@ -58,11 +82,9 @@ static void apply_improper_anharm(TemplatedSystemPtr sys, ForcefieldPtr ff) {
                     VIPARR_FAIL(msg.str());
             }
             table->addTerm(term, row);
-        } else if (sys->system()->findBond(term[0], term[1]) != msys::BadId
-                && sys->system()->findBond(term[0], term[2]) != msys::BadId
-                && sys->system()->findBond(term[0], term[3]) != msys::BadId) {
-            /* New style, center atom first */
-            Id row = matcher_new->match(sys, term);
+        } else if (style[i] == 2) {
+            const IdList& term = terms_new[next_new];
+            Id row = rows_new[next_new++];
             if (row == msys::BadId) {
                 Pattern patt = (*SystemToPattern::BondToFirst)(sys, term);
                 if (!matcher_new->match_bonds)
@@ -79,16 +101,14 @@ static void apply_improper_anharm(TemplatedSystemPtr sys, ForcefieldPtr ff) {
                     VIPARR_FAIL(msg.str());
             }
             table->addTerm(term, row);
-        } else {
-          /* DESRESCode#3487 Ignore this improper term. */
         }
     }
 }
 
 /* improper_trig terms are paired with dihedral_trig params */
 static void apply_improper_trig(TemplatedSystemPtr sys, ForcefieldPtr ff) {
-    msys::TermTablePtr table = sys->system()->addTable("improper_trig", 4,
-            Forcefield::ParamTable("improper_trig"));
+    msys::TermTablePtr table = AddPluginTable(sys, "improper_trig", 4,
+            ff->context()->paramTable("improper_trig"));
     table->category = msys::NO_CATEGORY;
     /* Match forward and reverse permutations with no bonds. (We do not specify
      * the bond pattern for improper_trig because different forcefields have
@@ -98,10 +118,12 @@ static void apply_improper_trig(TemplatedSystemPtr sys, ForcefieldPtr ff) {
     perms.push_back(Permutation::Reverse);
     ParameterMatcherPtr matcher = ParameterMatcher::create(ff, "improper_trig",
             SystemToPattern::BType, TypeToPattern::Default, perms);
-    const std::vector<IdList>& impropers = sys->impropers();
+    const TupleArray<4>& impropers = sys->impropers();
+    IdList rows = matcher->matchAll(sys, impropers);
+    IdList term;
     for (unsigned i = 0, n = impropers.size(); i < n; ++i) {
-        const IdList& term = impropers[i];
-        Id row = matcher->match(sys, term);
+        impropers[i].copyTo(term);
+        Id row = rows[i];
         if (row == msys::BadId) {
             Pattern patt = (*SystemToPattern::BType)(sys, term);
             std::stringstream msg;
@@ -181,3 +203,7 @@ static void compile_improper_trig(msys::SystemPtr sys) {
 
 static Forcefield::RegisterPlugin _("impropers", apply_impropers, std::vector<std::string>(),
                                     compile_improper_trig);
+static const char* improper_tables[]
+    = { "improper_harm", "improper_anharm", "improper_trig" };
+static Forcefield::RegisterPluginTables __("impropers",
+        std::vector<std::string>(improper_tables, improper_tables + 3));
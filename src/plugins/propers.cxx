@@ -1,3 +1,4 @@
+#include "../apply_plugins.hxx"
 #include "../parameter_matcher.hxx"
 
 using namespace desres;
@@ -9,8 +10,8 @@ template <bool fatal>
 static void apply_dihedral_trig(TemplatedSystemPtr sys, ForcefieldPtr ff) {
     if (ff->rowIDs("dihedral_trig").size() == 0)
         VIPARR_FAIL("Must have 'dihedral_trig' table for 'propers' plugin");
-    msys::TermTablePtr table = sys->system()->addTable("dihedral_trig", 4,
-            Forcefield::ParamTable("dihedral_trig"));
+    msys::TermTablePtr table = AddPluginTable(sys, "dihedral_trig", 4,
+            ff->context()->paramTable("dihedral_trig"));
     table->category = msys::BOND;
 
     /* Match forward and reverse permutations with bonds */
@@ -21,10 +22,12 @@ static void apply_dihedral_trig(TemplatedSystemPtr sys, ForcefieldPtr ff) {
             SystemToPattern::Bonded, TypeToPattern::Default, perms);
 
     unsigned old_size = table->termCount();
-    const std::vector<msys::IdList>& dihedrals = sys->dihedrals();
+    const TupleArray<4>& dihedrals = sys->dihedrals();
+    msys::IdList rows = matcher->matchAll(sys, dihedrals, NULL, true);
+    msys::IdList term;
     for (unsigned i = 0, n = dihedrals.size(); i < n; ++i) {
-        const msys::IdList& term = dihedrals[i];
-        msys::Id row = matcher->match(sys, term, NULL, true);
+        dihedrals[i].copyTo(term);
+        msys::Id row = rows[i];
         if (row == msys::BadId) {
             Pattern patt = (*SystemToPattern::Bonded)(sys, term);
             if (!matcher->match_bonds)
@@ -51,3 +54,7 @@ static void apply_dihedral_trig(TemplatedSystemPtr sys, ForcefieldPtr ff) {
 
 static Forcefield::RegisterPlugin _("propers", apply_dihedral_trig<true>);
 static Forcefield::RegisterPlugin __("propers_allowmissing", apply_dihedral_trig<false>);
+static Forcefield::RegisterPluginTables ___("propers",
+        std::vector<std::string>(1, "dihedral_trig"));
+static Forcefield::RegisterPluginTables ____("propers_allowmissing",
+        std::vector<std::string>(1, "dihedral_trig"));
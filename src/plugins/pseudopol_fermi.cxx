@@ -76,7 +76,7 @@ static void pseudopol_fermi( TemplatedSystemPtr sys, ForcefieldPtr ff) {
 
     /* Scan for carbonyls and amides */
     static const Entry defval;
-    for (IdList atm : sys->typedAtoms()) {
+    for (IdSpan atm : sys->typedAtoms()) {
         Id res = mol->atom(atm[0]).residue;
         if (mol->atomCountForResidue(res)<6) continue;
         /* create an entry for this residue if we don't have one already */
@@ -18,7 +18,7 @@ void match_scaled_pair_overrides(TemplatedSystemPtr sys, ForcefieldPtr ff) {
         VIPARR_FAIL("Must have scaled_pair_overrides table for "
                 "scaled_pair_overrides plugin");
     msys::TermTablePtr overrides = sys->system()->addTable("scaled_pair_overrides", 2,
-            Forcefield::ParamTable("scaled_pair_overrides"));
+            ff->context()->paramTable("scaled_pair_overrides"));
     overrides->category = msys::NO_CATEGORY;
     std::vector<PermutationPtr> perms;
     perms.push_back(Permutation::Identity);
@@ -29,15 +29,13 @@ void match_scaled_pair_overrides(TemplatedSystemPtr sys, ForcefieldPtr ff) {
     int rule = ff->rules()->exclusions();
     if (rule > 4)
         VIPARR_FAIL("Maximum supported exclusion rule is 4");
-    const std::vector<IdList>* alltuples[3];
-    alltuples[0] = &sys->nonPseudoBonds();
-    alltuples[1] = &sys->angles();
-    alltuples[2] = &sys->dihedrals();
+    const TupleView alltuples[3] = {sys->nonPseudoBonds(), sys->angles(),
+        sys->dihedrals()};
     for (int i = 2; i <= rule; ++i) {
-        for (unsigned j = 0; j < alltuples[i-2]->size(); ++j) {
+        for (unsigned j = 0; j < alltuples[i-2].size(); ++j) {
             IdList pair(2);
-            pair[0] = (*alltuples[i-2])[j][0];
-            pair[1] = (*alltuples[i-2])[j][i-1];
+            pair[0] = alltuples[i-2][j][0];
+            pair[1] = alltuples[i-2][j][i-1];
             if (overrides->findWithAll(pair).size() > 0) continue;
             /* Add pairs between ai/its pseudos and aj/its pseudos*/
             IdList atomsi;
@@ -9,7 +9,7 @@ static void apply_ureybradley(TemplatedSystemPtr sys, ForcefieldPtr ff) {
         VIPARR_FAIL("Must have 'ureybradley_harm' table for "
                 "'ureybradley' plugin");
     msys::TermTablePtr table = sys->system()->addTable("ureybradley_harm",
-            2, Forcefield::ParamTable("ureybradley_harm"));
+            2, ff->context()->paramTable("ureybradley_harm"));
     table->category = msys::NO_CATEGORY;
     std::vector<PermutationPtr> perms;
     perms.push_back(Permutation::Identity);
@@ -17,15 +17,14 @@ static void apply_ureybradley(TemplatedSystemPtr sys, ForcefieldPtr ff) {
     ParameterMatcherPtr matcher = ParameterMatcher::create(ff,
             "ureybradley_harm", SystemToPattern::Bonded, TypeToPattern::Default,
             perms);
-    const std::vector<msys::IdList>& angles = sys->angles();
+    const TupleArray<3>& angles = sys->angles();
+    msys::IdList rows = matcher->matchAll(sys, angles);
+    msys::IdList pair(2);
     for (unsigned i = 0, n = angles.size(); i < n; ++i) {
-        const msys::IdList& term = angles[i];
-        msys::Id row = matcher->match(sys, term);
-        if (row != msys::BadId) {
-            msys::IdList pair(2);
-            pair[0] = term[0];
-            pair[1] = term[2];
-            table->addTerm(pair, row);
+        if (rows[i] != msys::BadId) {
+            pair[0] = angles[i][0];
+            pair[1] = angles[i][2];
+            table->addTerm(pair, rows[i]);
         }
     }
 }
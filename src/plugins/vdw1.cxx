@@ -1,3 +1,4 @@
+#include "../apply_plugins.hxx"
 #include "../parameter_matcher.hxx"
 
 using namespace desres;
@@ -6,17 +7,19 @@ using namespace desres::viparr;
 static void apply_vdw(TemplatedSystemPtr sys, ForcefieldPtr ff) {
     if (ff->rowIDs("vdw1").size() == 0)
         VIPARR_FAIL("Must have 'vdw1' table for 'vdw1' plugin");
-    msys::TermTablePtr table = sys->system()->addTable("nonbonded", 1,
-            Forcefield::ParamTable("vdw1"));
+    msys::TermTablePtr table = AddPluginTable(sys, "nonbonded", 1,
+            ff->context()->paramTable("vdw1"));
     table->category = msys::NONBONDED;
     ParameterMatcherPtr matcher = ParameterMatcher::create(ff, "vdw1",
             SystemToPattern::NBType, TypeToPattern::Default,
             std::vector<PermutationPtr>(1, Permutation::Identity));
     unsigned old_size = table->termCount();
-    const std::vector<msys::IdList>& atoms = sys->typedAtoms();
+    const TupleArray<1>& atoms = sys->typedAtoms();
+    msys::IdList rows = matcher->matchAll(sys, atoms);
+    msys::IdList term;
     for (unsigned i = 0, n = atoms.size(); i < n; ++i) {
-        const msys::IdList& term = atoms[i];
-        msys::Id row = matcher->match(sys, term);
+        atoms[i].copyTo(term);
+        msys::Id row = rows[i];
         if (row == msys::BadId) {
             Pattern patt = (*SystemToPattern::NBType)(sys, term);
             if (!matcher->match_bonds)
@@ -39,3 +42,5 @@ static void apply_vdw(TemplatedSystemPtr sys, ForcefieldPtr ff) {
 }
 
 static Forcefield::RegisterPlugin _("vdw1", apply_vdw);
+static Forcefield::RegisterPluginTables __("vdw1",
+        std::vector<std::string>(1, "nonbonded"));
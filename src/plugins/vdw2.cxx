@@ -10,7 +10,7 @@ static void apply_vdw2(TemplatedSystemPtr sys, ForcefieldPtr ff) {
     /* Create a term table with dummy terms to keep track of which vdw2 params
      * should be applied to this system */
     msys::TermTablePtr table = sys->system()->addTable("vdw2", 1,
-            Forcefield::ParamTable("vdw2"));
+            ff->context()->paramTable("vdw2"));
     table->category = msys::NO_CATEGORY;
     for (msys::Id row : ff->rowIDs("vdw2")) {
         table->addTerm(msys::IdList(1, sys->system()->atoms()[0]), row);
@@ -18,3 +18,5 @@ static void apply_vdw2(TemplatedSystemPtr sys, ForcefieldPtr ff) {
 }
 
 static Forcefield::RegisterPlugin _("vdw2", apply_vdw2);
+static Forcefield::RegisterPluginGlobalTables __("vdw2",
+        std::vector<std::string>(1, "vdw2"));
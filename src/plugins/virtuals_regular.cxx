@@ -22,7 +22,7 @@ static void apply_virtuals_regular(TemplatedSystemPtr sys, ForcefieldPtr ff) {
         std::string vname = "virtuals_";
         vname += name.substr(8);
         msys::TermTablePtr vtable = sys->system()->addTable(name,
-                nsites, Forcefield::ParamTable(vname));
+                nsites, ff->context()->paramTable(vname));
         vtable->category = msys::VIRTUAL;
 
         /* Match pset of pseudo, btypes of site atoms, and bonds to
@@ -35,9 +35,10 @@ static void apply_virtuals_regular(TemplatedSystemPtr sys, ForcefieldPtr ff) {
                 sys_to_pattern, TypeToPattern::Pseudo, perms);
 
         unsigned old_size = vtable->termCount();
+        IdList rows = matcher->matchAll(sys, virtuals);
         for (unsigned j = 0; j < virtuals.size(); ++j) {
             const IdList& term = virtuals[j];
-            Id row = matcher->match(sys, term);
+            Id row = rows[j];
             if (row == msys::BadId) {
                 Pattern patt = (*sys_to_pattern)(sys, term);
                 if (!matcher->match_bonds)
@@ -1,6 +1,7 @@
 #include "compile_plugins.hxx"
 #include "../base.hxx"
 #include "../ff.hxx"
+#include "../util/profile.hxx"
 
 #include <algorithm>
 #include <string>
@@ -46,7 +47,10 @@ desres::msys::TermTablePtr desres::viparr::AddPairsTable(msys::SystemPtr sys) {
 
 void desres::viparr::CompilePlugins(msys::SystemPtr sys,
                                     std::set<std::string> plugins) {
-  ApplyNBFix(sys);
+  {
+    ViparrScopedTimer timer("compile/nbfix");
+    ApplyNBFix(sys);
+  }
   AddPairsTable(sys);
 
   for (std::string plugin_name : plugins) {
@@ -54,6 +58,7 @@ void desres::viparr::CompilePlugins(msys::SystemPtr sys,
       iter = Forcefield::PluginRegistry().find(plugin_name);
     if(iter == Forcefield::PluginRegistry().end())
       VIPARR_FAIL("Asked to compile unknown plugin " + plugin_name);
+    ViparrScopedTimer timer("compile/" + plugin_name);
     iter->second->compile(sys);
   }
 }
@@ -5,6 +5,7 @@
 #include <msys/elements.hxx>
 #include <stdio.h>
 #include <sstream>
+#include <algorithm>
 #include <msys/MsysThreeRoe.hpp>
 
 using namespace desres::msys;
@@ -15,6 +16,9 @@ namespace desres { namespace viparr {
 
     void TemplateTyper::addTemplate(TemplatedSystemPtr tpl) {
       _templates[tpl->hash()].push_back(tpl);
+      _formula_templates[get_formula(tpl->system(),
+                                     tpl->system()->atoms())].push_back(tpl);
+      _memo.clear();
     }
 
     void TemplateTyper::delTemplate(TemplatedSystemPtr tpl) {
@@ -25,6 +29,11 @@ namespace desres { namespace viparr {
              = iter->second.begin(); viter != iter->second.end(); ++viter) {
         if (*viter == tpl) {
           iter->second.erase(viter);
+          TemplateList& same_formula = _formula_templates[get_formula(
+              tpl->system(), tpl->system()->atoms())];
+          same_formula.erase(std::find(same_formula.begin(),
+                                       same_formula.end(), tpl));
+          _memo.clear();
           return;
         }
       }
@@ -47,6 +56,16 @@ namespace desres { namespace viparr {
       return iter->second;
     }
 
+    std::vector<std::string> TemplateTyper::hashes() const {
+      std::vector<std::string> vec;
+      for (TemplateMap::const_iterator iter = _templates.begin();
+           iter != _templates.end(); ++iter) {
+        if (!iter->second.empty())
+          vec.push_back(iter->first);
+      }
+      return vec;
+    }
+
     TemplateList TemplateTyper::findTemplateByName(const std::string&
                                                    name) const {
       TemplateList tpls;
@@ -63,6 +82,16 @@ namespace desres { namespace viparr {
     bool TemplateTyper::matchFragment(TemplatedSystemPtr sys,
                                       const IdList& fragment, std::vector<std::pair<TemplatedSystemPtr,
                                       msys::IdList> >& matches, std::ostream& why_not) {
+      Failure failure;
+      if (matchFragment(sys, fragment, matches, failure))
+        return true;
+      whyNot(sys, fragment, failure, why_not);
+      return false;
+    }
+
+    bool TemplateTyper::matchFragment(TemplatedSystemPtr sys,
+                                      const IdList& fragment, std::vector<std::pair<TemplatedSystemPtr,
+                                      msys::IdList> >& matches, Failure& failure) const {
 
       /* Partition the system into residues and split fragment based
        * on residue */
@@ -85,7 +114,6 @@ namespace desres { namespace viparr {
       for (std::map<Id, IdList>::const_iterator r=residues.begin();
            r!=residues.end(); ++r) {
         const IdList& atoms = r->second;
-        std::string resname = sys->system()->residue(r->first).name;
         Id resid = r->first;
         //if (atoms.size() < sys->system()->atomCountForResidue(resid)) {
         //    VIPARR_ERR << "WARNING: Residue " << resid << ": " << resname
@@ -94,8 +122,8 @@ namespace desres { namespace viparr {
         //}
 
         IdList tmap;
-        TemplatedSystemPtr tpl = findMatch(sys, atoms, resname,
-                                           resid, tmap, why_not);
+        TemplatedSystemPtr tpl = findMatch(sys, atoms, resid, tmap,
+                                           failure);
         if (tpl == TemplatedSystemPtr()) {
           matched = false;
           break;
@@ -105,6 +133,20 @@ namespace desres { namespace viparr {
       return matched;
     }
 
+    void TemplateTyper::whyNot(TemplatedSystemPtr sys, const IdList& fragment,
+                               const Failure& failure,
+                               std::ostream& why_not) const {
+      if (failure.code == Failure::NONE)
+        return;
+      IdList atoms;
+      for (Id atom : fragment)
+        if (sys->system()->atom(atom).residue == failure.resid)
+          atoms.push_back(atom);
+      writeWhyNot(sys->system(), atoms,
+                  sys->system()->residue(failure.resid).name, failure.resid,
+                  failure.code, why_not);
+    }
+
     std::string const& TemplateTyper::get_formula(
       msys::SystemPtr sys,
       const IdList& atoms) const {
@@ -115,7 +157,10 @@ namespace desres { namespace viparr {
       if (r.second) {
         int counts[128];
         memset(counts,0,sizeof(counts));
-        for (Id i : atoms) ++counts[sys->atom(i).atomic_number];
+        for (Id i : atoms) {
+          int anum = sys->atom(i).atomic_number;
+          if (anum > 0) ++counts[anum];
+        }
         std::stringstream formula;
         for (unsigned j=1; j<128; ++j) {
           if (!counts[j]) continue;
@@ -135,37 +180,67 @@ namespace desres { namespace viparr {
     TemplatedSystemPtr TemplateTyper::findMatch(TemplatedSystemPtr sys,
                                                 const IdList& atoms, const std::string& resname, Id resid,
                                                 IdList& tmap, std::ostream& why_not) const {
+      Failure failure;
+      TemplatedSystemPtr tpl = findMatch(sys, atoms, resid, tmap, failure);
+      if (tpl == TemplatedSystemPtr())
+        writeWhyNot(sys->system(), atoms, resname, resid, failure.code,
+                    why_not);
+      return tpl;
+    }
+
+    TemplatedSystemPtr TemplateTyper::findMatch(TemplatedSystemPtr sys,
+                                                const IdList& atoms, Id resid,
+                                                IdList& tmap, Failure& failure) const {
+
+      /* Reuse the match of a previous residue with the same signature */
+      const std::string& resname = sys->system()->residue(resid).name;
+      IdList sorted;
+      Memo::Key key;
+      residueKey(sys->system(), atoms, resname, sorted, key);
+      uint64_t key_hash = Memo::Hash(key);
+      TemplatedSystemPtr memo_tpl;
+      IdList memo_rmap;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        ++_stats.lookups;
+        const MemoEntry* memo = _memo.find(key, key_hash);
+        if (memo != NULL) {
+          memo_tpl = memo->tpl;
+          memo_rmap = memo->rmap;
+        }
+      }
+      if (memo_tpl != TemplatedSystemPtr()) {
+        tmap.resize(memo_rmap.size());
+        for (unsigned i = 0; i < memo_rmap.size(); ++i)
+          tmap[i] = bad(memo_rmap[i]) ? BadId : sorted[memo_rmap[i]];
+        if (verifyMatch(memo_tpl, sys->system(), tmap)) {
+          std::lock_guard<std::mutex> lock(_mutex);
+          ++_stats.hits;
+          return memo_tpl;
+        }
+      }
 
       TemplateList candidates = findTemplateByHash(msys::Graph::hash(
                                                      sys->system(), atoms));
       if (!candidates.size()) { // No hash match
-        std::string formula = get_formula(sys->system(), atoms);
-          
-        why_not << "has no template with matching formula for residue " 
-                << resid << " (" << resname << ", " << formula << ")";
-        for (TemplateMap::const_iterator iter = _templates.begin();
-             iter != _templates.end(); ++iter)
-          for (unsigned i = 0; i < iter->second.size(); ++i) {
-            if (iter->second[i]->system()->residue(0).name == resname)
-              why_not << "\n\ta template with name " << resname 
-                      << " was found but has different "
-                      << "chemical formula and/or terminal locations";
-
-            if(get_formula(iter->second[i]->system(), iter->second[i]->system()->atoms()) == formula) {
-              why_not << "\n\ta template (" << iter->second[i]->system()->residue(0).name;
-              why_not << ") with same chemical formula but different terminal extensions was found. ";
-              why_not << "\n\tDid you remember to include or exclude connections to external residues?";
-            }
-          }
-        why_not << "." << std::endl;
+        failure.code = Failure::NO_FORMULA;
+        failure.resid = resid;
         return TemplatedSystemPtr();
       }
       msys::GraphPtr target = msys::Graph::create(sys->system(), atoms);
+      /* Template graphs are built on first use */
+      std::vector<msys::GraphPtr> graphs;
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (TemplatedSystemPtr t : candidates)
+          graphs.push_back(t->graph());
+      }
       TemplatedSystemPtr tpl;
       std::vector<std::pair<Id, Id> > perm;
-      for (TemplatedSystemPtr t : candidates) {
+      for (unsigned i = 0; i < candidates.size(); ++i) {
+        TemplatedSystemPtr t = candidates[i];
         std::vector<std::pair<Id, Id> > p;
-        if (t->graph()->match(target, p)) {
+        if (graphs[i]->match(target, p)) {
           if (tpl == TemplatedSystemPtr()) {
             tpl = t;
             perm = p;
@@ -180,13 +255,8 @@ namespace desres { namespace viparr {
         }
       }
       if (tpl == TemplatedSystemPtr()) { // No graph match
-        why_not << "has no template with matching topology for "
-                << "residue " << resid << " (" << resname
-                << "), but templates found with matching formula and "
-                << "different bond topology:";
-        for (unsigned i = 0; i < candidates.size(); ++i)
-          why_not << " " << candidates[i]->system()->residue(0).name;
-        why_not << "." << std::endl;
+        failure.code = Failure::NO_TOPOLOGY;
+        failure.resid = resid;
         return tpl;
       }
       /* Found match */
@@ -194,23 +264,180 @@ namespace desres { namespace viparr {
       tmap.resize(tpl->system()->atomCount(), BadId);
       for (unsigned j=0; j<perm.size(); j++)
         tmap[perm[j].first] = perm[j].second;
+
+      IdList rmap(tmap.size(), BadId);
+      for (unsigned i = 0; i < tmap.size(); ++i) {
+        if (bad(tmap[i])) continue;
+        rmap[i] = std::lower_bound(sorted.begin(), sorted.end(), tmap[i])
+          - sorted.begin();
+      }
+      std::lock_guard<std::mutex> lock(_mutex);
+      _memo.insert(key, key_hash, MemoEntry(tpl, rmap));
       return tpl;
     }
 
+    void TemplateTyper::writeWhyNot(SystemPtr sys, const IdList& atoms,
+                                    const std::string& resname, Id resid,
+                                    Failure::Code code,
+                                    std::ostream& why_not) const {
+      if (code == Failure::NO_FORMULA) {
+        /* Only the formula cache is shared with concurrent matching */
+        std::string formula;
+        {
+          std::lock_guard<std::mutex> lock(_mutex);
+          formula = get_formula(sys, atoms);
+        }
+        why_not << "has no template with matching formula for residue " 
+                << resid << " (" << resname << ", " << formula << ")";
+        for (TemplateMap::const_iterator iter = _templates.begin();
+             iter != _templates.end(); ++iter)
+          for (unsigned i = 0; i < iter->second.size(); ++i) {
+            if (iter->second[i]->system()->residue(0).name == resname)
+              why_not << "\n\ta template with name " << resname 
+                      << " was found but has different "
+                      << "chemical formula and/or terminal locations";
+          }
+        TemplateMap::const_iterator same_formula
+          = _formula_templates.find(formula);
+        if (same_formula != _formula_templates.end()) {
+          for (TemplatedSystemPtr tpl : same_formula->second) {
+            why_not << "\n\ta template (" << tpl->system()->residue(0).name;
+            why_not << ") with same chemical formula but different terminal extensions was found. ";
+            why_not << "\n\tDid you remember to include or exclude connections to external residues?";
+          }
+        }
+        why_not << "." << std::endl;
+      } else if (code == Failure::NO_TOPOLOGY) {
+        TemplateList candidates = findTemplateByHash(msys::Graph::hash(
+                                                       sys, atoms));
+        why_not << "has no template with matching topology for "
+                << "residue " << resid << " (" << resname
+                << "), but templates found with matching formula and "
+                << "different bond topology:";
+        for (unsigned i = 0; i < candidates.size(); ++i)
+          why_not << " " << candidates[i]->system()->residue(0).name;
+        why_not << "." << std::endl;
+      }
+    }
+
+    void TemplateTyper::residueKey(SystemPtr sys, const IdList& atoms,
+                                   const std::string& resname,
+                                   IdList& sorted, Memo::Key& key) {
+      sorted = atoms;
+      std::sort(sorted.begin(), sorted.end());
+      key.clear();
+      key.push_back(TypeDictionary::Intern(resname));
+      key.push_back(sorted.size());
+      IdList nbrs;
+      for (unsigned i = 0; i < sorted.size(); ++i) {
+        const atom_t& atm = sys->atom(sorted[i]);
+        unsigned external = 0;
+        unsigned external_pseudo = 0;
+        nbrs.clear();
+        for (Id bond : sys->bondsForAtom(sorted[i])) {
+          Id other = sys->bond(bond).other(sorted[i]);
+          IdList::const_iterator iter = std::lower_bound(sorted.begin(),
+              sorted.end(), other);
+          if (iter != sorted.end() && *iter == other) {
+            unsigned j = iter - sorted.begin();
+            if (j > i) nbrs.push_back(j);
+          } else if (sys->atom(other).atomic_number > 0)
+            ++external;
+          else
+            ++external_pseudo;
+        }
+        std::sort(nbrs.begin(), nbrs.end());
+        key.push_back(atm.atomic_number);
+        key.push_back(external);
+        key.push_back(external_pseudo);
+        key.push_back(nbrs.size());
+        key.insert(key.end(), nbrs.begin(), nbrs.end());
+      }
+    }
+
+    bool TemplateTyper::verifyMatch(TemplatedSystemPtr tpl, SystemPtr sys,
+                                    const IdList& tmap) {
+      SystemPtr tsys = tpl->system();
+      if (tmap.size() != tsys->atomCount())
+        return false;
+      for (unsigned i = 0; i < tmap.size(); ++i) {
+        int anum = tsys->atom(i).atomic_number;
+        if (anum <= 0) continue; // Pseudo and external atoms not mapped
+        if (bad(tmap[i]) || !sys->hasAtom(tmap[i])
+            || sys->atom(tmap[i]).atomic_number != anum)
+          return false;
+      }
+      for (unsigned i = 0; i < tsys->bondCount(); ++i) {
+        const bond_t& bond = tsys->bond(i);
+        if (bad(tmap[bond.i]) || bad(tmap[bond.j])) continue;
+        if (bad(sys->findBond(tmap[bond.i], tmap[bond.j])))
+          return false;
+      }
+      return true;
+    }
+
+    namespace {
+      /* Scratch space for assignMatch, kept per thread so that assignment
+       * does no per-residue allocation once the buffers have grown. member
+       * is a bitmap over system atom ids and is all false between uses. */
+      struct AssignScratch {
+        std::vector<char> member;
+        IdList marked;
+        IdList tmap;
+        IdList ambiguous;
+        IdList assigned_atoms;
+        IdList tuple;
+        std::vector<const TemplatedSystem::PseudoType*> pseudo_types;
+        IdList tuples[4];
+        BondGraph graph;
+      };
+      thread_local AssignScratch assign_scratch;
+
+      /* Clears the marks of AssignScratch::member, also on error */
+      struct MemberMarks {
+        AssignScratch& scratch;
+        MemberMarks(AssignScratch& scratch) : scratch(scratch) { }
+        void mark(Id atom) {
+          if (!scratch.member[atom]) {
+            scratch.member[atom] = true;
+            scratch.marked.push_back(atom);
+          }
+        }
+        ~MemberMarks() {
+          for (Id atom : scratch.marked)
+            scratch.member[atom] = false;
+          scratch.marked.clear();
+        }
+      };
+
+      inline bool is_drude(const TemplatedSystem::PseudoType& type) {
+        return type.name.compare(0, 5, "drude") == 0;
+      }
+    }
+
     void TemplateTyper::assignMatch(TemplatedSystemPtr sys,
                                     const std::vector<std::pair<TemplatedSystemPtr, IdList> >& matches,
                                     bool rename_atoms, bool rename_residues) const {
 
-      IdList assigned_atoms;
+      AssignScratch& scratch = assign_scratch;
+      IdList& assigned_atoms = scratch.assigned_atoms;
+      IdList& tuple = scratch.tuple;
+      assigned_atoms.clear();
       for (unsigned match_i = 0, n = matches.size(); match_i < n; ++match_i) {
         TemplatedSystemPtr tpl = matches[match_i].first;
-        IdList tmap = matches[match_i].second;
+        IdList& tmap = scratch.tmap;
+        tmap.assign(matches[match_i].second.begin(),
+                    matches[match_i].second.end());
+        if (scratch.member.size() < sys->system()->maxAtomId())
+          scratch.member.resize(sys->system()->maxAtomId(), false);
+        MemberMarks in_tmap(scratch);
 
         /* Map atom types and charges, and add typed atoms */
         for (unsigned i=0; i<tmap.size(); i++) {
           Id j=tmap.at(i);
           if (bad(j)) continue; // Pseudo and external atoms not mapped
-          sys->setTypes(j, tpl->btype(i), tpl->nbtype(i));
+          in_tmap.mark(j);
+          sys->setTypeIds(j, tpl->btypeId(i), tpl->nbtypeId(i));
           sys->system()->atom(j).charge = tpl->system()->atom(i).charge;
           if (rename_atoms) {
             sys->system()->atom(j).name = tpl->system()->atom(i).name;
@@ -226,7 +453,8 @@ namespace desres { namespace viparr {
 
         /* Validate bonds, add aromaticity for internal bonds, add external
          * bonded atoms to tmap */
-        std::set<Id> ambiguous_externals;
+        IdList& ambiguous_externals = scratch.ambiguous;
+        ambiguous_externals.clear();
         for (unsigned i=0; i<tpl->system()->bondCount(); i++) {
           bond_t const& tbond = tpl->system()->bond(i);
           if (tpl->system()->atom(tbond.i).atomic_number == 0 || 
@@ -255,28 +483,32 @@ namespace desres { namespace viparr {
             IdList const& s_bonds = sys->system()->bondsForAtom(s_in);
             for (unsigned j=0; j<s_bonds.size(); j++) {
               Id tmp = sys->system()->bond(s_bonds[j]).other(s_in);
-              if (std::find(tmap.begin(), tmap.end(), tmp)
-                  != tmap.end()) {
+              if (scratch.member[tmp])
                 continue;
-              }
-              if (s_ex != BadId)
-                ambiguous_externals.insert(t_ex);
+              if (s_ex != BadId
+                  && std::find(ambiguous_externals.begin(),
+                               ambiguous_externals.end(), t_ex)
+                  == ambiguous_externals.end())
+                ambiguous_externals.push_back(t_ex);
               s_ex = tmp;
             }
             if (bad(sys->system()->findBond(s_in, s_ex)))
               VIPARR_FAIL("Incorrect match; system is missing bond");
             tmap.at(t_ex) = s_ex;
+            in_tmap.mark(s_ex);
           }
         }
+        auto is_ambiguous = [&ambiguous_externals](Id atom) {
+          return std::find(ambiguous_externals.begin(),
+                           ambiguous_externals.end(), atom)
+            != ambiguous_externals.end();
+        };
 
         /* Add impropers, exclusions, cmaps */
-        const TupleList& exclusions = tpl->exclusions();
-        for (TupleList::const_iterator iter = exclusions.begin();
-             iter != exclusions.end(); ++iter) {
-          IdList tuple = *iter;
+        for (IdSpan span : tpl->exclusions()) {
+          span.copyTo(tuple);
           for (unsigned j = 0; j < 2; ++j) {
-            if (ambiguous_externals.find(tuple[j])
-                != ambiguous_externals.end())
+            if (is_ambiguous(tuple[j]))
               VIPARR_FAIL("Exclusion in template "
                           << tpl->system()->residue(0).name
                           << " references an ambiguous externally "
@@ -285,13 +517,10 @@ namespace desres { namespace viparr {
           }
           sys->addExclusion(tuple);
         }
-        const TupleList& impropers = tpl->impropers();
-        for (TupleList::const_iterator iter = impropers.begin();
-             iter != impropers.end(); ++iter) {
-          IdList tuple = *iter;
+        for (IdSpan span : tpl->impropers()) {
+          span.copyTo(tuple);
           for (unsigned j = 0; j < 4; ++j) {
-            if (ambiguous_externals.find(tuple[j])
-                != ambiguous_externals.end())
+            if (is_ambiguous(tuple[j]))
               VIPARR_FAIL("Improper in template "
                           << tpl->system()->residue(0).name
                           << " references an ambiguous externally "
@@ -300,13 +529,10 @@ namespace desres { namespace viparr {
           }
           sys->addImproper(tuple);
         }
-        const TupleList& cmaps = tpl->cmaps();
-        for (TupleList::const_iterator iter = cmaps.begin();
-             iter != cmaps.end(); ++iter) {
-          IdList tuple = *iter;
+        for (IdSpan span : tpl->cmaps()) {
+          span.copyTo(tuple);
           for (unsigned j = 0; j < 8; ++j) {
-            if (ambiguous_externals.find(tuple[j])
-                != ambiguous_externals.end())
+            if (is_ambiguous(tuple[j]))
               VIPARR_FAIL("Cmap in template "
                           << tpl->system()->residue(0).name
                           << " references an ambiguous externally "
@@ -318,22 +544,23 @@ namespace desres { namespace viparr {
 
         /* Reorder pseudo types with drudes at the end, to support drudes
          * attached to virtuals */
-        std::vector<TemplatedSystem::PseudoType> pseudo_types;
+        std::vector<const TemplatedSystem::PseudoType*>& pseudo_types
+          = scratch.pseudo_types;
+        pseudo_types.clear();
         for (unsigned i = 0; i < tpl->pseudoTypes().size(); ++i)
-          if (tpl->pseudoTypes()[i].name.substr(0,5) != "drude")
-            pseudo_types.push_back(tpl->pseudoTypes()[i]);
+          if (!is_drude(tpl->pseudoTypes()[i]))
+            pseudo_types.push_back(&tpl->pseudoTypes()[i]);
         for (unsigned i = 0; i < tpl->pseudoTypes().size(); ++i)
-          if (tpl->pseudoTypes()[i].name.substr(0,5) == "drude")
-            pseudo_types.push_back(tpl->pseudoTypes()[i]);
+          if (is_drude(tpl->pseudoTypes()[i]))
+            pseudo_types.push_back(&tpl->pseudoTypes()[i]);
 
         /* Add pseudo atoms, pseudo-sites, and pseudo-bonds */
         for (unsigned ind = 0; ind < pseudo_types.size(); ++ind) {
-          const TupleList& sites_list = pseudo_types[ind].sites_list;
+          const TupleList& sites_list = pseudo_types[ind]->sites_list;
           for (unsigned i = 0; i < sites_list.size(); ++i) {
-            IdList tuple = sites_list[i];
+            tuple.assign(sites_list[i].begin(), sites_list[i].end());
             for (unsigned j = 1; j < tuple.size(); ++j) {
-              if (ambiguous_externals.find(tuple[j])
-                  != ambiguous_externals.end())
+              if (is_ambiguous(tuple[j]))
                 VIPARR_FAIL("Virtual site definition in template "
                             << tpl->system()->residue(0).name
                             << " references an ambiguous externally "
@@ -349,7 +576,7 @@ namespace desres { namespace viparr {
             Id id = tuple[0] = sys->system()->addAtom(
               sys->system()->atom(parent).residue);
             tmap[tid] = id;
-            sys->addPseudoSites(pseudo_types[ind].name, tuple);
+            sys->addPseudoSites(pseudo_types[ind]->name, tuple);
 
             atom_t& pseudo = sys->system()->atom(id);
             pseudo.name=tpseudo.name;
@@ -359,8 +586,8 @@ namespace desres { namespace viparr {
             pseudo.charge = tpseudo.charge;
             pseudo.formal_charge = 0;
             //pseudo.resonant_charge  = 0;
-            sys->setTypes(id, tpl->btype(tid), tpl->nbtype(tid), 
-                          tpl->pset(tid));
+            sys->setTypeIds(id, tpl->btypeId(tid), tpl->nbtypeId(tid),
+                            tpl->psetId(tid));
             sys->addTypedAtom(id);
             assigned_atoms.push_back(id);
             /* Add pseudo bonds */
@@ -385,20 +612,26 @@ namespace desres { namespace viparr {
       }
 
       /* Add bonds, angles, and dihedrals lists */
-      std::vector<IdList> non_pseudo_bonds;
-      std::vector<IdList> pseudo_bonds;
-      std::vector<IdList> angles;
-      std::vector<IdList> dihedrals;
-      GetBondsAnglesDihedrals(sys->system(), assigned_atoms,
-                              non_pseudo_bonds, pseudo_bonds, angles, dihedrals);
-      for (unsigned i = 0; i < non_pseudo_bonds.size(); ++i)
-        sys->addNonPseudoBond(non_pseudo_bonds[i]);
-      for (unsigned i = 0; i < pseudo_bonds.size(); ++i)
-        sys->addPseudoBond(pseudo_bonds[i]);
-      for (unsigned i = 0; i < angles.size(); ++i)
-        sys->addAngle(angles[i]);
-      for (unsigned i = 0; i < dihedrals.size(); ++i)
-        sys->addDihedral(dihedrals[i]);
+      IdList* tuples = scratch.tuples;
+      scratch.graph.assign(sys->system(), assigned_atoms);
+      GetBondsAnglesDihedrals(scratch.graph, tuples[0], tuples[1], tuples[2],
+                              tuples[3]);
+      for (unsigned i = 0; i < tuples[0].size(); i += 2) {
+        tuple.assign(&tuples[0][i], &tuples[0][i] + 2);
+        sys->addNonPseudoBond(tuple);
+      }
+      for (unsigned i = 0; i < tuples[1].size(); i += 2) {
+        tuple.assign(&tuples[1][i], &tuples[1][i] + 2);
+        sys->addPseudoBond(tuple);
+      }
+      for (unsigned i = 0; i < tuples[2].size(); i += 3) {
+        tuple.assign(&tuples[2][i], &tuples[2][i] + 3);
+        sys->addAngle(tuple);
+      }
+      for (unsigned i = 0; i < tuples[3].size(); i += 4) {
+        tuple.assign(&tuples[3][i], &tuples[3][i] + 4);
+        sys->addDihedral(tuple);
+      }
     }
   }
 }
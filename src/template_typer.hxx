@@ -2,8 +2,10 @@
 #define desres_viparr_template_typer_hxx
 
 #include "templated_system.hxx"
+#include "util/key_map.hxx"
 #include <vector>
 #include <map>
+#include <mutex>
 #include <string>
 
 namespace desres { namespace viparr {
@@ -23,6 +25,42 @@ namespace desres { namespace viparr {
             std::string const& get_formula(msys::SystemPtr sys,
                                            msys::IdList const& atoms) const;
 
+            /* Templates keyed by chemical formula, for failure diagnostics */
+            TemplateMap _formula_templates;
+
+            /* Memo of successful findMatch results, keyed by the residue
+             * signature written by residueKey(). Each entry holds the
+             * matched template and the template-to-residue mapping as
+             * indices into the residue's atoms sorted by id (BadId for
+             * unmapped template atoms). Cleared whenever templates are
+             * added or removed. */
+            struct MemoEntry {
+                MemoEntry(TemplatedSystemPtr tpl, const msys::IdList& rmap)
+                : tpl(tpl), rmap(rmap) { }
+                TemplatedSystemPtr tpl;
+                msys::IdList rmap;
+            };
+            typedef KeyMap<MemoEntry> Memo;
+            mutable Memo _memo;
+
+            /* Guards _formula_cache, _memo, _stats, and the lazily built
+             * template graphs, so that findMatch and matchFragment may be
+             * called concurrently */
+            mutable std::mutex _mutex;
+
+            /* Write the signature of a residue to key: its name, the atomic
+             * number and count of external bonds of each atom, and the bonds
+             * among its atoms, with atoms in increasing id order. sorted
+             * receives the residue's atoms in that order. */
+            static void residueKey(msys::SystemPtr sys,
+                    const msys::IdList& atoms, const std::string& resname,
+                    msys::IdList& sorted, Memo::Key& key);
+
+            /* Check that the template-to-system mapping tmap preserves
+             * atomic numbers and internal bonds of tpl */
+            static bool verifyMatch(TemplatedSystemPtr tpl,
+                    msys::SystemPtr sys, const msys::IdList& tmap);
+
         public:
 
             /* Create a new typer with no templates */
@@ -42,17 +80,41 @@ namespace desres { namespace viparr {
             /* Return list of templates for a given formula hash */
             TemplateList findTemplateByHash(const std::string& hash) const;
 
+            /* Return the distinct graph hashes of all templates */
+            std::vector<std::string> hashes() const;
+
+            /* Why findMatch failed for a residue: no template has its graph
+             * hash, or templates with its hash have a different topology */
+            struct Failure {
+                enum Code { NONE, NO_FORMULA, NO_TOPOLOGY };
+                Failure() : code(NONE), resid(msys::BadId) { }
+                Code code;
+                msys::Id resid;
+            };
+
             /* Match templates to a given fragment of a given system. Templates
              * are matched separately to the separate residues of sys->system();
              * matches are based on isomorphism of the bond-graph. If all
              * residues are successfully matched, returns true and stores
              * matching with template-to-system Id map in matches. Otherwise,
-             * returns false and prints the error message to why_not. */
+             * returns false and prints the error message to why_not. May be
+             * called concurrently, provided that neither the system nor the
+             * templates are modified meanwhile. */
             virtual bool matchFragment(TemplatedSystemPtr sys,
                     const msys::IdList& fragment, std::vector<std::pair<
                     TemplatedSystemPtr, msys::IdList> >& matches,
                     std::ostream& why_not);
 
+            /* As matchFragment above, but on failure records only the failed
+             * residue and the reason in failure; whyNot() prints the
+             * explanation that matchFragment would have */
+            bool matchFragment(TemplatedSystemPtr sys,
+                    const msys::IdList& fragment, std::vector<std::pair<
+                    TemplatedSystemPtr, msys::IdList> >& matches,
+                    Failure& failure) const;
+            void whyNot(TemplatedSystemPtr sys, const msys::IdList& fragment,
+                    const Failure& failure, std::ostream& why_not) const;
+
             /* Assign atom type and other template information from matched 
              * templates to the given system. Permanent changes to sys->system()
              * are the mapping of atom charges and bond aromaticity (if
@@ -74,6 +136,9 @@ namespace desres { namespace viparr {
                     const msys::IdList& atoms, const std::string& resname,
                     msys::Id resid, msys::IdList& tmap,
                     std::ostream& why_not) const;
+            TemplatedSystemPtr findMatch(TemplatedSystemPtr sys,
+                    const msys::IdList& atoms, msys::Id resid,
+                    msys::IdList& tmap, Failure& failure) const;
 
             /* Helper function used within SmartsTyper::matchFragment to
              * construct a template for a fragment using SMARTS definitions */
@@ -84,11 +149,29 @@ namespace desres { namespace viparr {
 
             std::vector<TemplatedSystemPtr> templates() const;
 
+            /* Counts of findMatch() calls and of those answered from the
+             * memo of previously matched residues without graph matching */
+            struct Stats {
+                Stats() : lookups(0), hits(0) { }
+                uint64_t lookups;
+                uint64_t hits;
+            };
+            const Stats& stats() const { return _stats; }
+            void resetStats() { _stats = Stats(); }
+
             virtual ~TemplateTyper() { }
 
         protected:
             /* Hash map of templates */
             TemplateMap _templates;
+
+            mutable Stats _stats;
+
+        private:
+            /* Print the explanation of a findMatch failure for a residue */
+            void writeWhyNot(msys::SystemPtr sys, const msys::IdList& atoms,
+                    const std::string& resname, msys::Id resid,
+                    Failure::Code code, std::ostream& why_not) const;
     };
     typedef std::shared_ptr<TemplateTyper> TemplateTyperPtr;
 
@@ -1,35 +1,101 @@
 #include "base.hxx"
 #include "templated_system.hxx"
 #include <sstream>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
 #include <msys/clone.hxx>
 #include <msys/param_table.hxx>
 
 using namespace desres::viparr;
 
+namespace {
+    /* Storage for TypeDictionary. Names are appended to fixed-size chunks
+     * that are never moved or freed, and each new name is published by a
+     * release store of the count, so Name() and Count() read them without
+     * locking. Only Intern() takes the mutex. */
+    const TypeId ChunkSize = 4096;
+    const TypeId MaxChunks = 4096;
+
+    struct TypeDictionaryData {
+        std::mutex mutex;
+        std::atomic<TypeId> count;
+        std::atomic<std::string*> chunks[MaxChunks];
+        std::unordered_map<std::string, TypeId> ids;
+        TypeDictionaryData() : count(0) {
+            for (TypeId i = 0; i < MaxChunks; ++i)
+                chunks[i].store(NULL, std::memory_order_relaxed);
+            append("");
+        }
+        ~TypeDictionaryData() {
+            for (TypeId i = 0; i < MaxChunks; ++i)
+                delete[] chunks[i].load(std::memory_order_relaxed);
+        }
+
+        /* Add a name with the next id; the mutex must be held */
+        TypeId append(const std::string& name) {
+            TypeId id = count.load(std::memory_order_relaxed);
+            TypeId chunk = id / ChunkSize;
+            if (chunk >= MaxChunks)
+                VIPARR_FAIL("Too many distinct atom types");
+            std::string* names = chunks[chunk].load(std::memory_order_relaxed);
+            if (names == NULL) {
+                names = new std::string[ChunkSize];
+                chunks[chunk].store(names, std::memory_order_relaxed);
+            }
+            names[id % ChunkSize] = name;
+            ids.insert(std::make_pair(name, id));
+            count.store(id + 1, std::memory_order_release);
+            return id;
+        }
+    };
+
+    TypeDictionaryData& GetTypeDictionary() {
+        static TypeDictionaryData data;
+        return data;
+    }
+}
+
+TypeId TypeDictionary::Intern(const std::string& name) {
+    TypeDictionaryData& data = GetTypeDictionary();
+    std::lock_guard<std::mutex> lock(data.mutex);
+    std::unordered_map<std::string, TypeId>::const_iterator iter
+        = data.ids.find(name);
+    if (iter != data.ids.end())
+        return iter->second;
+    return data.append(name);
+}
+
+const std::string& TypeDictionary::Name(TypeId id) {
+    TypeDictionaryData& data = GetTypeDictionary();
+    if (id >= data.count.load(std::memory_order_acquire)) {
+        std::stringstream msg;
+        msg << "Invalid atom type id " << id;
+        VIPARR_FAIL(msg.str());
+    }
+    return data.chunks[id / ChunkSize].load(std::memory_order_relaxed)
+        [id % ChunkSize];
+}
+
+TypeId TypeDictionary::Count() {
+    return GetTypeDictionary().count.load(std::memory_order_acquire);
+}
+
 TemplatedSystem::TemplatedSystem() :
     _sys(msys::System::create()), _atom_count(0), _max_atom_id(0),
-    _bond_count(0), _max_bond_id(0), _type_table(msys::ParamTable::create()),
-    _arom_table(msys::ParamTable::create()) {
+    _bond_count(0), _max_bond_id(0), _arom_table(msys::ParamTable::create()) {
 
-    _type_table->addProp("btype", msys::StringType);
-    _type_table->addProp("nbtype", msys::StringType);
-    _type_table->addProp("pset", msys::StringType);
     _arom_table->addProp("aromatic", msys::IntType);
 }
 
 TemplatedSystem::TemplatedSystem(msys::SystemPtr sys) :
     _sys(sys), _atom_count(sys->atomCount()),
     _max_atom_id(sys->maxAtomId()), _bond_count(sys->bondCount()),
-    _max_bond_id(sys->maxBondId()), _type_table(msys::ParamTable::create()),
+    _max_bond_id(sys->maxBondId()), _btypes(_max_atom_id, 0),
+    _nbtypes(_max_atom_id, 0), _psets(_max_atom_id, 0),
     _arom_table(msys::ParamTable::create()) {
 
-    _type_table->addProp("btype", msys::StringType);
-    _type_table->addProp("nbtype", msys::StringType);
-    _type_table->addProp("pset", msys::StringType);
     _arom_table->addProp("aromatic", msys::IntType);
-    for (unsigned i = 0; i < _max_atom_id; ++i) {
-        _type_table->addParam();
-    }
     for (unsigned i = 0; i < _max_bond_id; ++i)
         _arom_table->addParam();
 }
@@ -51,8 +117,8 @@ TemplatedSystemPtr TemplatedSystem::clone(const IdList& atoms) {
     /* Copy atom types, create atom index map */
     IdList atoms_map(_sys->maxAtomId(), msys::BadId);
     for (unsigned i = 0; i < atoms.size(); ++i) {
-        tclone->setTypes(i, this->btype(atoms[i]), this->nbtype(atoms[i]),
-                this->pset(atoms[i]));
+        tclone->setTypeIds(i, btypeId(atoms[i]), nbtypeId(atoms[i]),
+                psetId(atoms[i]));
         atoms_map[atoms[i]] = i;
     }
     
@@ -71,8 +137,8 @@ TemplatedSystemPtr TemplatedSystem::clone(const IdList& atoms) {
         if (atoms_map[_typed_atoms[i][0]] != msys::BadId)
             tclone->addTypedAtom(atoms_map[_typed_atoms[i][0]]);
     }
-    const TupleList* tuple_lists[7] = {&_non_pseudo_bonds, &_pseudo_bonds,
-        &_angles, &_dihedrals, &_exclusions, &_impropers, &_cmaps};
+    const TupleView tuple_lists[7] = {_non_pseudo_bonds, _pseudo_bonds,
+        _angles, _dihedrals, _exclusions, _impropers, _cmaps};
     void (TemplatedSystem::*adders[7])(const IdList&) = {
         &TemplatedSystem::addNonPseudoBond,
         &TemplatedSystem::addPseudoBond,
@@ -83,13 +149,13 @@ TemplatedSystemPtr TemplatedSystem::clone(const IdList& atoms) {
         &TemplatedSystem::addCmap
     };
     for (unsigned i = 0; i < 7; ++i) {
-        const TupleList* tuple_list = tuple_lists[i];
-        for (unsigned j = 0; j < tuple_list->size(); ++j) {
-            IdList new_tuple((*tuple_list)[j].size(), msys::BadId);
+        const TupleView& tuple_list = tuple_lists[i];
+        IdList new_tuple(tuple_list.arity(), msys::BadId);
+        for (unsigned j = 0; j < tuple_list.size(); ++j) {
             bool copy = true;
-            for (unsigned c = 0; c < (*tuple_list)[j].size(); ++c) {
-                if (atoms_map[(*tuple_list)[j][c]] != msys::BadId)
-                    new_tuple[c] = atoms_map[(*tuple_list)[j][c]];
+            for (unsigned c = 0; c < tuple_list.arity(); ++c) {
+                if (atoms_map[tuple_list[j][c]] != msys::BadId)
+                    new_tuple[c] = atoms_map[tuple_list[j][c]];
                 else {
                     copy = false;
                     break;
@@ -128,6 +194,11 @@ const std::string& TemplatedSystem::hash() {
     return _hash;
 }
 
+void TemplatedSystem::setHash(const std::string& hash) {
+    updateSystem();
+    _hash = hash;
+}
+
 desres::msys::GraphPtr TemplatedSystem::graph() {
     updateSystem();
     if (_graph == msys::GraphPtr())
@@ -135,27 +206,6 @@ desres::msys::GraphPtr TemplatedSystem::graph() {
     return _graph;
 }
 
-std::string TemplatedSystem::btype(Id atom) const {
-    if (atom >= _type_table->paramCount())
-        return "";
-    else
-        return _type_table->value(atom, "btype").asString();
-}
-
-std::string TemplatedSystem::nbtype(Id atom) const {
-    if (atom >= _type_table->paramCount())
-        return "";
-    else
-        return _type_table->value(atom, "nbtype").asString();
-}
-
-std::string TemplatedSystem::pset(Id atom) const {
-    if (atom >= _type_table->paramCount())
-        return "";
-    else
-        return _type_table->value(atom, "pset").asString();
-}
-
 bool TemplatedSystem::aromatic(Id bond) const {
     if (bond >= _arom_table->paramCount())
         return false;
@@ -165,10 +215,21 @@ bool TemplatedSystem::aromatic(Id bond) const {
 
 void TemplatedSystem::setTypes(Id atom, const std::string& btype,
         const std::string& nbtype, const std::string& pset) {
+    setTypeIds(atom, TypeDictionary::Intern(btype),
+            TypeDictionary::Intern(nbtype), TypeDictionary::Intern(pset));
+}
+
+void TemplatedSystem::setTypeIds(Id atom, TypeId btype, TypeId nbtype,
+        TypeId pset) {
     updateSystem();
-    _type_table->value(atom, "btype") = btype;
-    _type_table->value(atom, "nbtype") = nbtype;
-    _type_table->value(atom, "pset") = pset;
+    if (atom >= _btypes.size()) {
+        std::stringstream msg;
+        msg << "Cannot set types: atom " << atom << " does not exist";
+        VIPARR_FAIL(msg.str());
+    }
+    _btypes[atom] = btype;
+    _nbtypes[atom] = nbtype;
+    _psets[atom] = pset;
 }
 
 void TemplatedSystem::setAromatic(Id bond, bool arom) {
@@ -177,10 +238,10 @@ void TemplatedSystem::setAromatic(Id bond, bool arom) {
 }
 
 void TemplatedSystem::updateSystem() {
-    if (_max_atom_id != _type_table->paramCount()) {
+    if (_max_atom_id != _btypes.size()) {
         std::stringstream msg;
         msg << "Inconsistent system: max atom ID = " << _max_atom_id
-            << ", type table nrows = " << _type_table->paramCount();
+            << ", type table nrows = " << _btypes.size();
         VIPARR_FAIL(msg.str());
     }
     if (_max_bond_id != _arom_table->paramCount()) {
@@ -193,12 +254,14 @@ void TemplatedSystem::updateSystem() {
             || _max_atom_id != _sys->maxAtomId()
             || _bond_count != _sys->bondCount()
             || _max_bond_id != _sys->maxBondId()) {
-        /* System topology has changed: reset _graph and _hash, and add rows
-         * to _type_table and _arom_table if necessary */
+        /* System topology has changed: reset _graph and _hash, and extend
+         * the type columns and _arom_table if necessary */
         _hash = "";
         _graph.reset();
-        for (unsigned i = _max_atom_id; i < _sys->maxAtomId(); ++i) {
-            _type_table->addParam();
+        if (_sys->maxAtomId() > _max_atom_id) {
+            _btypes.resize(_sys->maxAtomId(), 0);
+            _nbtypes.resize(_sys->maxAtomId(), 0);
+            _psets.resize(_sys->maxAtomId(), 0);
         }
         for (unsigned i = _max_bond_id; i < _sys->maxBondId(); ++i)
             _arom_table->addParam();
@@ -276,9 +339,8 @@ void TemplatedSystem::addPseudoSites(const std::string& type,
 }
 
 void TemplatedSystem::removeTypedAtom(Id atom) {
-    auto it = std::find(_typed_atoms.begin(),
-			_typed_atoms.end(), msys::IdList(1, atom));
-    if (it == _typed_atoms.end()) {
+    unsigned it = _typed_atoms.find(msys::IdList(1, atom));
+    if (it == _typed_atoms.size()) {
         std::string s = "{" + std::to_string(atom) + "}";
 	VIPARR_FAIL("TemplatedSystem::removeTypedAtom: " + s + 
 		    " was not found in the TemplatedSystem.");
@@ -290,9 +352,8 @@ void TemplatedSystem::removeTypedAtom(Id atom) {
 
 void TemplatedSystem::removeNonPseudoBond(const IdList& atoms) {
     assert(atoms.size() == 2);
-    auto it = std::find(_non_pseudo_bonds.begin(), 
-			_non_pseudo_bonds.end(), atoms);
-    if (it == _non_pseudo_bonds.end()) {
+    unsigned it = _non_pseudo_bonds.find(atoms);
+    if (it == _non_pseudo_bonds.size()) {
         std::string s = "{";
 	s += std::to_string(atoms[0]) + ", ";
 	s += std::to_string(atoms[1]) + "}";
@@ -306,8 +367,8 @@ void TemplatedSystem::removeNonPseudoBond(const IdList& atoms) {
 
 void TemplatedSystem::removePseudoBond(const IdList& atoms) {
     assert(atoms.size() == 2);
-    auto it = std::find(_pseudo_bonds.begin(), _pseudo_bonds.end(), atoms);
-    if (it == _pseudo_bonds.end()) {
+    unsigned it = _pseudo_bonds.find(atoms);
+    if (it == _pseudo_bonds.size()) {
         std::string s = "{";
 	s += std::to_string(atoms[0]) + ", ";
 	s += std::to_string(atoms[1]) + "} ";
@@ -321,8 +382,8 @@ void TemplatedSystem::removePseudoBond(const IdList& atoms) {
 
 void TemplatedSystem::removeAngle(const IdList& atoms) {
     assert(atoms.size() == 3);
-    auto it = std::find(_angles.begin(), _angles.end(), atoms);
-    if (it == _angles.end()) {
+    unsigned it = _angles.find(atoms);
+    if (it == _angles.size()) {
         std::string s = "{";
 	for (unsigned int i = 0; i < 2; i++)
 	    s += std::to_string(atoms[i]) + ", ";
@@ -337,8 +398,8 @@ void TemplatedSystem::removeAngle(const IdList& atoms) {
 
 void TemplatedSystem::removeDihedral(const IdList& atoms) {
     assert(atoms.size() == 4);
-    auto it = std::find(_dihedrals.begin(), _dihedrals.end(), atoms);
-    if (it == _dihedrals.end()) {
+    unsigned it = _dihedrals.find(atoms);
+    if (it == _dihedrals.size()) {
         std::string s = "{";
 	for (unsigned int i = 0; i < 3; i++)
 	    s += std::to_string(atoms[i]) + ", ";
@@ -353,14 +414,14 @@ void TemplatedSystem::removeDihedral(const IdList& atoms) {
 
 void TemplatedSystem::removeExclusion(const IdList& atoms) {
     assert(atoms.size() == 2);
-    auto it = std::find(_exclusions.begin(), _exclusions.end(), atoms);
-    if (it == _exclusions.end()) {
+    unsigned it = _exclusions.find(atoms);
+    if (it == _exclusions.size()) {
  	IdList reversed;
         reversed.push_back(atoms.back());
 	reversed.push_back(atoms.front());
-        it = std::find(_exclusions.begin(), _exclusions.end(), reversed);
+        it = _exclusions.find(reversed);
     }
-    if (it == _exclusions.end()) {
+    if (it == _exclusions.size()) {
         std::string s = "{";
 	s += std::to_string(atoms[0]) + ", ";
 	s += std::to_string(atoms[1]) + "}";
@@ -374,8 +435,8 @@ void TemplatedSystem::removeExclusion(const IdList& atoms) {
 
 void TemplatedSystem::removeImproper(const IdList& atoms) {
     assert(atoms.size() == 4);
-    auto it = std::find(_impropers.begin(), _impropers.end(), atoms);
-    if (it == _impropers.end()) {
+    unsigned it = _impropers.find(atoms);
+    if (it == _impropers.size()) {
         std::string s = "{";
 	for (unsigned int i = 0; i < 3; i++)
 	    s += std::to_string(atoms[i]) + ", ";
@@ -390,8 +451,8 @@ void TemplatedSystem::removeImproper(const IdList& atoms) {
 
 void TemplatedSystem::removeCmap(const IdList& atoms) {
     assert(atoms.size() == 8);
-    auto it = std::find(_cmaps.begin(), _cmaps.end(), atoms);
-    if (it == _cmaps.end()) {
+    unsigned it = _cmaps.find(atoms);
+    if (it == _cmaps.size()) {
         std::string s = "{";
 	for (unsigned int i = 0; i < 7; i++)
 	    s += std::to_string(atoms[i]) + ", ";
@@ -3,9 +3,33 @@
 
 #include <msys/graph.hxx>
 #include <msys/system.hxx>
+#include "util/tuple_array.hxx"
+#include <stdint.h>
 
 namespace desres { namespace viparr {
 
+    /* Process-wide dictionary of interned atom type strings (btype, nbtype,
+     * and pset). Each distinct string is assigned a small integer id on
+     * first use, so types can be stored and compared as integers. Id 0 is
+     * always the empty string; ids are never reused, and the string for an
+     * id stays at a fixed address. Thread-safe; Name() and Count() do not
+     * lock, so type lookups on the matching path do not contend. It is
+     * shared by all ForcefieldContexts and only grows. */
+    class TypeDictionary {
+        public:
+            typedef uint32_t TypeId;
+
+            /* Return the id of a type string, adding it if necessary */
+            static TypeId Intern(const std::string& name);
+
+            /* Return the type string of an id returned by Intern */
+            static const std::string& Name(TypeId id);
+
+            /* Number of interned type strings */
+            static TypeId Count();
+    };
+    typedef TypeDictionary::TypeId TypeId;
+
     /* A wrapper class for msys::System to hold template information, as a
      * vehicle for communication between the TemplateTyper and parameter
      * matcher plug-ins. Can hold atom btype, nbtype, and pset information,
@@ -51,13 +75,31 @@ namespace desres { namespace viparr {
             msys::GraphPtr graph();
             const std::string& hash();
 
+            /* Store a precomputed hash() value, such as one read from a
+             * compiled forcefield; it is reset like a computed value */
+            void setHash(const std::string& hash);
+
             /* Return or set atom type properties */
-            std::string btype(Id atom) const;
-            std::string nbtype(Id atom) const;
-            std::string pset(Id atom) const;
+            const std::string& btype(Id atom) const {
+                return TypeDictionary::Name(btypeId(atom)); }
+            const std::string& nbtype(Id atom) const {
+                return TypeDictionary::Name(nbtypeId(atom)); }
+            const std::string& pset(Id atom) const {
+                return TypeDictionary::Name(psetId(atom)); }
             void setTypes(Id atom, const std::string& btype,
                     const std::string& nbtype, const std::string& pset="");
 
+            /* Return or set atom type properties as TypeDictionary ids;
+             * untyped atoms have id 0 (the empty string) */
+            TypeId btypeId(Id atom) const {
+                return atom < _btypes.size() ? _btypes[atom] : 0; }
+            TypeId nbtypeId(Id atom) const {
+                return atom < _nbtypes.size() ? _nbtypes[atom] : 0; }
+            TypeId psetId(Id atom) const {
+                return atom < _psets.size() ? _psets[atom] : 0; }
+            void setTypeIds(Id atom, TypeId btype, TypeId nbtype,
+                    TypeId pset=0);
+
             /* Return or set bond aromaticity */
             bool aromatic(Id bond) const;
             void setAromatic(Id bond, bool arom);
@@ -92,16 +134,18 @@ namespace desres { namespace viparr {
             void removeImproper(const IdList& atoms);
             void removeCmap(const IdList& atoms);
 
-            /* Return corresponding list */
-            const TupleList& typedAtoms() const { return _typed_atoms; }
-            const TupleList& nonPseudoBonds() const {
+            /* Return corresponding list. Tuples are stored flat; index or
+             * iterate to get an IdSpan per tuple, or call lists() for a
+             * copy as separate IdLists. */
+            const TupleArray<1>& typedAtoms() const { return _typed_atoms; }
+            const TupleArray<2>& nonPseudoBonds() const {
                 return _non_pseudo_bonds; }
-            const TupleList& pseudoBonds() const { return _pseudo_bonds; }
-            const TupleList& angles() const { return _angles; }
-            const TupleList& dihedrals() const { return _dihedrals; }
-            const TupleList& exclusions() const { return _exclusions; }
-            const TupleList& impropers() const { return _impropers; }
-            const TupleList& cmaps() const { return _cmaps; }
+            const TupleArray<2>& pseudoBonds() const { return _pseudo_bonds; }
+            const TupleArray<3>& angles() const { return _angles; }
+            const TupleArray<4>& dihedrals() const { return _dihedrals; }
+            const TupleArray<2>& exclusions() const { return _exclusions; }
+            const TupleArray<4>& impropers() const { return _impropers; }
+            const TupleArray<8>& cmaps() const { return _cmaps; }
             const std::vector<PseudoType>& pseudoTypes() const {
                 return _pseudo_types; }
 
@@ -111,9 +155,9 @@ namespace desres { namespace viparr {
              * system() method */
             msys::SystemPtr _sys;
 
-            /* Keep track of atoms and bonds in the system, to add rows to
-             * _type_table and update _graph and _hash when the system topology
-             * has changed */
+            /* Keep track of atoms and bonds in the system, to extend the
+             * type columns and _arom_table and update _graph and _hash when
+             * the system topology has changed */
             Id _atom_count;
             Id _max_atom_id;
             Id _bond_count;
@@ -124,21 +168,25 @@ namespace desres { namespace viparr {
             msys::GraphPtr _graph;
             std::string _hash;
 
-            /* Tables containing atom btypes, nbtypes, and psets and bond
-             * aromaticity */
-            msys::ParamTablePtr _type_table;
+            /* Atom btypes, nbtypes, and psets as TypeDictionary ids,
+             * indexed by atom ID */
+            std::vector<TypeId> _btypes;
+            std::vector<TypeId> _nbtypes;
+            std::vector<TypeId> _psets;
+
+            /* Table containing bond aromaticity */
             msys::ParamTablePtr _arom_table;
 
             /* Lists of all typed atoms, non-pseudo bonds, pseudo bonds, angles,
              * dihedrals, exclusion pairs, impropers, and cmaps */
-            TupleList _typed_atoms;
-            TupleList _non_pseudo_bonds;
-            TupleList _pseudo_bonds;
-            TupleList _angles;
-            TupleList _dihedrals;
-            TupleList _exclusions;
-            TupleList _impropers;
-            TupleList _cmaps;
+            TupleArray<1> _typed_atoms;
+            TupleArray<2> _non_pseudo_bonds;
+            TupleArray<2> _pseudo_bonds;
+            TupleArray<3> _angles;
+            TupleArray<4> _dihedrals;
+            TupleArray<2> _exclusions;
+            TupleArray<4> _impropers;
+            TupleArray<8> _cmaps;
 
             /* List of pseudo types, the number of sites for each type
              * (including the pseudo particle itself), and a list of
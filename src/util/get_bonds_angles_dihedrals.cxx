@@ -1,91 +1,271 @@
 #include "get_bonds_angles_dihedrals.hxx"
 #include "../base.hxx"
+#include "parallel.hxx"
+#include <algorithm>
 
 using desres::msys::Id;
 using desres::msys::IdList;
 using desres::msys::BadId;
 
-void desres::viparr::GetBondsAnglesDihedrals(msys::SystemPtr sys,
-        const IdList& atoms, std::vector<IdList>& non_pseudo_bonds,
-        std::vector<IdList>& pseudo_bonds, std::vector<IdList>& angles,
-        std::vector<IdList>& dihedrals) {
+namespace {
+    /* Bits of the marks scratch space of the incremental enumeration */
+    const char NewAtom = 1;
+    const char Center = 2;
 
-    /* To check that there are no bonds to external atoms */
-    std::vector<bool> in_frag(sys->maxAtomId(), false);
-    for (unsigned i = 0; i < atoms.size(); ++i)
-        in_frag[atoms[i]] = true;
+    /* Minimum number of atoms per chunk of the parallel enumeration */
+    const unsigned MinChunkSize = 4096;
 
-    non_pseudo_bonds.clear();
-    pseudo_bonds.clear();
-    angles.clear();
-    dihedrals.clear();
+    /* Non-pseudo bonds, pseudo bonds, angles, and dihedrals, flat */
+    struct Tuples {
+        IdList* lists[4];
+        Tuples(IdList& non_pseudo_bonds, IdList& pseudo_bonds,
+                IdList& angles, IdList& dihedrals) {
+            lists[0] = &non_pseudo_bonds;
+            lists[1] = &pseudo_bonds;
+            lists[2] = &angles;
+            lists[3] = &dihedrals;
+        }
+        void clear() {
+            for (unsigned i = 0; i < 4; ++i)
+                lists[i]->clear();
+        }
+    };
 
-    IdList bond(2);
-    IdList angle(3);
-    IdList dihedral(4);
-    for (unsigned i = 0; i < atoms.size(); ++i) {
-        Id ai = atoms[i];
-        if (sys->atom(ai).atomic_number == 0)
-            continue;
-        const IdList& ibonded = sys->bondedAtoms(ai);
-        for (unsigned j = 0, m = ibonded.size(); j < m; ++j) {
-            Id aj = ibonded[j];
-            if (!in_frag[aj])
-                VIPARR_FAIL("Cannot get tuples: incomplete fragment");
-            if (sys->atom(aj).atomic_number == 0) {
+    /* Append the tuples whose first bond, center atom, or central bond
+     * starts at the atom at position i, i.e. exactly those tuples that a
+     * full enumeration attributes to i. If marks is not NULL, only tuples
+     * containing a NewAtom are appended. */
+    void enumerate(const desres::viparr::BondGraph& graph, unsigned i,
+            const char* marks, Tuples& out) {
+        if (!graph.real(i))
+            return;
+        const IdList& ids = graph.atoms();
+        IdList& non_pseudo_bonds = *out.lists[0];
+        IdList& pseudo_bonds = *out.lists[1];
+        IdList& angles = *out.lists[2];
+        IdList& dihedrals = *out.lists[3];
+        auto keep = [marks](unsigned a, unsigned b) {
+            return marks == NULL || ((marks[a] | marks[b]) & NewAtom);
+        };
+        Id ai = ids[i];
+        for (const unsigned* j = graph.begin(i); j != graph.end(i); ++j) {
+            Id aj = ids[*j];
+            if (!graph.real(*j)) {
                 /* Add pseudo bond ai-aj */
-                bond[0] = ai;
-                bond[1] = aj;
-                pseudo_bonds.push_back(bond);
+                if (keep(i, *j)) {
+                    pseudo_bonds.push_back(ai);
+                    pseudo_bonds.push_back(aj);
+                }
                 continue;
             }
             /* Add angles with center ai */
-            for (unsigned k = 0; k < m; ++k) {
-                Id ak = ibonded[k];
-                if (!in_frag[ak])
-                    VIPARR_FAIL("Cannot get tuples: incomplete fragment");
-                if (sys->atom(ak).atomic_number != 0 && aj < ak) {
-                    angle[0] = aj;
-                    angle[1] = ai;
-                    angle[2] = ak;
-                    angles.push_back(angle);
+            for (const unsigned* k = graph.begin(i); k != graph.end(i); ++k) {
+                Id ak = ids[*k];
+                if (graph.real(*k) && aj < ak
+                        && (keep(i, *j) || keep(*k, *k))) {
+                    angles.push_back(aj);
+                    angles.push_back(ai);
+                    angles.push_back(ak);
                 }
             }
             if (ai > aj) continue;
             /* Add non-pseudo bond ai-aj */
-            bond[0] = ai;
-            bond[1] = aj;
-            non_pseudo_bonds.push_back(bond);
+            if (keep(i, *j)) {
+                non_pseudo_bonds.push_back(ai);
+                non_pseudo_bonds.push_back(aj);
+            }
             /* Add dihedrals with center ai-aj */
-            const IdList& jbonded = sys->bondedAtoms(aj);
-            for (unsigned h = 0; h < m; ++h) {
-                Id ah = ibonded[h];
-                if (!in_frag[ah])
-                    VIPARR_FAIL("Cannot get tuples: incomplete fragment");
-                if (sys->atom(ah).atomic_number == 0 || ah == aj)
+            for (const unsigned* h = graph.begin(i); h != graph.end(i); ++h) {
+                if (!graph.real(*h) || *h == *j)
                     continue;
-                for (unsigned k = 0; k < jbonded.size(); ++k) {
-                    Id ak = jbonded[k];
-                    if (!in_frag[ak])
-                        VIPARR_FAIL("Cannot get tuples: incomplete fragment");
-                    if (sys->atom(ak).atomic_number == 0
-                            || ak == ai || ak == ah)
+                Id ah = ids[*h];
+                for (const unsigned* k = graph.begin(*j); k != graph.end(*j);
+                        ++k) {
+                    if (!graph.real(*k) || *k == i || *k == *h)
                         continue;
+                    if (!keep(i, *j) && !keep(*h, *k))
+                        continue;
+                    Id ak = ids[*k];
                     if (ah < ak) {
-                        dihedral[0] = ah;
-                        dihedral[1] = ai;
-                        dihedral[2] = aj;
-                        dihedral[3] = ak;
+                        dihedrals.push_back(ah);
+                        dihedrals.push_back(ai);
+                        dihedrals.push_back(aj);
+                        dihedrals.push_back(ak);
                     }
                     else {
-                        dihedral[0] = ak;
-                        dihedral[1] = aj;
-                        dihedral[2] = ai;
-                        dihedral[3] = ah;
+                        dihedrals.push_back(ak);
+                        dihedrals.push_back(aj);
+                        dihedrals.push_back(ai);
+                        dihedrals.push_back(ah);
                     }
-                    dihedrals.push_back(dihedral);
                 }
             }
         }
     }
+
+    void append(std::vector<IdList>& tuples, const IdList& flat,
+            unsigned size) {
+        tuples.reserve(flat.size() / size);
+        for (unsigned i = 0; i < flat.size(); i += size)
+            tuples.push_back(IdList(flat.begin() + i,
+                        flat.begin() + i + size));
+    }
+}
+
+void desres::viparr::BondGraph::assign(msys::SystemPtr sys,
+        const IdList& atoms) {
+
+    /* Clear positions of the previous atoms */
+    for (unsigned i = 0; i < _atoms.size(); ++i)
+        _pos[_atoms[i]] = BadId;
+    _atoms.clear();
+    if (_pos.size() < sys->maxAtomId())
+        _pos.resize(sys->maxAtomId(), BadId);
+    _atoms = atoms;
+    for (unsigned i = 0; i < _atoms.size(); ++i)
+        _pos[_atoms[i]] = i;
+
+    unsigned natoms = _atoms.size();
+    _real.resize(natoms);
+    _offsets.resize(natoms + 1);
+    _neighbors.clear();
+    _offsets[0] = 0;
+    for (unsigned i = 0; i < natoms; ++i) {
+        Id ai = _atoms[i];
+        _real[i] = (sys->atom(ai).atomic_number != 0);
+        const IdList& bonds = sys->bondsForAtom(ai);
+        for (unsigned j = 0; j < bonds.size(); ++j) {
+            Id pos = _pos[sys->bond(bonds[j]).other(ai)];
+            if (pos == BadId) {
+                if (_real[i])
+                    VIPARR_FAIL("Cannot get tuples: incomplete fragment");
+                continue;
+            }
+            _neighbors.push_back(pos);
+        }
+        _offsets[i+1] = _neighbors.size();
+    }
+}
+
+void desres::viparr::GetBondsAnglesDihedrals(msys::SystemPtr sys,
+        const IdList& atoms, std::vector<IdList>& non_pseudo_bonds,
+        std::vector<IdList>& pseudo_bonds, std::vector<IdList>& angles,
+        std::vector<IdList>& dihedrals) {
+
+    BondGraph graph(sys, atoms);
+    IdList flat[4];
+    GetBondsAnglesDihedrals(graph, flat[0], flat[1], flat[2], flat[3]);
+
+    non_pseudo_bonds.clear();
+    pseudo_bonds.clear();
+    angles.clear();
+    dihedrals.clear();
+    append(non_pseudo_bonds, flat[0], 2);
+    append(pseudo_bonds, flat[1], 2);
+    append(angles, flat[2], 3);
+    append(dihedrals, flat[3], 4);
+}
+
+void desres::viparr::GetBondsAnglesDihedrals(msys::SystemPtr sys,
+        const IdList& atoms, const IdList& new_atoms,
+        std::vector<IdList>& non_pseudo_bonds,
+        std::vector<IdList>& pseudo_bonds, std::vector<IdList>& angles,
+        std::vector<IdList>& dihedrals) {
+
+    BondGraph graph(sys, atoms);
+    std::vector<char> marks;
+    IdList flat[4];
+    GetBondsAnglesDihedrals(graph, new_atoms, marks, flat[0], flat[1],
+            flat[2], flat[3]);
+
+    non_pseudo_bonds.clear();
+    pseudo_bonds.clear();
+    angles.clear();
+    dihedrals.clear();
+    append(non_pseudo_bonds, flat[0], 2);
+    append(pseudo_bonds, flat[1], 2);
+    append(angles, flat[2], 3);
+    append(dihedrals, flat[3], 4);
+}
+
+void desres::viparr::GetBondsAnglesDihedrals(const BondGraph& graph,
+        IdList& non_pseudo_bonds, IdList& pseudo_bonds, IdList& angles,
+        IdList& dihedrals) {
+
+    Tuples out(non_pseudo_bonds, pseudo_bonds, angles, dihedrals);
+    out.clear();
+    unsigned natoms = graph.size();
+    unsigned nchunks = std::min(ViparrThreads() * 4,
+            std::max(1u, natoms / MinChunkSize));
+    if (nchunks == 1) {
+        for (unsigned i = 0; i < natoms; ++i)
+            enumerate(graph, i, NULL, out);
+        return;
+    }
+
+    /* Enumerate contiguous chunks of atoms into separate buffers, then
+     * concatenate the buffers in chunk order */
+    std::vector<IdList> buffers(4 * nchunks);
+    ViparrParallelFor(nchunks, [&](unsigned c) {
+        IdList* lists = &buffers[4 * c];
+        Tuples chunk(lists[0], lists[1], lists[2], lists[3]);
+        unsigned end = ViparrChunkBegin(natoms, nchunks, c+1);
+        for (unsigned i = ViparrChunkBegin(natoms, nchunks, c); i < end; ++i)
+            enumerate(graph, i, NULL, chunk);
+    });
+    for (unsigned t = 0; t < 4; ++t) {
+        size_t total = 0;
+        for (unsigned c = 0; c < nchunks; ++c)
+            total += buffers[4 * c + t].size();
+        out.lists[t]->reserve(total);
+        for (unsigned c = 0; c < nchunks; ++c)
+            out.lists[t]->insert(out.lists[t]->end(),
+                    buffers[4 * c + t].begin(), buffers[4 * c + t].end());
+    }
+}
+
+void desres::viparr::GetBondsAnglesDihedrals(const BondGraph& graph,
+        const IdList& new_atoms, std::vector<char>& marks,
+        IdList& non_pseudo_bonds, IdList& pseudo_bonds, IdList& angles,
+        IdList& dihedrals) {
+
+    Tuples out(non_pseudo_bonds, pseudo_bonds, angles, dihedrals);
+    out.clear();
+    if (marks.size() < graph.size())
+        marks.resize(graph.size(), 0);
+
+    /* Every tuple containing a new atom is attributed to an atom within two
+     * bonds of it; collect those atoms as centers */
+    IdList centers;
+    auto add_center = [&](unsigned i) {
+        if (!(marks[i] & Center)) {
+            marks[i] |= Center;
+            centers.push_back(i);
+        }
+    };
+    for (unsigned n = 0; n < new_atoms.size(); ++n)
+        if (graph.position(new_atoms[n]) == BadId)
+            VIPARR_FAIL("Cannot get tuples: atom " << new_atoms[n]
+                    << " is not in the bond graph");
+    for (unsigned n = 0; n < new_atoms.size(); ++n) {
+        Id i = graph.position(new_atoms[n]);
+        marks[i] |= NewAtom;
+        add_center(i);
+    }
+    for (unsigned n = 0, m = centers.size(); n < m; ++n) {
+        unsigned i = centers[n];
+        for (const unsigned* j = graph.begin(i); j != graph.end(i); ++j) {
+            add_center(*j);
+            for (const unsigned* k = graph.begin(*j); k != graph.end(*j); ++k)
+                add_center(*k);
+        }
+    }
+
+    /* Enumerate centers in position order, so tuples come out in the
+     * order of the full enumeration */
+    std::sort(centers.begin(), centers.end());
+    for (unsigned n = 0; n < centers.size(); ++n)
+        enumerate(graph, centers[n], marks.data(), out);
+    for (unsigned n = 0; n < centers.size(); ++n)
+        marks[centers[n]] = 0;
 }
@@ -6,6 +6,48 @@
 
 namespace desres { namespace viparr {
 
+    /* Bond graph of a set of atoms in compressed sparse row form. Atoms are
+     * numbered by their position in atoms(); neighbors are stored as
+     * positions, so tuples can be enumerated repeatedly without querying
+     * the msys System. assign() reuses the graph's storage, so a graph can
+     * be rebuilt for each fragment without allocating once it has grown. */
+    class BondGraph {
+        public:
+            BondGraph() { }
+            BondGraph(msys::SystemPtr sys, const msys::IdList& atoms) {
+                assign(sys, atoms);
+            }
+
+            /* Rebuild the graph for the given atoms of sys. Throws if a
+             * non-pseudo atom is bonded to an atom not in atoms; bonds from
+             * pseudo atoms to atoms not in atoms are omitted. */
+            void assign(msys::SystemPtr sys, const msys::IdList& atoms);
+
+            unsigned size() const { return _atoms.size(); }
+            const msys::IdList& atoms() const { return _atoms; }
+
+            /* Position of an atom ID in atoms(), or msys::BadId */
+            msys::Id position(msys::Id atom) const {
+                return atom < _pos.size() ? _pos[atom] : msys::BadId; }
+
+            /* Whether the atom at position i is a non-pseudo atom */
+            bool real(unsigned i) const { return _real[i]; }
+
+            /* Positions of the atoms bonded to the atom at position i, in
+             * the order of msys::System::bondedAtoms */
+            const unsigned* begin(unsigned i) const {
+                return _neighbors.data() + _offsets[i]; }
+            const unsigned* end(unsigned i) const {
+                return _neighbors.data() + _offsets[i+1]; }
+
+        private:
+            msys::IdList _atoms;
+            msys::IdList _pos;
+            std::vector<char> _real;
+            std::vector<unsigned> _offsets;
+            std::vector<unsigned> _neighbors;
+    };
+
     /* Returns lists of non-pseudo bonds, pseudo bonds, angles, and dihedrals
      * in a given fragment or set of fragments */
     void GetBondsAnglesDihedrals(msys::SystemPtr sys, const msys::IdList& atoms,
@@ -13,6 +55,40 @@ namespace desres { namespace viparr {
             std::vector<msys::IdList>& pseudo_bonds,
             std::vector<msys::IdList>& angles,
             std::vector<msys::IdList>& dihedrals);
+
+    /* As above, but returns only the tuples that contain at least one of
+     * new_atoms, a subset of atoms, in the same order; for callers that
+     * extend a parametrized system and need the tuples of the new atoms */
+    void GetBondsAnglesDihedrals(msys::SystemPtr sys, const msys::IdList& atoms,
+            const msys::IdList& new_atoms,
+            std::vector<msys::IdList>& non_pseudo_bonds,
+            std::vector<msys::IdList>& pseudo_bonds,
+            std::vector<msys::IdList>& angles,
+            std::vector<msys::IdList>& dihedrals);
+
+    /* As above for all atoms of a BondGraph, but stores each list flat,
+     * with 2, 2, 3, and 4 atoms per tuple respectively, so that repeated
+     * calls reuse the lists' storage. Large graphs are enumerated in
+     * parallel if ViparrThreads() > 1; the tuples are returned in the same
+     * order as by a serial enumeration. */
+    void GetBondsAnglesDihedrals(const BondGraph& graph,
+            msys::IdList& non_pseudo_bonds,
+            msys::IdList& pseudo_bonds,
+            msys::IdList& angles,
+            msys::IdList& dihedrals);
+
+    /* Incremental form of the above: returns only the tuples of the graph
+     * that contain at least one of new_atoms, in the order in which the
+     * full enumeration would return them. The cost is proportional to the
+     * number of tuples near new_atoms, not to the size of the graph. marks
+     * is scratch space that is grown to graph.size() elements if needed;
+     * it must be all zero, and is all zero again on return. */
+    void GetBondsAnglesDihedrals(const BondGraph& graph,
+            const msys::IdList& new_atoms, std::vector<char>& marks,
+            msys::IdList& non_pseudo_bonds,
+            msys::IdList& pseudo_bonds,
+            msys::IdList& angles,
+            msys::IdList& dihedrals);
 }}
 
 #endif
@@ -0,0 +1,120 @@
+#ifndef viparr_util_key_map_h
+#define viparr_util_key_map_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+namespace desres { namespace viparr {
+
+    /* Open-addressing hash map from variable-length keys of 32-bit words to
+     * values of type T. Key words are copied into a single pool when
+     * inserted; each slot stores only the 64-bit hash of its key, the key's
+     * position in the pool, and the index of its value, so a lookup
+     * compares hashes before key words and never allocates. Entries cannot
+     * be removed individually. */
+    template <typename T>
+    class KeyMap {
+        public:
+            typedef std::vector<uint32_t> Key;
+
+            KeyMap() : _slots(MinSlots) { }
+
+            static uint64_t Hash(const Key& key) {
+                uint64_t h = 0x9e3779b97f4a7c15ULL ^ key.size();
+                for (unsigned i = 0; i < key.size(); ++i) {
+                    h = (h ^ key[i]) * 0xff51afd7ed558ccdULL;
+                    h ^= h >> 32;
+                }
+                return h;
+            }
+
+            /* Return the value stored for key, or NULL if there is none;
+             * hash must be Hash(key) */
+            const T* find(const Key& key, uint64_t hash) const {
+                size_t mask = _slots.size() - 1;
+                for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+                    const Slot& slot = _slots[i];
+                    if (slot.value == Empty)
+                        return NULL;
+                    if (slot.hash == hash && equal(slot, key))
+                        return &_values[slot.value];
+                }
+            }
+
+            /* Store value for key, replacing any existing value; hash must
+             * be Hash(key) */
+            void insert(const Key& key, uint64_t hash, const T& value) {
+                if (2 * (_values.size() + 1) > _slots.size())
+                    rehash(2 * _slots.size());
+                size_t mask = _slots.size() - 1;
+                size_t i = hash & mask;
+                for (; _slots[i].value != Empty; i = (i + 1) & mask) {
+                    Slot& slot = _slots[i];
+                    if (slot.hash == hash && equal(slot, key)) {
+                        _values[slot.value] = value;
+                        return;
+                    }
+                }
+                Slot& slot = _slots[i];
+                slot.hash = hash;
+                slot.offset = _pool.size();
+                slot.length = key.size();
+                slot.value = _values.size();
+                _pool.insert(_pool.end(), key.begin(), key.end());
+                _values.push_back(value);
+            }
+
+            size_t size() const { return _values.size(); }
+
+            void clear() {
+                _slots.assign(MinSlots, Slot());
+                _pool.clear();
+                _values.clear();
+            }
+
+        private:
+            static const uint32_t Empty = uint32_t(-1);
+            static const size_t MinSlots = 16;
+
+            struct Slot {
+                Slot() : hash(0), offset(0), length(0), value(Empty) { }
+                uint64_t hash;
+                uint32_t offset;
+                uint32_t length;
+                uint32_t value;
+            };
+
+            /* Slot count is always a power of 2 */
+            std::vector<Slot> _slots;
+            std::vector<uint32_t> _pool;
+            std::vector<T> _values;
+
+            bool equal(const Slot& slot, const Key& key) const {
+                if (slot.length != key.size())
+                    return false;
+                const uint32_t* words = _pool.data() + slot.offset;
+                for (unsigned i = 0; i < slot.length; ++i)
+                    if (words[i] != key[i])
+                        return false;
+                return true;
+            }
+
+            void rehash(size_t nslots) {
+                std::vector<Slot> slots(nslots);
+                size_t mask = nslots - 1;
+                for (unsigned j = 0; j < _slots.size(); ++j) {
+                    if (_slots[j].value == Empty)
+                        continue;
+                    size_t i = _slots[j].hash & mask;
+                    while (slots[i].value != Empty)
+                        i = (i + 1) & mask;
+                    slots[i] = _slots[j];
+                }
+                _slots.swap(slots);
+            }
+    };
+
+}}
+
+#endif
@@ -0,0 +1,64 @@
+#include "parallel.hxx"
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace {
+    std::atomic<unsigned> nthreads_(1);
+
+    /* Whether the calling thread is in a ViparrSerialScope */
+    thread_local bool serial_ = false;
+}
+
+desres::viparr::ViparrSerialScope::ViparrSerialScope() : _prev(serial_) {
+    serial_ = true;
+}
+
+desres::viparr::ViparrSerialScope::~ViparrSerialScope() {
+    serial_ = _prev;
+}
+
+unsigned desres::viparr::ViparrThreads() {
+    return nthreads_;
+}
+
+void desres::viparr::ViparrSetThreads(unsigned nthreads) {
+    nthreads_ = (nthreads == 0 ? 1 : nthreads);
+}
+
+void desres::viparr::ViparrParallelFor(unsigned n,
+        const std::function<void(unsigned)>& func) {
+    unsigned nthreads = ViparrThreads();
+    if (nthreads > n)
+        nthreads = n;
+    if (nthreads <= 1 || serial_) {
+        for (unsigned i = 0; i < n; ++i)
+            func(i);
+        return;
+    }
+
+    /* Threads take the next index from a shared counter; errors are
+     * recorded per index so the lowest failing index can be rethrown */
+    std::atomic<unsigned> next(0);
+    std::vector<std::exception_ptr> errors(n);
+    auto worker = [&]() {
+        ViparrSerialScope serial;
+        for (unsigned i = next++; i < n; i = next++) {
+            try {
+                func(i);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < nthreads; ++t)
+        threads.push_back(std::thread(worker));
+    worker();
+    for (unsigned t = 0; t < threads.size(); ++t)
+        threads[t].join();
+    for (unsigned i = 0; i < n; ++i)
+        if (errors[i])
+            std::rethrow_exception(errors[i]);
+}
@@ -0,0 +1,45 @@
+#ifndef viparr_util_parallel_h
+#define viparr_util_parallel_h
+
+#include <functional>
+
+namespace desres { namespace viparr {
+
+    /* Number of threads used by viparr's parallel code paths. The default
+     * of 1 runs everything serially in the calling thread. The setting is
+     * process-wide: it applies to all ForcefieldContexts, and concurrent
+     * parametrizations each start up to this many threads. */
+    unsigned ViparrThreads();
+    void ViparrSetThreads(unsigned nthreads);
+
+    /* Call func(i) for each i in [0, n), distributing the calls over up to
+     * ViparrThreads() threads; returns when all calls have completed. Calls
+     * from within a parallel loop, or a ViparrSerialScope, run serially. If
+     * any call throws, the exception from the call with the lowest i is
+     * rethrown, so failures are reported as in a serial loop. */
+    void ViparrParallelFor(unsigned n, const std::function<void(unsigned)>& func);
+
+    /* While an object of this class exists, ViparrParallelFor runs
+     * serially in the calling thread. Workers of ViparrParallelFor and of
+     * other parallel regions (see ApplyPlugins) use it, so that nested
+     * parallel loops run in the threads that already exist instead of
+     * each starting up to ViparrThreads() more. */
+    class ViparrSerialScope {
+        bool _prev;
+    public:
+        ViparrSerialScope();
+        ~ViparrSerialScope();
+        ViparrSerialScope(const ViparrSerialScope&) = delete;
+        ViparrSerialScope& operator=(const ViparrSerialScope&) = delete;
+    };
+
+    /* Split [0, n) into at most nchunks contiguous chunks of nearly equal
+     * size; chunk i is [ViparrChunkBegin(n, nchunks, i),
+     * ViparrChunkBegin(n, nchunks, i+1)). */
+    inline unsigned ViparrChunkBegin(unsigned n, unsigned nchunks, unsigned i) {
+        return (unsigned long long)n * i / nchunks;
+    }
+
+}}
+
+#endif
@@ -0,0 +1,66 @@
+#include "profile.hxx"
+#include <atomic>
+#include <mutex>
+
+namespace {
+    std::atomic<bool> enabled_(false);
+
+    struct Profile {
+        std::mutex mutex;
+        std::map<std::string, desres::viparr::ViparrTimerTotal> timers;
+        std::map<std::string, uint64_t> counters;
+    };
+
+    Profile& profile() {
+        static Profile p;
+        return p;
+    }
+}
+
+void desres::viparr::ViparrSetProfiling(bool enable) {
+    enabled_ = enable;
+}
+
+bool desres::viparr::ViparrProfiling() {
+    return enabled_;
+}
+
+void desres::viparr::ViparrResetProfile() {
+    Profile& p = profile();
+    std::lock_guard<std::mutex> lock(p.mutex);
+    p.timers.clear();
+    p.counters.clear();
+}
+
+void desres::viparr::ViparrProfileTime(const std::string& name,
+        double seconds) {
+    if (!enabled_)
+        return;
+    Profile& p = profile();
+    std::lock_guard<std::mutex> lock(p.mutex);
+    ViparrTimerTotal& total = p.timers[name];
+    total.seconds += seconds;
+    ++total.calls;
+}
+
+void desres::viparr::ViparrProfileCount(const std::string& name,
+        uint64_t n) {
+    if (!enabled_)
+        return;
+    Profile& p = profile();
+    std::lock_guard<std::mutex> lock(p.mutex);
+    p.counters[name] += n;
+}
+
+std::map<std::string, desres::viparr::ViparrTimerTotal>
+desres::viparr::ViparrProfileTimers() {
+    Profile& p = profile();
+    std::lock_guard<std::mutex> lock(p.mutex);
+    return p.timers;
+}
+
+std::map<std::string, uint64_t> desres::viparr::ViparrProfileCounters() {
+    Profile& p = profile();
+    std::lock_guard<std::mutex> lock(p.mutex);
+    return p.counters;
+}
@@ -0,0 +1,62 @@
+#ifndef viparr_util_profile_h
+#define viparr_util_profile_h
+
+#include <chrono>
+#include <map>
+#include <stdint.h>
+#include <string>
+
+namespace desres { namespace viparr {
+
+    /* Process-wide profile of viparr's phases and counters. Nothing is
+     * recorded unless profiling is enabled; it is off by default. Names
+     * use '/' to separate levels, e.g. "plugin/bonds". Thread-safe; it is
+     * not per ForcefieldContext, so concurrent parametrizations add to the
+     * same timers and counters. */
+    void ViparrSetProfiling(bool enable);
+    bool ViparrProfiling();
+    void ViparrResetProfile();
+
+    /* Add seconds (and one call) to a timer, or n to a counter */
+    void ViparrProfileTime(const std::string& name, double seconds);
+    void ViparrProfileCount(const std::string& name, uint64_t n);
+
+    struct ViparrTimerTotal {
+        ViparrTimerTotal() : seconds(0), calls(0) { }
+        double seconds;
+        uint64_t calls;
+    };
+    std::map<std::string, ViparrTimerTotal> ViparrProfileTimers();
+    std::map<std::string, uint64_t> ViparrProfileCounters();
+
+    /* Adds the wall time from construction to stop() or destruction to
+     * the named timer, if profiling was enabled at construction */
+    class ViparrScopedTimer {
+        public:
+            explicit ViparrScopedTimer(const std::string& name)
+            : _on(ViparrProfiling()) {
+                if (_on) {
+                    _name = name;
+                    _start = std::chrono::steady_clock::now();
+                }
+            }
+            ~ViparrScopedTimer() { stop(); }
+
+            void stop() {
+                if (!_on)
+                    return;
+                std::chrono::duration<double> elapsed
+                    = std::chrono::steady_clock::now() - _start;
+                ViparrProfileTime(_name, elapsed.count());
+                _on = false;
+            }
+
+        private:
+            bool _on;
+            std::string _name;
+            std::chrono::steady_clock::time_point _start;
+    };
+
+}}
+
+#endif
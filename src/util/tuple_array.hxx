@@ -0,0 +1,139 @@
+#ifndef viparr_util_tuple_array_h
+#define viparr_util_tuple_array_h
+
+#include "../base.hxx"
+#include <msys/types.hxx>
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <vector>
+
+namespace desres { namespace viparr {
+
+    /* Read-only view of one tuple of atom ids, stored elsewhere */
+    class IdSpan {
+        const msys::Id* _ids;
+        unsigned _size;
+    public:
+        IdSpan(const msys::Id* ids, unsigned size)
+        : _ids(ids), _size(size) { }
+
+        unsigned size() const { return _size; }
+        msys::Id operator[](unsigned i) const { return _ids[i]; }
+        const msys::Id* begin() const { return _ids; }
+        const msys::Id* end() const { return _ids + _size; }
+
+        /* Copy into an IdList */
+        msys::IdList list() const { return msys::IdList(begin(), end()); }
+        void copyTo(msys::IdList& list) const { list.assign(begin(), end()); }
+
+        bool operator==(const msys::IdList& other) const {
+            return other.size() == _size
+                && std::equal(begin(), end(), other.begin());
+        }
+    };
+
+    /* Read-only view of a flat array of tuples that all have the same
+     * number of atoms. Iteration yields an IdSpan for each tuple. */
+    class TupleView {
+        const msys::Id* _ids;
+        unsigned _arity;
+        unsigned _size;
+    public:
+        TupleView(const msys::Id* ids, unsigned arity, unsigned size)
+        : _ids(ids), _arity(arity), _size(size) { }
+
+        /* Forward iterator; dereferencing yields an IdSpan by value */
+        class const_iterator {
+            const msys::Id* _ids;
+            unsigned _arity;
+        public:
+            typedef std::forward_iterator_tag iterator_category;
+            typedef IdSpan value_type;
+            typedef std::ptrdiff_t difference_type;
+            typedef void pointer;
+            typedef IdSpan reference;
+
+            const_iterator() : _ids(NULL), _arity(0) { }
+            const_iterator(const msys::Id* ids, unsigned arity)
+            : _ids(ids), _arity(arity) { }
+            IdSpan operator*() const { return IdSpan(_ids, _arity); }
+            const_iterator& operator++() { _ids += _arity; return *this; }
+            const_iterator operator++(int) {
+                const_iterator tmp(*this); _ids += _arity; return tmp; }
+            bool operator==(const const_iterator& o) const {
+                return _ids == o._ids; }
+            bool operator!=(const const_iterator& o) const {
+                return _ids != o._ids; }
+        };
+
+        unsigned arity() const { return _arity; }
+        unsigned size() const { return _size; }
+        bool empty() const { return _size == 0; }
+        IdSpan operator[](unsigned i) const {
+            return IdSpan(_ids + i * _arity, _arity); }
+        const_iterator begin() const {
+            return const_iterator(_ids, _arity); }
+        const_iterator end() const {
+            return const_iterator(_ids + _size * _arity, _arity); }
+
+        /* Copy into one IdList per tuple, for the Python interface and
+         * other callers that need separate lists */
+        std::vector<msys::IdList> lists() const {
+            std::vector<msys::IdList> result;
+            result.reserve(_size);
+            for (unsigned i = 0; i < _size; ++i)
+                result.push_back((*this)[i].list());
+            return result;
+        }
+    };
+
+    /* Flat, contiguous storage for tuples of exactly N atom ids; tuple i
+     * occupies ids [N*i, N*(i+1)). */
+    template <unsigned N>
+    class TupleArray {
+        std::vector<msys::Id> _ids;
+    public:
+        typedef TupleView::const_iterator const_iterator;
+
+        operator TupleView() const {
+            return TupleView(_ids.data(), N, size()); }
+
+        unsigned size() const { return _ids.size() / N; }
+        bool empty() const { return _ids.empty(); }
+        IdSpan operator[](unsigned i) const {
+            return IdSpan(_ids.data() + i * N, N); }
+        const_iterator begin() const {
+            return const_iterator(_ids.data(), N); }
+        const_iterator end() const {
+            return const_iterator(_ids.data() + _ids.size(), N); }
+        std::vector<msys::IdList> lists() const {
+            return TupleView(*this).lists(); }
+
+        void reserve(unsigned n) { _ids.reserve(n * N); }
+        void clear() { _ids.clear(); }
+
+        void push_back(const msys::IdList& tuple) {
+            if (tuple.size() != N)
+                VIPARR_FAIL("Tuple must have " << N << " atoms");
+            _ids.insert(_ids.end(), tuple.begin(), tuple.end());
+        }
+
+        /* Return the index of the first tuple equal to the given one, or
+         * size() if there is none */
+        unsigned find(const msys::IdList& tuple) const {
+            unsigned n = size();
+            for (unsigned i = 0; i < n; ++i)
+                if ((*this)[i] == tuple)
+                    return i;
+            return n;
+        }
+
+        void erase(unsigned i) {
+            _ids.erase(_ids.begin() + i * N, _ids.begin() + (i + 1) * N);
+        }
+    };
+
+}}
+
+#endif
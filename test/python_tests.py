@@ -915,6 +915,99 @@ class TestMain(unittest.TestCase):
         Forcefield.ClearParamTables()
         shutil.rmtree('charmm_copy')
 
+    def testCompiledForcefield(self):
+        import shutil
+        if os.path.isdir('charmm_copy'):
+            shutil.rmtree('charmm_copy')
+        shutil.copytree('test/ff3/charmm27', 'charmm_copy')
+        Forcefield.ClearParamTables()
+        ff = ImportForcefield('charmm_copy')
+        table_print = PrintParams(Forcefield.ParamTable('angle_harm').params)
+        hashes = sorted(tpl.hash for tpl in ff.typer.templates)
+        ncmaps = len(ff.cmap_tables)
+        ExportCompiledForcefield('charmm_copy', 'charmm_copy.vff')
+        self.assertTrue(CompiledForcefieldIsCurrent('charmm_copy.vff',
+            'charmm_copy'))
+        Forcefield.ClearParamTables()
+        ff = ImportCompiledForcefield('charmm_copy.vff', 'charmm_copy')
+        self.assertTrue(PrintParams(Forcefield.ParamTable('angle_harm').params) == table_print)
+        self.assertTrue(sorted(tpl.hash for tpl in ff.typer.templates) == hashes)
+        self.assertTrue(len(ff.cmap_tables) == ncmaps)
+        # Changing the source directory invalidates the compiled file
+        with open('charmm_copy/README', 'w') as fp:
+            fp.write('not read by ImportForcefield\n')
+        self.assertTrue(CompiledForcefieldIsCurrent('charmm_copy.vff',
+            'charmm_copy'))
+        with open('charmm_copy/rules', 'a') as fp:
+            fp.write('\n')
+        self.assertFalse(CompiledForcefieldIsCurrent('charmm_copy.vff',
+            'charmm_copy'))
+        self.assertRaises(RuntimeError, ImportCompiledForcefield,
+                'charmm_copy.vff', 'charmm_copy')
+        Forcefield.ClearParamTables()
+        ff = ImportForcefield('charmm_copy', cache='charmm_copy.vff')
+        self.assertTrue(CompiledForcefieldIsCurrent('charmm_copy.vff',
+            'charmm_copy'))
+        self.assertRaises(ValueError, ImportForcefield, 'charmm_copy',
+                cache='charmm_copy.vff', lazy=True)
+        Forcefield.ClearParamTables()
+        shutil.rmtree('charmm_copy')
+        os.remove('charmm_copy.vff')
+
+    def testLazyImport(self):
+        def run(lazy):
+            Forcefield.ClearParamTables()
+            amber99 = ImportForcefield('test/ff3/amber99', lazy=lazy)
+            tip4p = ImportForcefield('test/ff3/tip4p', lazy=lazy)
+            self.assertTrue(Forcefield.HasParamTable('stretch_harm'))
+            sys = msys.LoadDMS('test/dms/ww.dms', structure_only=True)
+            ExecuteViparr(sys, [amber99, tip4p], atoms=sys.select('water'),
+                    verbose=False)
+            nterms = dict((name, sys.table(name).nterms)
+                    for name in sys.table_names)
+            return nterms, len(amber99.params('stretch_harm'))
+        self.assertTrue(run(True) == run(False))
+
+    def testParallelImport(self):
+        def tables(nthreads):
+            SetThreads(nthreads)
+            try:
+                Forcefield.ClearParamTables()
+                ff = ImportForcefield('test/ff3/charmm27')
+            finally:
+                SetThreads(1)
+            return dict((name, PrintParams(Forcefield.ParamTable(name).params))
+                    for name in Forcefield.AllParamTables()), \
+                    [tpl.hash for tpl in ff.typer.templates]
+        self.assertTrue(tables(4) == tables(1))
+
+    def testForcefieldContext(self):
+        def run(context):
+            amber99 = ImportForcefield('test/ff3/amber99', context=context)
+            tip4p = ImportForcefield('test/ff3/tip4p', context=context)
+            sys = msys.LoadDMS('test/dms/ww.dms', structure_only=True)
+            ExecuteViparr(sys, [amber99, tip4p], atoms=sys.select('water'),
+                    verbose=False)
+            return dict((name, sys.table(name).nterms)
+                    for name in sys.table_names)
+        Forcefield.ClearParamTables()
+        context = ForcefieldContext()
+        nterms = run(context)
+        self.assertTrue(context.hasParamTable('stretch_harm'))
+        self.assertFalse(Forcefield.HasParamTable('stretch_harm'))
+        self.assertTrue(run(None) == nterms)
+        amber99 = ImportForcefield('test/ff3/amber99', context=context)
+        self.assertTrue(amber99.context == context)
+        self.assertTrue(amber99.params('stretch_harm')[0]._ptr
+                == context.paramTable('stretch_harm')._ptr)
+        tip4p = ImportForcefield('test/ff3/tip4p')
+        sys = msys.LoadDMS('test/dms/ww.dms', structure_only=True)
+        with self.assertRaises(RuntimeError):
+            ExecuteViparr(sys, [amber99, tip4p], verbose=False)
+        Forcefield.ClearParamTables()
+        self.assertTrue(context.hasParamTable('stretch_harm'))
+        context.clearParamTables()
+
     def testMerge(self):
         Forcefield.ClearParamTables()
         src = ImportForcefield('test/ff3/charmm27')
@@ -1114,6 +1207,142 @@ class TestMain(unittest.TestCase):
         self.assertTrue(sys.table('constraint_hoh').nterms == len(water_atoms) / 3)
         self.assertTrue(sys.table('constraint_ah2').nterms == nconstraints)
 
+    def testViparrThreads(self):
+        def terms(sys):
+            result = {}
+            for name in sys.table_names:
+                table = sys.table(name)
+                props = table.params.props
+                result[name] = [([a.id for a in t.atoms],
+                    t.param and [t.param[p] for p in props])
+                    for t in table.terms]
+            return result
+        Forcefield.ClearParamTables()
+        amber99 = ImportForcefield('test/ff3/amber99')
+        tip4p = ImportForcefield('test/ff3/tip4p')
+        results = []
+        try:
+            for nthreads in [1, 4]:
+                SetThreads(nthreads)
+                self.assertTrue(GetThreads() == nthreads)
+                sys = msys.LoadDMS('test/dms/ww_solv.dms', structure_only=True)
+                ExecuteViparr(sys, [amber99, tip4p], verbose=False)
+                results.append(terms(sys))
+        finally:
+            SetThreads(1)
+        self.assertTrue(results[0] == results[1])
+
+    def testDedupFragments(self):
+        # dedup_fragments adds the terms of copied fragments after all
+        # others, so terms are compared without regard to their order
+        def terms(sys):
+            result = {}
+            for name in sys.table_names:
+                table = sys.table(name)
+                props = table.params.props
+                result[name] = sorted(([a.id for a in t.atoms],
+                    t.param and [t.param[p] for p in props])
+                    for t in table.terms)
+            result['atoms'] = [(a.charge, a.mass) for a in sys.atoms]
+            return result
+        Forcefield.ClearParamTables()
+        amber99 = ImportForcefield('test/ff3/amber99')
+        tip4p = ImportForcefield('test/ff3/tip4p')
+        results = []
+        for dedup in [False, True]:
+            sys = msys.LoadDMS('test/dms/ww_solv.dms', structure_only=True)
+            ExecuteViparr(sys, [amber99, tip4p], verbose=False,
+                    dedup_fragments=dedup)
+            results.append(terms(sys))
+        self.assertTrue(results[0] == results[1])
+
+    def testIncremental(self):
+        # Term ids are never reused, so a term keeps its id exactly when it
+        # was not reparametrized
+        def terms(sys):
+            result = {}
+            for name in sys.table_names:
+                for t in sys.table(name).terms:
+                    result[(name, t.id)] = ([a.id for a in t.atoms],
+                            t.param and t.param.id)
+            return result
+        # Only the terms touching the atoms of one fragment were replaced
+        def check_retyped(before, after, fragment):
+            self.assertTrue(len(after) == len(before))
+            retyped = 0
+            for key, (atoms, param) in before.items():
+                if fragment.intersection(atoms):
+                    self.assertFalse(key in after)
+                    retyped += 1
+                else:
+                    self.assertTrue(after.get(key) == (atoms, param))
+            self.assertTrue(retyped > 0)
+        Forcefield.ClearParamTables()
+        amber99 = ImportForcefield('test/ff3/amber99')
+        tip4p = ImportForcefield('test/ff3/tip4p')
+        sys = msys.LoadDMS('test/dms/ww_solv.dms', structure_only=True)
+        ExecuteViparr(sys, [amber99, tip4p], verbose=False, incremental=True)
+        self.assertTrue('viparr_fragment_hash' in sys.atom_props)
+        before = terms(sys)
+        waters = sys.select('water and atomicnumber 8')
+        prop = 'viparr_fragment_hash'
+        self.assertTrue(waters[0][prop] == waters[1][prop])
+        # Unchanged system: nothing is reparametrized
+        ExecuteViparr(sys, [amber99, tip4p], verbose=False, incremental=True)
+        self.assertTrue(terms(sys) == before)
+        # A mutated fragment is retyped; all others keep their terms
+        water = set(a.id for a in
+                sys.select('fragid %d' % waters[0].fragid))
+        charge = waters[0].charge
+        waters[0].formal_charge = 1
+        waters[0].charge = 99.0
+        ExecuteViparr(sys, [amber99, tip4p], verbose=False, incremental=True)
+        check_retyped(before, terms(sys), water)
+        self.assertTrue(waters[0].charge == charge)
+        self.assertTrue(waters[0][prop] != waters[1][prop])
+        # A non-incremental run clears the hashes of the fragments it
+        # parametrizes, so the next incremental run parametrizes them again
+        ExecuteViparr(sys, [amber99, tip4p], verbose=False,
+                atoms=sys.select('fragid %d' % waters[1].fragid))
+        self.assertTrue(waters[1][prop] == 0)
+        water = set(a.id for a in
+                sys.select('fragid %d' % waters[1].fragid))
+        before = terms(sys)
+        ExecuteViparr(sys, [amber99, tip4p], verbose=False, incremental=True)
+        check_retyped(before, terms(sys), water)
+        self.assertTrue(waters[1][prop] == waters[2][prop])
+
+    def testGetBondsAnglesDihedrals(self):
+        sys = msys.LoadDMS('test/dms/ww_solv.dms', structure_only=True)
+        full = GetBondsAnglesDihedrals(sys)
+        for sel in ['residue 3', 'water and residue 600', 'none']:
+            new = set(a.id for a in sys.select(sel))
+            touched = GetBondsAnglesDihedrals(sys, list(new))
+            for key in full:
+                expected = [t for t in full[key]
+                        if any(a in new for a in t)]
+                self.assertTrue(touched[key] == expected)
+
+    def testProfile(self):
+        Forcefield.ClearParamTables()
+        amber99 = ImportForcefield('test/ff3/amber99')
+        tip4p = ImportForcefield('test/ff3/tip4p')
+        sys = msys.LoadDMS('test/dms/ww_solv.dms', structure_only=True)
+        SetProfiling(True)
+        ResetProfile()
+        try:
+            ExecuteViparr(sys, [amber99, tip4p], verbose=False)
+        finally:
+            SetProfiling(False)
+        profile = GetProfile()
+        self.assertTrue(profile['timers']['total']['calls'] == 1)
+        self.assertTrue('plugin/bonds' in profile['timers'])
+        self.assertTrue(profile['counters']['fragments'] > 1)
+        self.assertTrue(profile['counters']['terms/stretch_harm']
+                == sys.table('stretch_harm').nterms)
+        ResetProfile()
+        self.assertTrue(GetProfile() == {'timers': {}, 'counters': {}})
+
     def testFixMasses(self):
         Forcefield.ClearParamTables()
         amber99 = ImportForcefield('test/ff3/amber99')
@@ -56,6 +56,7 @@ import msys
 import viparr
 
 import argparse
+import json
 import os
 import shutil
 import subprocess
@@ -157,6 +158,15 @@ def parser():
     parser.add_argument("--verbose-plugins", action="store_true", help="print debug messages from plugin load")
     parser.add_argument("--non-fatal", action="store_true", help="do not exit in error if a required term is unmatched")
     parser.add_argument("--verbose-matching", action="store_true", help="print the template matched by each residue")
+    parser.add_argument("--threads", type=int, default=1,
+                        help="number of threads used for template and parameter matching (Default: 1)")
+    parser.add_argument("--dedup-fragments", action="store_true",
+                        help="parametrize identical fragments once and copy the result")
+    parser.add_argument("--incremental", action="store_true",
+                        help="keep the parameters of fragments unchanged since an earlier --incremental run "
+                        "with the same forcefields, and parametrize only the rest")
+    parser.add_argument("--profile", metavar="OUT_JSON",
+                        help="write per-phase timings and counters to this JSON file")
 
     parser.add_argument("--make-rigid", action="store_true",
                                 help="Replaces constraint_ah1, _ah2, and _ah3 constraints with alternative " \
@@ -164,7 +174,7 @@ def parser():
     return parser
 
 def run_viparr(args):
-    structure_only = True if args.selection == 'all' else False
+    structure_only = True if args.selection == 'all' and not args.incremental else False
     if args.ligand_files and args.ligand_selection=='none':
         raise RuntimeError("Missing --ligand-selection")
     print("Importing structure from %s" % args.input)
@@ -176,6 +186,10 @@ def run_viparr(args):
         return
 
     mol = msys.Load(args.input, structure_only=structure_only)
+    viparr.SetThreads(args.threads)
+    if args.profile:
+        viparr.SetProfiling(True)
+        viparr.ResetProfile()
     ffs = [ff._Forcefield for ff in args.fflist]
     ids = mol.selectIds('(%s) and not (%s)' % (args.selection, args.ligand_selection))
     if not ids:
@@ -188,7 +202,11 @@ def run_viparr(args):
                 args.rename_atoms, args.rename_residues, args.with_constraints,
                 args.fix_masses, not args.non_fatal,
                 compile_plugins, args.verbose_plugins, args.verbose_matching,
-                args.rename_prochiral_atoms)
+                args.rename_prochiral_atoms, args.dedup_fragments, args.incremental)
+        if args.profile:
+            print("Writing profile to %s" % args.profile)
+            with open(args.profile, 'w') as f:
+                json.dump(viparr.GetProfile(), f, indent=2, sort_keys=True)
 
     if args.ligand_files:
         ligands = [msys.Load(f) for f in args.ligand_files]
@@ -214,6 +232,11 @@ def run_viparr(args):
     msys.Save(mol, args.output)
 
 def main():
+    # -d and -f import their forcefields while the arguments are being parsed,
+    # so the thread count has to be in effect before the full parse.
+    threads = argparse.ArgumentParser(add_help=False)
+    threads.add_argument("--threads", type=int, default=1)
+    viparr.SetThreads(threads.parse_known_args()[0].threads)
     args = parser().parse_args()
     run_viparr(args)
 